@@ -25,13 +25,228 @@
  */
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
 
 typedef struct heap_st heap;
 
 /* malloc() and free() */
-void* __attribute((malloc)) heap_alloc(heap*h, uint32_t sz);
+void* __attribute((malloc)) heap_alloc(heap*h, size_t sz);
 void heap_free(heap*h, void*address);
+/* free() of a block whose size is known (the size given when allocating it,
+ * or to heap_realloc()): skips the walk down the bitfields that sizes it */
+void heap_free_sized(heap*h, void*address, size_t size);
 
-/* heap create / destroy */
-heap*heap_create(uint8_t*address, uint32_t size);
+/* calloc(): only clears the parts of the block that may not be zero, see
+ * heap_set_zeroed() */
+void* __attribute((malloc)) heap_calloc(heap*h, size_t nmemb, size_t size);
+
+/* the largest block heap_alloc() can hand out without growing the heap: the
+ * largest free run, read from the bitmap of the non-empty free lists */
+size_t heap_largest_free(heap*h);
+/* allocates a block of min bytes or more, and stores its size in *actual
+ * (0 on failure). min is rounded up to a single nibble (e.g. 0x1230 to
+ * 0x2000); when the best fitting free run is made of chunks of that level,
+ * the whole run is taken: e.g. asking for 4000 bytes from a run of 3 chunks
+ * of 4KB hands out 12KB. */
+void* __attribute((malloc)) heap_alloc_at_least(heap*h, size_t min,
+                                                size_t*actual);
+
+/* allocates up to n blocks of sz bytes with a single lock, returns how many.
+ * Blocks of a single level (e.g. 48 or 512 bytes) are carved by 16 / count
+ * from one chunk of the level above. */
+uint32_t heap_alloc_batch(heap*h, size_t sz, uint32_t n, void**out);
+/* frees n blocks with a single lock. ptrs is sorted by address in place so
+ * that blocks next to each other are merged and coalesced in one pass. */
+void heap_free_batch(heap*h, void**ptrs, uint32_t n);
+
+/* aligned_alloc() and posix_memalign(): alignment is a power of 2. A block is
+ * naturally aligned on its highest size nibble (e.g. 4096 for 0x1230 bytes);
+ * beyond that, the block is carved at the start of a chunk of the alignment's
+ * level and the rest of that chunk goes back to the heap. */
+void* __attribute((malloc)) heap_aligned_alloc(heap*h, size_t alignment,
+                                               size_t sz);
+int heap_posix_memalign(heap*h, void**memptr, size_t alignment, size_t sz);
+
+/* realloc(): grows or shrinks the block in place when possible, copies it
+ * otherwise. With a NULL address, allocates; with a zero size, frees. */
+void*heap_realloc(heap*h, void*address, size_t sz);
+
+/* with HEAP_THREAD_SAFE: gives the blocks cached by the calling thread back to
+ * the heap (done automatically when the thread exits). No-op otherwise. */
+void heap_tcache_flush(heap*h);
+
+/* heap create / destroy. With a NULL address, the heap maps its region
+ * itself. heap_destroy() also unmaps the regions the heap mapped. The address
+ * only needs to be aligned on 16 bytes: a region that isn't aligned on the
+ * highest nibble of its size (e.g. 16MB for 0x1100000 bytes) is managed from
+ * the aligned address below it, as a block that is never handed out. That
+ * costs book-keeping for these bytes, none of the region. */
+heap*heap_create(uint8_t*address, size_t size);
 void heap_destroy(heap *h);
+/* heap_create() allocates the heap's book-keeping (its free lists, about
+ * 1/64th of size for the bitfields and the page maps) with malloc().
+ * heap_create_in() takes it from meta instead, a buffer of
+ * heap_bookkeeping_size_at(address, size) bytes (heap_bookkeeping_size(size)
+ * for an aligned region) aligned on 16 bytes that the heap uses until
+ * heap_destroy(). With a NULL meta, the book-keeping takes the start of the
+ * region: it shows as an allocated block, and the regions added to the heap
+ * keep theirs in them too. Either way, the heap never calls malloc(). Both
+ * sizes are 0 for an invalid size. */
+size_t heap_bookkeeping_size(size_t size);
+/* the same for a region at address, which may not be aligned */
+size_t heap_bookkeeping_size_at(uint8_t const*address, size_t size);
+heap*heap_create_in(uint8_t*address, size_t size, void*meta);
+
+/* with HEAP_SHARED: a heap used by several processes, over a shm_open() or
+ * memfd_create() object that each of them maps at an address of its own,
+ * aligned as for heap_create(). heap_create_shared() keeps the book-keeping at
+ * the start of the mapping, as heap_create_in() does; the free lists hold
+ * offsets and a process-shared mutex guards the heap. heap_attach() returns
+ * the heap created at another mapping of the same object, NULL if there is
+ * none. A block is passed between processes as its offset from the heap. The
+ * heap has a single region, and only its creator calls heap_destroy(), once
+ * no process uses it anymore. Both return NULL without HEAP_SHARED. */
+heap*heap_create_shared(uint8_t*address, size_t size);
+heap*heap_attach(uint8_t*address);
+/* with HEAP_SHARED: a heap kept in the file at path, a shared heap over a
+ * mapping of the file. A new (or empty) file is sized and the heap created;
+ * a file holding a heap is mapped and its heap used as it was, blocks
+ * included, at whatever address it lands (a size of 0 takes the file's).
+ * heap_sync() writes the heap back to the file and returns 0, or -1 if h
+ * isn't kept in a file or the write failed. heap_destroy() syncs and unmaps
+ * the file, which keeps the heap. The file is only consistent after a sync
+ * with no allocation or free since, and must be opened by one process at a
+ * time; the others can heap_attach() their own mapping of it. heap_set_root()
+ * records a block to find the others from after a reopen, heap_get_root()
+ * returns it (NULL if none, or without HEAP_SHARED). */
+heap*heap_create_persistent(char const*path, size_t size);
+int heap_sync(heap*h);
+void heap_set_root(heap*h, void*p);
+void*heap_get_root(heap*h);
+
+/* adds a region to the heap, with the same size and alignment rules as
+ * heap_create(). Each region has its own bitfields and free lists; allocations
+ * go to the region with the best fit. Returns 0, or -1 if the region can't be
+ * used. */
+int heap_add_region(heap*h, uint8_t*address, size_t size);
+/* free runs of min_size bytes and more (64KB at least) are given back to the
+ * OS, but for the page holding their links, and fault back in when handed
+ * out. flags: HEAP_RELEASE_DEFERRED to only release them in heap_trim(),
+ * HEAP_RELEASE_LAZY to use MADV_FREE instead of MADV_DONTNEED. A min_size of
+ * 0 disables it (the default). The pages of a shared heap are punched out of
+ * its object with MADV_REMOVE instead: none are released if the object can't
+ * have holes. Returns 0, or -1 if the pages are larger than 4KB. */
+#define HEAP_RELEASE_DEFERRED 1U
+#define HEAP_RELEASE_LAZY 2U
+int heap_set_release(heap*h, size_t min_size, uint32_t flags);
+/* which free chunk an allocation takes among those of the size it needs:
+ * HEAP_POLICY_LIFO (the default) the last one freed, HEAP_POLICY_ADDRESS the
+ * one at the lowest address, which keeps the blocks packed at the bottom of
+ * the regions. The latter reads the bitfields for it, a bounded number of
+ * words per allocation. Returns 0, or -1 for an unknown policy or a
+ * HEAP_STRIPED heap other than HEAP_POLICY_LIFO. */
+#define HEAP_POLICY_LIFO 0U
+#define HEAP_POLICY_ADDRESS 1U
+int heap_set_policy(heap*h, uint32_t policy);
+/* relocatable blocks, which heap_compact() may move. heap_halloc() returns
+ * the handle of a new block, 0 if out of memory. heap_hlock() returns the
+ * block's address, which stays valid until the matching heap_hunlock(): a
+ * block locked once or more doesn't move. heap_hfree() frees it, unless it's
+ * locked.
+ * heap_compact() moves the unlocked blocks that keep a chunk from merging
+ * with free ones next to it, to lower free chunks out of it. It moves budget
+ * bytes at most, and returns the bytes it moved: 0 once there is nothing left
+ * to move. Handles aren't available with HEAP_STRIPED. */
+typedef uint32_t heap_handle;
+heap_handle heap_halloc(heap*h, size_t size);
+void*heap_hlock(heap*h, heap_handle hd);
+void heap_hunlock(heap*h, heap_handle hd);
+void heap_hfree(heap*h, heap_handle hd);
+size_t heap_compact(heap*h, size_t budget);
+/* gives the free runs of the release size back to the OS now. Returns the
+ * number of bytes released. */
+size_t heap_trim(heap*h);
+/* bytes given back to the OS (and not handed out since), and the rest of the
+ * heap's regions */
+void heap_get_release_stats(heap*h, size_t*resident, size_t*released);
+
+/* occupancy of all the heap's regions. Blocks held by the thread caches
+ * count as allocated. free_runs[lvl * 15 + n - 1] is the number of free runs
+ * of n chunks of 16 << (4 * lvl) bytes. The block counters are kept by the
+ * alloc and free paths: they read as 0 in MAX_PERF builds, unless built with
+ * HEAP_STATS. */
+#define HEAP_STATS_CLASSES 120 /* 15 sizes for each of 8 levels at most */
+typedef struct {
+   size_t size;          /* bytes of all the regions */
+   size_t allocated;     /* bytes in allocated blocks */
+   size_t free;          /* bytes in free runs */
+   size_t largest_free;  /* largest free run: no larger block can be had */
+   size_t released;      /* free bytes given back to the OS */
+   uint64_t allocs;      /* blocks allocated so far */
+   uint64_t frees;       /* blocks freed so far */
+   uint64_t live_blocks; /* allocs - frees */
+   double fragmentation; /* 1 - largest_free / free, 0 when nothing's free */
+   uint32_t free_runs[HEAP_STATS_CLASSES];
+} heap_stats;
+void heap_get_stats(heap*h, heap_stats*stats);
+
+/* calls cb for every block of the heap's regions in address order, allocated
+ * (used != 0) or free, until it returns non-zero. The heap is locked during
+ * the walk: cb mustn't call the heap. Returns what cb last returned. */
+typedef int (*heap_walk_cb)(void*ctx, void*address, size_t size, int used);
+int heap_walk(heap*h, heap_walk_cb cb, void*ctx);
+/* writes the occupancy of the heap, one cell per chunk of 16 << (4 * lvl)
+ * bytes: in ASCII, 64 cells per line ('.' free, '#' allocated, a digit when
+ * partly allocated), or in CSV, one line per cell with its allocated bytes.
+ * Returns 0, or -1 for an invalid lvl or format. */
+#define HEAP_MAP_ASCII 0U
+#define HEAP_MAP_CSV 1U
+int heap_dump_map(heap*h, FILE*out, uint32_t lvl, uint32_t format);
+
+/* with HEAP_TRACE: every allocation and free of the heap is appended to a
+ * trace file, see heap-replay. A record is a heap_trace_rec: the time in ns
+ * since the trace started, the block's address as its id (0 for a failed
+ * allocation) and its size, op and thread packed in info. A block moved by
+ * heap_realloc() shows as an alloc and a free, one resized in place as a
+ * realloc. The file starts with a record whose id is HEAP_TRACE_MAGIC.
+ * Start and stop the trace while no other thread uses the heap.
+ * heap_trace_start() returns 0, or -1 if the file can't be created or the
+ * heap is built without HEAP_TRACE. */
+#define HEAP_TRACE_MAGIC 0x3154434DU /* "MCT1" */
+#define HEAP_TRACE_ALLOC 1U
+#define HEAP_TRACE_FREE 2U
+#define HEAP_TRACE_REALLOC 3U
+typedef struct {
+   uint64_t time;
+   uint64_t id;
+   uint64_t info;
+} heap_trace_rec;
+#define HEAP_TRACE_INFO(op, thread, size) \
+   ((uint64_t)(size) | (uint64_t)((thread) & 0xFFFU) << 48 | (uint64_t)(op) << 60)
+#define HEAP_TRACE_SIZE(info) ((size_t)((info) & 0xFFFFFFFFFFFFU))
+#define HEAP_TRACE_THREAD(info) ((uint32_t)((info) >> 48) & 0xFFFU)
+#define HEAP_TRACE_OP(info) ((uint32_t)((info) >> 60))
+int heap_trace_start(heap*h, char const*path);
+void heap_trace_stop(heap*h);
+
+/* once out of memory, the heap maps and adds regions of region_size bytes (or
+ * more for larger blocks). 0 disables it (the default). To be called right
+ * after heap_create(). */
+void heap_set_growth(heap*h, size_t region_size);
+
+/* the memory given to heap_create() reads as zero (e.g. fresh from mmap):
+ * heap_calloc() won't clear it until it has been handed out. To be called
+ * right after heap_create(). */
+void heap_set_zeroed(heap*h);
+
+/* with HEAP_ARENAS: the region is split in count heaps of equal size. Each
+ * thread allocates from its own heap; a block freed by another thread is
+ * handed back to the owner without locking and freed at its next alloc.
+ * Threads beyond count share a locked heap, mapped on first use, until an
+ * arena is released by a thread exit. */
+typedef struct heap_arenas_st heap_arenas;
+heap_arenas*heap_arenas_create(uint8_t*address, size_t size, uint32_t count);
+void heap_arenas_destroy(heap_arenas*a);
+void* __attribute((malloc)) heap_arenas_alloc(heap_arenas*a, size_t sz);
+void heap_arenas_free(heap_arenas*a, void*address);
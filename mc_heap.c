@@ -30,13 +30,35 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HEAP_ARENAS
+#include <stdatomic.h>
+#endif
+#ifdef HEAP_TRACE
+#include <fcntl.h>
+#include <time.h>
+#endif
 
+typedef uint64_t U64;
 typedef uint32_t U32;
 typedef uint16_t U16;
 typedef uint8_t  U8 ;
+/* native word: heap sizes, relative addresses and chunk indexes */
+typedef size_t   USZ;
 
-#define PRINTF(...) printf(__VA_ARGS__)
+#ifndef PRINTF
+   #define PRINTF(...) printf(__VA_ARGS__)
+#endif
+/* the book-keeping of the heaps and of their regions */
+#ifndef HEAP_META_ALLOC
+   #define HEAP_META_ALLOC(sz) malloc(sz)
+   #define HEAP_META_FREE(p, sz) free(p)
+#endif
 
 #ifdef MAX_PERF
    #define ASSERT(x)  { }
@@ -45,27 +67,158 @@ typedef uint8_t  U8 ;
    #define DEBUG_BUILD
 #endif
 
-#define BASE_SIZES_COUNT (105)
-#define BASE_SIZE_MAX (0xF0000000U)
-#define BASE_SIZE_MIN (0x00000010U)
+/* block counters of heap_get_stats(), a plain add in the alloc and free paths
+ * (a relaxed atomic one with HEAP_STRIPED, which has no global lock) */
+#if !defined(MAX_PERF) && !defined(HEAP_STATS)
+   #define HEAP_STATS
+#endif
+#ifdef HEAP_STATS
+   #ifdef HEAP_STRIPED
+      #define STAT_ADD(h, f, n) __atomic_fetch_add(&(h)->f, (n), __ATOMIC_RELAXED)
+   #else
+      #define STAT_ADD(h, f, n) ((h)->f += (n))
+   #endif
+#else
+   #define STAT_ADD(h, f, n) { }
+#endif
+
+/* a chunk of level L is cut in 16 chunks of level L - 1, down to
+ * BASE_SIZE_MIN bytes at level 0, and a block is made of up to 15 chunks of
+ * each level: one 32 bit word of the bitfields holds the 2 bit entries of
+ * the 16 children of a chunk, and a free chunk holds 2 links. */
+#define BASE_SIZE_MIN 16U
+_Static_assert(BASE_SIZE_MIN >= 2 * sizeof(void*), "a free chunk holds 2 links");
+/* levels: 7 (16B up to 256MB chunks) on 32 bit targets, one more level (4GB
+ * chunks) on 64 bit targets so a single heap can span up to 64GB. Fewer
+ * levels cap the heap size, but shorten the walks down the bitfields from
+ * the top level and the heads[] lists. */
+#ifndef HEAP_LEVELS
+   #if SIZE_MAX > 0xFFFFFFFFU
+      #define HEAP_LEVELS 8U
+   #else
+      #define HEAP_LEVELS 7U
+   #endif
+#endif
+#define LEVEL_SHIFT(lvl) (((lvl) + 1) << 2)
+_Static_assert(HEAP_LEVELS >= 3 && LEVEL_SHIFT(HEAP_LEVELS) < 8 * sizeof(size_t),
+               "HEAP_LEVELS out of range");
+#define MAIN_BASE_SIZE_COUNT HEAP_LEVELS
+#define BASE_SIZES_COUNT (15 * HEAP_LEVELS)
+#define BASE_SIZE_MAX ((USZ)15 << LEVEL_SHIFT(HEAP_LEVELS - 1))
+#define HEAP_SIZE_MAX (((USZ)1 << LEVEL_SHIFT(HEAP_LEVELS)) - BASE_SIZE_MIN)
+
+#define USZ_BITS (sizeof(USZ) << 3)
+#define NIBBLE_MASK (USZ_BITS - 4U)
+#define USZ_ALL_ONES (~(USZ)0)
 
 #define CLZ(x) __builtin_clz(x)
 #define CTZ(x) __builtin_ctz(x)
+#define CLZW(x) __builtin_clzl(x)
+#define CTZW(x) __builtin_ctzl(x)
+_Static_assert(sizeof(long) == sizeof(USZ), "FIXME");
 
-#define MAIN_BASE_SIZE_COUNT 7U
-
+#define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#ifdef HEAP_SLAB
+   /* objects of up to HEAP_SLAB_MAX_SIZE bytes are carved by steps of
+    * SLAB_STEP bytes from slabs: chunks of level HEAP_ZERO_LEVEL (4KB) */
+   #ifdef HEAP_STRIPED
+      #error "HEAP_SLAB needs the heap lock: it can't be combined with HEAP_STRIPED"
+   #endif
+   #define HEAP_SLAB_MAX_SIZE 256U
+   #define SLAB_STEP 8U
+   #define SLAB_CLASSES (HEAP_SLAB_MAX_SIZE / SLAB_STEP)
+   /* the thread caches hold slab objects as well */
+   #define SMALL_STEP SLAB_STEP
+   #define SMALL_MAX_SIZE HEAP_SLAB_MAX_SIZE
+#else
+   #define SMALL_STEP BASE_SIZE_MIN
+   #define SMALL_MAX_SIZE 256U
+#endif
+#define SMALL_ROUND(sz) (((sz) + SMALL_STEP - 1) & ~(USZ)(SMALL_STEP - 1))
+
+#ifdef HEAP_THREAD_SAFE
+   /* each thread keeps up to HEAP_TCACHE_DEPTH allocated blocks per base size
+    * up to HEAP_TCACHE_MAX_SIZE bytes, and refills / flushes them
+    * HEAP_TCACHE_BATCH at a time with the heap locked */
+   #ifndef HEAP_TCACHE_DEPTH
+      #define HEAP_TCACHE_DEPTH 32U
+   #endif
+   #ifndef HEAP_TCACHE_BATCH
+      #define HEAP_TCACHE_BATCH (HEAP_TCACHE_DEPTH >> 1)
+   #endif
+   _Static_assert(0 < HEAP_TCACHE_BATCH && HEAP_TCACHE_BATCH <= HEAP_TCACHE_DEPTH,
+                  "HEAP_TCACHE_BATCH must be within 1..HEAP_TCACHE_DEPTH");
+   #define HEAP_TCACHE_MAX_SIZE SMALL_MAX_SIZE
+   #define HEAP_TCACHE_CLASSES (HEAP_TCACHE_MAX_SIZE / SMALL_STEP)
+#endif
+
+/* heap_calloc knows which chunks of level HEAP_ZERO_LEVEL (2: 4KB) still
+ * read as zero since the heap was created */
+#ifndef HEAP_ZERO_LEVEL
+   #define HEAP_ZERO_LEVEL 2U
+#endif
+#define ZERO_SHIFT ((HEAP_ZERO_LEVEL + 1) << 2)
+/* with HEAP_POLICY_ADDRESS, an allocation reads at most that many bitfield
+ * words of a level for the lowest free chunk of its size */
+#ifndef HEAP_POLICY_SCAN
+   #define HEAP_POLICY_SCAN 16U
+#endif
+/* heap_compact(): the lowest chunk of all the sizes that fit, not the best fit */
+#define POLICY_LOWEST 2U
+/* free runs are given back to the OS by chunks of that level (pages), from
+ * level 3 (64KB) up: a run keeps its first page for its links */
+#define RELEASE_LEVEL_MIN (HEAP_ZERO_LEVEL + 1)
+#define RELEASE_OFF MAIN_BASE_SIZE_COUNT
+#ifndef MADV_FREE
+   #define MADV_FREE MADV_DONTNEED
+#endif
+/* the maps with one bit per chunk of level HEAP_ZERO_LEVEL, after the
+ * bitfields: zmap, rmap (and smap) */
+#ifdef HEAP_SLAB
+   #define ZERO_MAPS 3U
+#else
+   #define ZERO_MAPS 2U
+#endif
+
+#ifdef HEAP_STRIPED
+   #ifdef HEAP_THREAD_SAFE
+      #error "HEAP_STRIPED and HEAP_THREAD_SAFE cannot be combined"
+   #endif
+   /* the chunks of level HEAP_STRIPE_LEVEL (4: 1MB) are guarded by
+    * HEAP_STRIPE_LOCKS locks, the levels above by a single one, and each
+    * heads[] list by its own lock */
+   #ifndef HEAP_STRIPE_LEVEL
+      #define HEAP_STRIPE_LEVEL 4U
+   #endif
+   #ifndef HEAP_STRIPE_LOCKS
+      #define HEAP_STRIPE_LOCKS 64U
+   #endif
+   _Static_assert(0 == (HEAP_STRIPE_LOCKS & (HEAP_STRIPE_LOCKS - 1)),
+                  "HEAP_STRIPE_LOCKS must be a power of 2");
+#endif
+
+#ifdef HEAP_SHARED
+   /* the thread caches, the regions lists of the arenas and the slabs, and
+    * the traces are private to a process */
+   #if defined(HEAP_THREAD_SAFE) || defined(HEAP_STRIPED) || \
+       defined(HEAP_ARENAS) || defined(HEAP_SLAB) || defined(HEAP_TRACE)
+      #error "HEAP_SHARED cannot be combined with other modes"
+   #endif
+   #define HEAP_SHARED_MAGIC 0x5248434DU /* "MCHR" */
+#endif
+
 /* -------------------------------------------------------------------------- */
 #ifndef MAX_PERF
-static const bool is_base_size(U32 const size)
+static const bool is_base_size(USZ const size)
 {
-   U32 const clz = CLZ(size) & 0x1CU;
-   return ((0xF0000000U >> clz) & size) == size;
+   U32 const clz = CLZW(size) & NIBBLE_MASK;
+   return ((~(USZ_ALL_ONES >> 4) >> clz) & size) == size;
 }
 #endif
 /* -------------------------------------------------------------------------- */
-static const U32 closest_base_size(U32 const from)
+static const USZ closest_base_size(USZ const from)
 {
    if (unlikely(from < BASE_SIZE_MIN)) {
       return BASE_SIZE_MIN;
@@ -74,27 +227,26 @@ static const U32 closest_base_size(U32 const from)
       return 0;
    }
    ASSERT(0 != from);
-   U32 const clz = CLZ(from) & 0x1CU;
-   ASSERT(clz < 28);
-   U32 const lsbits = 0x0FFFFFFFU >> clz;
+   U32 const clz = CLZW(from) & NIBBLE_MASK;
+   ASSERT(clz < NIBBLE_MASK);
+   USZ const lsbits = (USZ_ALL_ONES >> 4) >> clz;
    return ((from + lsbits) & ~lsbits);
 }
 /* -------------------------------------------------------------------------- */
-static const U32 base_size_to_index(U32 const size)
+static const U32 base_size_to_index(USZ const size)
 {
    ASSERT(0 != size);
    ASSERT(is_base_size(size));
-   U32 const ctz = CTZ(size) & 0x1CU;
-   U32 const tmp = (ctz >> 2);
-   return (tmp << 4) - tmp + (size >> ctz) - 16;
+   U32 const ctz = CTZW(size) & NIBBLE_MASK;
+   U32 const lvl = (ctz >> 2) - 1;
+   return (lvl << 4) - lvl + (U32)(size >> ctz) - 1;
 }
 /* -------------------------------------------------------------------------- */
-static const U32 base_size_from_index(U32 const index)
+static const USZ base_size_from_index(U32 const index)
 {
    ASSERT(index < BASE_SIZES_COUNT);
-   U32 const index_div15 = ((index << 7) + (index << 3) + index) >> 11; 
-   U32 const index_rem15 = index - ((index_div15 << 4) - index_div15);
-   return (index_rem15 + 1) << ((index_div15 + 1) << 2);
+   U32 const lvl = index / 15;
+   return (USZ)(index - ((lvl << 4) - lvl) + 1) << LEVEL_SHIFT(lvl);
 }
 /* -------------------------------------------------------------------------- */
 typedef enum {
@@ -110,49 +262,148 @@ typedef enum {
 #define ALL_FREE  0xAAAAAAAAU
 #define ALL_ALLOC 0x00000000U
 
+#ifdef HEAP_SHARED
+   /* processes map a shared heap at different addresses: the pointers of a
+    * heap_st are offsets from it, and the free lists link chunks by their
+    * offset in the region (plus one, 0 is NULL) */
+   #define HEAP_PTR(type) USZ
+   #define HEAP_GET(h, f) ((void*)((USZ)(h) + (h)->f))
+   #define HEAP_SET(h, f, p) ((h)->f = (USZ)(p) - (USZ)(h))
+   typedef USZ chunk_link;
+   #define LINK(h, l) ((chunk*)(0 == (l) ? NULL : HDATA(h) + (l) - 1))
+   #define LINK_OF(h, c) (NULL == (c) ? 0 : (USZ)((U8 const*)(c) - HDATA(h)) + 1)
+#else
+   #define HEAP_PTR(type) type*
+   #define HEAP_GET(h, f) ((h)->f)
+   #define HEAP_SET(h, f, p) ((h)->f = (p))
+   typedef struct _chunk*chunk_link;
+   #define LINK(h, l) (l)
+   #define LINK_OF(h, c) ((chunk*)(c))
+#endif
+#define HDATA(h) ((U8*)HEAP_GET(h, hdata))
+#define BITFIELD(h, lvl) ((U32*)HEAP_GET(h, bitfield[lvl]))
+#define ZMAP(h) ((U32*)HEAP_GET(h, zmap))
+#define RMAP(h) ((U32*)HEAP_GET(h, rmap))
+
 typedef struct _chunk {
-   struct _chunk *prev;
-   struct _chunk *next;
+   chunk_link prev;
+   chunk_link next;
 } chunk;
 _Static_assert(sizeof(chunk) <= 16, "FIXME");
 
-#define HEADS_BITS_SIZE (((BASE_SIZES_COUNT + 31) >> 5))
+/* an entry of the handles table, see heap_halloc() */
+typedef struct _hentry {
+   USZ off;    /* the block, relative to the heap's first region */
+   USZ size;   /* its size, 0 if the entry is free */
+   U32 locks;  /* heap_hlock() count: it can't move while not 0 */
+   U32 next;   /* free entries: the next one + 1, 0 if none */
+} hentry;
+
+/* one bit per base size, MSB first, in native words. The bits following
+ * index BASE_SIZES_COUNT - 1 are always set and act as a sentinel. */
+#define HEADS_BITS_SIZE (((BASE_SIZES_COUNT + USZ_BITS - 1) / USZ_BITS))
+#define HEADS_BITS_MSB (~(USZ_ALL_ONES >> 1))
+#ifdef HEAP_STRIPED
+   /* headsbits words are shared by lists with different locks */
+   #define HEADS_BITS_LOAD(h, i) __atomic_load_n(&(h)->headsbits[i], __ATOMIC_RELAXED)
+#else
+   #define HEADS_BITS_LOAD(h, i) ((h)->headsbits[i])
+#endif
+#if defined(HEAP_THREAD_SAFE) || defined(HEAP_STRIPED)
+   /* heap_free() sizes blocks without the lock, and the stripes write the
+    * words of different levels under different locks: the bitfield words
+    * are read and written whole */
+   #define BF_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+   #define BF_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+   #define BF_LOAD(p) (*(p))
+   #define BF_STORE(p, v) (*(p) = (v))
+#endif
+/* where the book-keeping of a region lives */
+#define META_ALLOC 0U  /* HEAP_META_ALLOC()'ed by heap_create() */
+#define META_CALLER 1U /* the buffer given to heap_create_in() */
+#define META_REGION 2U /* the start of the region, see heap_create_in() */
 struct heap_st {
-   U32 headsbits[HEADS_BITS_SIZE];
-   U32*bitfield[MAIN_BASE_SIZE_COUNT];
-   U8 *hdata;
-   U32 hsize;
+   USZ headsbits[HEADS_BITS_SIZE];
+   HEAP_PTR(U32) bitfield[MAIN_BASE_SIZE_COUNT];
+   HEAP_PTR(U8) hdata;
+   USZ hsize;
+   USZ hoff;  /* the region starts hoff bytes above hdata, see heap_create() */
    U32 hdcnt;
    U32 bscnt;
-   chunk*heads[0];
+   HEAP_PTR(U32) zmap; /* one bit per chunk of level HEAP_ZERO_LEVEL: may not be zero */
+   HEAP_PTR(U32) rmap; /* one bit per chunk of level HEAP_ZERO_LEVEL: given back to the OS */
+   USZ released;        /* bytes set in rmap */
+   U32 rel_lvl;         /* free runs of that level and above are given back */
+   U32 rel_flags;       /* HEAP_RELEASE_* */
+   struct heap_st*next; /* next region, see heap_add_region() */
+   USZ grow;            /* size of the regions mapped when out of memory */
+   bool mapped;         /* hdata was mapped by the heap, and is unmapped with it */
+   bool anon;           /* private anonymous hdata: released pages read as zero */
+   U8 meta;             /* META_*: where this heap_st and its bitfields live */
+   U8 policy;           /* HEAP_POLICY_*, see heap_set_policy() */
+   HEAP_PTR(hentry) htab; /* the handles, a block of the heap */
+   U32 hcount;          /* entries in htab */
+   U32 hfree;           /* first free entry + 1, 0 if none */
+   U32 hnext;           /* the entry heap_compact() goes on from */
+   /* HEAP_POLICY_ADDRESS: no chunk of heads[i] is in a bitfield word of its
+    * level below lowest[i] */
+   USZ lowest[BASE_SIZES_COUNT];
+#ifdef HEAP_TRACE
+   struct _trace*trace; /* see heap_trace_start() */
+#endif
+#ifdef HEAP_SLAB
+   U32*smap;            /* one bit per chunk of level HEAP_ZERO_LEVEL: a slab */
+   struct _slab*slabs[SLAB_CLASSES]; /* the slabs with free objects */
+#endif
+#ifdef HEAP_STATS
+   uint64_t allocs;     /* blocks handed out by this region */
+   uint64_t frees;      /* and given back */
+#endif
+#if defined(HEAP_THREAD_SAFE) || defined(HEAP_SHARED)
+   pthread_mutex_t lock;
+#endif
+#ifdef HEAP_THREAD_SAFE
+   struct _tcache*tcaches; /* thread caches currently bound to this heap */
+#endif
+#ifdef HEAP_SHARED
+   U32 magic;              /* HEAP_SHARED_MAGIC once heap_attach() can use it */
+   bool file;              /* mapped from a file, see heap_create_persistent() */
+   USZ root;               /* heap_set_root(), an offset as the links are */
+#endif
+#ifdef HEAP_STRIPED
+   pthread_mutex_t upper;                      /* levels >= HEAP_STRIPE_LEVEL */
+   pthread_mutex_t stripes[HEAP_STRIPE_LOCKS]; /* levels below, by chunk */
+   pthread_mutex_t classes[BASE_SIZES_COUNT];  /* heads[] lists */
+   pthread_mutex_t regions;                    /* adding a region */
+#endif
+   chunk_link heads[0];
 };
-static U32 next_available_head_index(heap*const h, U32 const size)
+static U32 next_available_head_index(heap*const h, USZ const size)
 {
-   U32 const next_size = closest_base_size(size);
+   USZ const next_size = closest_base_size(size);
    if (unlikely(0 == next_size)) {
       return BASE_SIZES_COUNT;
    }
    U32 const index = base_size_to_index(next_size);
-   U32 const start_idx = index >> 5;
-   U32 x = h->headsbits[start_idx] << (index & 0x1FU);
-   if (0 == x) {
-      U32 const idx = start_idx << 5;
-      ASSERT(start_idx <= 2);
-      x = h->headsbits[start_idx + 1];
-      if (0 == x) {
-         ASSERT(start_idx <= 1);
-         x = h->headsbits[start_idx + 2];
-         if (0 == x) {
-            ASSERT(0 == start_idx);
-            x = h->headsbits[start_idx + 3];
-            ASSERT(0 != x);
-            return idx + 96 + CLZ(x);
-         }
-         return idx + 64 + CLZ(x);
-      }
-      return idx + 32 + CLZ(x);
+   U32 w = index / USZ_BITS;
+   USZ x = HEADS_BITS_LOAD(h, w) << (index & (USZ_BITS - 1));
+   if (likely(0 != x)) {
+      return index + CLZW(x);
+   }
+   /* the last word always has its sentinel bits */
+   while (0 == x && w < HEADS_BITS_SIZE - 1) {
+      x = HEADS_BITS_LOAD(h, ++w);
    }
-   return index + CLZ(x);
+   ASSERT(0 != x);
+   return w * USZ_BITS + CLZW(x);
+}
+/* -------------------------------------------------------------------------- */
+/* chunk size of the highest level in use: or'ed with a relative address, it
+ * caps the level a walk down the bitfields starts from */
+static inline USZ top_level_size(heap const*const h)
+{
+   return (USZ)1 << (h->bscnt << 2);
 }
 /* -------------------------------------------------------------------------- */
 static inline U32 count_leading_allocs(U32 const bits)
@@ -160,31 +411,116 @@ static inline U32 count_leading_allocs(U32 const bits)
    return CLZ(bits) >> 1;
 }
 /* -------------------------------------------------------------------------- */
-static eChunkStatus chunk_get_status(U32 const*const bf, U32 const idx)
+static eChunkStatus chunk_get_status(U32 const*const bf, USZ const idx)
 {
    U32 const sub = ~idx & 15u;
-   return (bf[idx >> 4] >> (sub << 1)) & 0x03U;
+   return (BF_LOAD(&bf[idx >> 4]) >> (sub << 1)) & 0x03U;
+}
+/* -------------------------------------------------------------------------- */
+/* whether the chunk idx of level lvl heads a block: the padding past the end of
+ * a level reads ALLOC_HEAD too, and its first chunk may well be the parent of
+ * the heap's last, smaller chunks */
+static inline bool chunk_is_head(heap const*const h, U32 const lvl,
+                                 USZ const idx)
+{
+   return idx < (h->hsize >> ((lvl + 1) << 2)) &&
+          eSTATUS_ALLOC_HEAD == chunk_get_status(BITFIELD(h, lvl), idx);
+}
+/* -------------------------------------------------------------------------- */
+/* regions are only ever appended, and read without lock */
+static inline heap*region_next(heap const*const r)
+{
+   return __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+}
+/* -------------------------------------------------------------------------- */
+static inline bool region_has(heap const*const r, void const*const p)
+{
+   return (USZ)((U8 const*)p - HDATA(r) - r->hoff) < r->hsize - r->hoff;
+}
+/* -------------------------------------------------------------------------- */
+/* the region holding p, h itself if none does (the error is reported there) */
+static heap*region_of(heap const*const h, void const*const p)
+{
+   if (likely(region_has(h, p))) {
+      return (heap*)h;
+   }
+   for (heap*r = region_next(h); NULL != r; r = region_next(r)) {
+      if (region_has(r, p)) {
+         return r;
+      }
+   }
+   return (heap*)h;
+}
+/* -------------------------------------------------------------------------- */
+#ifdef HEAP_SLAB
+/* a slab: a chunk of level HEAP_ZERO_LEVEL cut in count objects of size
+ * bytes, after its header. Its bit is set in the region's smap, and it is
+ * listed in slabs[] while it has free objects. */
+#define SLAB_SIZE ((USZ)1 << ZERO_SHIFT)
+#define SLAB_WORDS (SLAB_SIZE / SLAB_STEP / 32)
+typedef struct _slab {
+   struct _slab*prev;
+   struct _slab*next;
+   U32 size;
+   U32 count;
+   U32 used;
+   U32 hint;             /* the words of free[] below are all zero */
+   U32 free[SLAB_WORDS]; /* one bit per free object */
+} slab;
+#define SLAB_HEADER ((sizeof(slab) + 15) & ~(USZ)15)
+/* -------------------------------------------------------------------------- */
+/* the slab of region r holding p, if any */
+static inline slab*slab_of(heap const*const r, void const*const p)
+{
+   if (!region_has(r, p)) {
+      return NULL;
+   }
+   USZ const z = ((U8 const*)p - HDATA(r)) >> ZERO_SHIFT;
+   if (0 == (__atomic_load_n(&r->smap[z >> 5], __ATOMIC_RELAXED) & (1U << (z & 31)))) {
+      return NULL;
+   }
+   return (slab*)(HDATA(r) + (z << ZERO_SHIFT));
 }
 /* -------------------------------------------------------------------------- */
+/* index of the object at p, count if p isn't one */
+static inline U32 slab_index(slab const*const s, void const*const p)
+{
+   USZ const off = (U8 const*)p - (U8 const*)s;
+   if (unlikely(off < SLAB_HEADER || 0 != (off - SLAB_HEADER) % s->size)) {
+      return s->count;
+   }
+   U32 const i = (off - SLAB_HEADER) / s->size;
+   return i < s->count ? i : s->count;
+}
+#endif
+/* -------------------------------------------------------------------------- */
 /* function to grab the number of bytes available from a given pointer
  * provided it's from within a heap allocated buffer */
-static U32 heap_get_alloc_size(heap const*const h, void const*const p)
+static USZ heap_get_alloc_size(heap const*h, void const*const p)
 {
+   h = region_of(h, p);
+#ifdef HEAP_SLAB
+   slab const*const s = slab_of(h, p);
+   if (NULL != s) {
+      return slab_index(s, p) < s->count ? s->size : 0;
+   }
+#endif
    U8 const*const a = (__typeof(a))p;
-   U32 const A = (__typeof(A))a;
-   U8*const base = h->hdata;
-   if (unlikely(a < base || a >= base + h->hsize || 0 != (A & 0x0FU))) {
+   USZ const A = (__typeof(A))a;
+   U8*const base = HDATA(h);
+   if (unlikely(a < base + h->hoff || a >= base + h->hsize ||
+                0 != (A & 0x0FU))) {
       return 0;
    }
-   U32 const reladdr = a - base;
-   ASSERT(0 != A);
-   U32 const ctz = CTZ(A);
+   USZ const reladdr = a - base;
+   U32 const ctz = CTZW(reladdr | top_level_size(h));
    ASSERT(ctz >= 4);
    U32 lvl = (ctz >> 2) - 1;
-   U32 shift = (lvl + 1) << 2, idx;
+   U32 shift = (lvl + 1) << 2;
+   USZ idx;
    for ( ;; --lvl, shift -= 4) {
       idx = reladdr >> shift;
-      if (eSTATUS_ALLOC_HEAD == chunk_get_status(h->bitfield[lvl], idx)) {
+      if (chunk_is_head(h, lvl, idx)) {
          break;
       }
       if (unlikely(0 == lvl)) {
@@ -194,26 +530,26 @@ static U32 heap_get_alloc_size(heap const*const h, void const*const p)
    }
    U32 const sub = idx & 0x0FU;
    if (unlikely(15 == sub)) {
-      return 1 << shift;
+      return (USZ)1 << shift;
    }
-   U32 const bits = h->bitfield[lvl][idx >> 4] << ((sub + 1) << 1);
+   U32 const bits = BF_LOAD(&BITFIELD(h, lvl)[idx >> 4]) << ((sub + 1) << 1);
    if (unlikely(0 == bits)) {
-      return (16 - sub) << shift;
+      return (USZ)(16 - sub) << shift;
    }
    U32 allocs = count_leading_allocs(bits) + 1;
    ASSERT(sub + allocs < 16);
 
-   U32 size = allocs << shift;
+   USZ size = (USZ)allocs << shift;
 
-   while (eSTATUS_SPLIT == chunk_get_status(h->bitfield[lvl], idx + allocs)) {
+   while (eSTATUS_SPLIT == chunk_get_status(BITFIELD(h, lvl), idx + allocs)) {
       ASSERT(0 != lvl && shift >= 4);
       lvl -= 1;
       shift -= 4;
       idx = (reladdr + size) >> shift;
-      U32 const bf = h->bitfield[lvl][idx >> 4];
+      U32 const bf = BF_LOAD(&BITFIELD(h, lvl)[idx >> 4]);
       ASSERT(0 != bf);
       allocs = count_leading_allocs(bf);
-      size += allocs << shift;
+      size += (USZ)allocs << shift;
    }
    return size;
 }
@@ -226,10 +562,12 @@ static U32 heap_get_address_status_priv(heap const*const h, void const*const a,
 
    ASSERT(idx < h->bscnt);
 
-   U32 const index = (address - h->hdata) >> ((idx + 1) << 2);
-   eChunkStatus status = chunk_get_status(h->bitfield[idx],index);
+   USZ const index = (USZ)(address - HDATA(h)) >> ((idx + 1) << 2);
+   eChunkStatus status = chunk_get_status(BITFIELD(h, idx),index);
 
-   if (status == eSTATUS_FREE && idx < h->bscnt - 1) {
+   /* the parent of a free chunk may be the padding past the end of the heap */
+   if (status == eSTATUS_FREE && idx < h->bscnt - 1 &&
+         (index >> 4) < (h->hsize >> ((idx + 2) << 2))) {
       return heap_get_address_status_priv(h,a,idx + 1,status);
    }
 
@@ -239,7 +577,7 @@ static U32 heap_get_address_status_priv(heap const*const h, void const*const a,
    }
 
    if (status == eSTATUS_ALLOC_HEAD &&
-         ((address - h->hdata) & ((16 << (idx << 2)) - 1)) != 0) {
+         ((address - HDATA(h)) & (((USZ)16 << (idx << 2)) - 1)) != 0) {
       status = eSTATUS_ALLOC;
    }
 
@@ -249,8 +587,8 @@ static U32 heap_get_address_status_priv(heap const*const h, void const*const a,
 eChunkStatus heap_get_address_status(heap const*const h, void const*const a)
 {
    U8 const*const address = (__typeof(address))a;
-   if (address < h->hdata || address >= h->hdata + h->hsize ||
-         ((U32)address & (BASE_SIZE_MIN - 1)) != 0) {
+   if (address < HDATA(h) + h->hoff || address >= HDATA(h) + h->hsize ||
+         ((USZ)address & (BASE_SIZE_MIN - 1)) != 0) {
       return eSTATUS_INVALID;
    }
 
@@ -258,36 +596,28 @@ eChunkStatus heap_get_address_status(heap const*const h, void const*const a)
 }
 #endif
 /* -------------------------------------------------------------------------- */
-static U32 needed_bitfield_count(U32 const size, U32 const index)
+static USZ needed_bitfield_count(USZ const size, U32 const index)
 {
-   U32 const count = size >> ((index + 1) << 2);
+   USZ const count = size >> ((index + 1) << 2);
    return (count + 15) >> 4;
 }
 /* -------------------------------------------------------------------------- */
-static U32 total_bitfield_count(U32 const size)
+static USZ total_bitfield_count(USZ const size)
 {
-   U32 cnt = 0;
+   USZ cnt = 0;
    for (U32 i = 0; i < MAIN_BASE_SIZE_COUNT; i++) {
       cnt += needed_bitfield_count(size, i);
    }
    return cnt;
 }
 /* -------------------------------------------------------------------------- */
-void heap_destroy(heap *h)
-{
-   ASSERT(h != NULL);
-   free(h->bitfield[0]);
-   free(h);
-   return;
-}
-/* -------------------------------------------------------------------------- */
-static inline void bf_set_b11(U32*const bf, U32 const index)
+static inline void bf_set_b11(U32*const bf, USZ const index)
 {
    U32 const sub = index & 0xFU;
-   bf[index >> 4] |= 0xC0000000U >> (sub << 1);
+   BF_STORE(&bf[index >> 4], bf[index >> 4] | (0xC0000000U >> (sub << 1)));
 }
 /* -------------------------------------------------------------------------- */
-static inline void bf_set_b00_multi(U32*const bf, U32 const index, U32 const cnt)
+static inline void bf_set_b00_multi(U32*const bf, USZ const index, U32 const cnt)
 {
    ASSERT(0 != cnt && cnt <= 16);
    U32 const sub = index & 0xFU;
@@ -295,11 +625,11 @@ static inline void bf_set_b00_multi(U32*const bf, U32 const index, U32 const cnt
    U32 const shf = 32 - (cnt << 1);
    U32 const msk = 0xFFFFFFFFU >> shf;
    ASSERT(shf >= (sub << 1));
-   bf[index >> 4] &= ~(msk << (shf - (sub << 1)));
+   BF_STORE(&bf[index >> 4], bf[index >> 4] & ~(msk << (shf - (sub << 1))));
 }
 /* -------------------------------------------------------------------------- */
 static inline void
-bf_set_bxx_multi(U32*const bf, U32 const index, U32 const cnt, U32 const pattern)
+bf_set_bxx_multi(U32*const bf, USZ const index, U32 const cnt, U32 const pattern)
 {
    ASSERT(0 != cnt && cnt <= 16);
    U32 const sub = index & 0xFU;
@@ -307,61 +637,79 @@ bf_set_bxx_multi(U32*const bf, U32 const index, U32 const cnt, U32 const pattern
    U32 const shf = 32 - (cnt << 1);
    ASSERT(shf >= (sub << 1));
    U32 const msk = (0xFFFFFFFFU >> shf) << (shf - (sub << 1));
-   U32 const idx = index >> 4;
+   USZ const idx = index >> 4;
    U32 const bit = bf[idx] & ~msk;
-   bf[idx] = bit | (msk & pattern);
+   BF_STORE(&bf[idx], bit | (msk & pattern));
 }
 /* -------------------------------------------------------------------------- */
-static inline void bf_set_b10_multi(U32*const bf, U32 const index, U32 const cnt)
+static inline void bf_set_b10_multi(U32*const bf, USZ const index, U32 const cnt)
 {
    bf_set_bxx_multi(bf, index, cnt, 0xAAAAAAAAU);
 }
 /* -------------------------------------------------------------------------- */
-static inline void bf_set_b01_multi(U32*const bf, U32 const index, U32 const cnt)
+static inline void bf_set_b01_multi(U32*const bf, USZ const index, U32 const cnt)
 {
    bf_set_bxx_multi(bf, index, cnt, 0x55555555U);
 }
 /* -------------------------------------------------------------------------- */
-static inline void bf_set_b01(U32*const bf, U32 const index)
+static inline void bf_set_b01(U32*const bf, USZ const index)
 {
    U32 const sub = index & 0xFU;
-   bf[index >> 4] &= ~(0x80000000U >> (sub << 1));
-   bf[index >> 4] |=   0x40000000U >> (sub << 1);
+   /* single store: never shows a transient 0b00 to lockless readers */
+   BF_STORE(&bf[index >> 4], (bf[index >> 4] & ~(0xC0000000U >> (sub << 1))) |
+                             (0x40000000U >> (sub << 1)));
 }
 /* -------------------------------------------------------------------------- */
-static inline void bf_set_free_multi(U32*const bf, U32 const index, U32 const cnt)
+static inline void bf_set_free_multi(U32*const bf, USZ const index, U32 const cnt)
 {
    bf_set_b10_multi(bf, index, cnt);
 }
 /* -------------------------------------------------------------------------- */
-static inline void bf_set_split(U32*const bf, U32 const index)
+static inline void bf_set_split(U32*const bf, USZ const index)
 {
    bf_set_b11(bf, index);
 }
 /* -------------------------------------------------------------------------- */
-static void bf_set_alloc_multi(U32*const bf, U32 const index, U32 const cnt)
+static void bf_set_alloc_multi(U32*const bf, USZ const index, U32 const cnt)
 {
    bf_set_b00_multi(bf, index, cnt);
 }
 /* -------------------------------------------------------------------------- */
-static void bf_set_alloc_head(U32*const bf, U32 const index)
+static void bf_set_alloc_head(U32*const bf, USZ const index)
 {
    bf_set_b01(bf, index);
 }
 /* -------------------------------------------------------------------------- */
-static void bf_set_alloc_head_multi(U32*const bf, U32 const index, U32 const cnt)
+static void bf_set_alloc_head_multi(U32*const bf, USZ const index, U32 const cnt)
 {
    bf_set_b01_multi(bf, index, cnt);
 }
 /* -------------------------------------------------------------------------- */
+static inline chunk*get_prev(heap const*const h, chunk const*const c)
+{
+   return LINK(h, c->prev);
+}
+static inline chunk*get_next(heap const*const h, chunk const*const c)
+{
+   return LINK(h, c->next);
+}
+static inline chunk*get_head(heap const*const h, U32 const index)
+{
+#ifdef HEAP_STRIPED
+   return LINK(h, __atomic_load_n(&h->heads[index], __ATOMIC_RELAXED));
+#else
+   return LINK(h, h->heads[index]);
+#endif
+}
+/* -------------------------------------------------------------------------- */
 static void update_prev(heap const*const h, chunk*const c, chunk const*const p)
 {
-   c->prev = (__typeof(c->prev))p;
+   c->prev = LINK_OF(h, p);
 
 #ifdef DEBUG_BUILD
    if (NULL != p) {
       for (U32 i = 0; i < h->hdcnt; i++) {
-         ASSERT(h->heads[i] != c);
+         ASSERT(get_head(h, i) != c);
       }
    }
 #endif
@@ -369,7 +717,7 @@ static void update_prev(heap const*const h, chunk*const c, chunk const*const p)
 /* -------------------------------------------------------------------------- */
 static void update_next(heap const*const h, chunk*const c, chunk const*const n)
 {
-   c->next = (__typeof(c->next))n;
+   c->next = LINK_OF(h, n);
 }
 /* -------------------------------------------------------------------------- */
 static void update_head(heap*const h, U32 const index, chunk const*const c)
@@ -379,96 +727,426 @@ static void update_head(heap*const h, U32 const index, chunk const*const c)
    if (NULL != c) {
    #ifdef DEBUG_BUILD
       for (U32 i = 0; i < h->hdcnt; i++) {
-         ASSERT(h->heads[i] != c);
+         ASSERT(get_head(h, i) != c);
       }
    #endif
 
-      ASSERT(NULL == c->prev);
-      h->headsbits[index >> 5] |=  (0x80000000U >> (index & 31));
+      ASSERT(NULL == get_prev(h, c));
+   #ifdef HEAP_STRIPED
+      __atomic_fetch_or(&h->headsbits[index / USZ_BITS],
+               HEADS_BITS_MSB >> (index & (USZ_BITS - 1)), __ATOMIC_RELAXED);
+   #else
+      h->headsbits[index / USZ_BITS] |=  (HEADS_BITS_MSB >> (index & (USZ_BITS - 1)));
+   #endif
    } else {
-      h->headsbits[index >> 5] &= ~(0x80000000U >> (index & 31));
+   #ifdef HEAP_STRIPED
+      __atomic_fetch_and(&h->headsbits[index / USZ_BITS],
+               ~(HEADS_BITS_MSB >> (index & (USZ_BITS - 1))), __ATOMIC_RELAXED);
+   #else
+      h->headsbits[index / USZ_BITS] &= ~(HEADS_BITS_MSB >> (index & (USZ_BITS - 1)));
+   #endif
    }
 
    ASSERT(index < h->hdcnt);
-   h->heads[index] = (chunk*)c;
+#ifdef HEAP_STRIPED
+   __atomic_store_n(&h->heads[index], LINK_OF(h, c), __ATOMIC_RELAXED);
+#else
+   h->heads[index] = LINK_OF(h, c);
+#endif
 }
 /* -------------------------------------------------------------------------- */
-#if 0
-static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_spinlock_t spl;
-#endif
 static void heap_lock(heap *h)
 {
-   #if 0
-   pthread_mutex_lock(&mtx);
-   pthread_spin_lock(&spl);
+   #if defined(HEAP_THREAD_SAFE) || defined(HEAP_SHARED)
+   pthread_mutex_lock(&h->lock);
    #endif
 }
 static void heap_unlock(heap *h)
 {
-   #if 0
-   pthread_mutex_unlock(&mtx);
-   pthread_spin_unlock(&spl);
+   #if defined(HEAP_THREAD_SAFE) || defined(HEAP_SHARED)
+   pthread_mutex_unlock(&h->lock);
    #endif
 }
 /* -------------------------------------------------------------------------- */
-/* Allocate! */
-void*heap_alloc(heap*const h, U32 const sz)
+static inline bool zmap_dirty(heap const*const h, USZ const reladdr)
 {
-   U32 lvl_needed_sz;
-   const U32 base = (U32)h->hdata;
-
-   if (unlikely(0 == sz)) {
-      return NULL;
+   USZ const z = reladdr >> ZERO_SHIFT;
+   /* zmap_claim() sets the bits of blocks handed out without the lock */
+   return 0 != (__atomic_load_n(&ZMAP(h)[z >> 5], __ATOMIC_RELAXED) &
+                (1U << (z & 31)));
+}
+/* -------------------------------------------------------------------------- */
+/* memory known to be zero holds no other data than the links of the listed
+ * chunks: clear them when a chunk leaves its list */
+static inline void chunk_unlisted(heap const*const h, chunk const*const c)
+{
+   if (!zmap_dirty(h, (U8 const*)c - HDATA(h))) {
+      memset((void*)c, 0, sizeof(*c));
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* the chunks of level HEAP_ZERO_LEVEL z to last are resident again */
+static void rmap_claim(heap*const h, USZ z, USZ const last)
+{
+   USZ cnt_total = 0;
+   while (z <= last) {
+      U32 const bit = z & 31;
+      U32 const cnt = (last - z >= 31 - bit) ? 32 - bit : (U32)(last - z) + 1;
+      U32 const msk = (USZ_ALL_ONES >> (USZ_BITS - cnt)) << bit;
+      U32*const w = &RMAP(h)[z >> 5];
+   #if defined(HEAP_THREAD_SAFE) || defined(HEAP_STRIPED) || defined(HEAP_SHARED)
+      U32 was = __atomic_load_n(w, __ATOMIC_RELAXED) & msk;
+      if (0 != was) {
+         was = __atomic_fetch_and(w, ~msk, __ATOMIC_RELAXED) & msk;
+      }
+   #else
+      U32 const was = *w & msk;
+      *w &= ~msk;
+   #endif
+      cnt_total += __builtin_popcount(was);
+      z += cnt;
+   }
+   if (0 != cnt_total) {
+      __atomic_fetch_sub(&h->released, cnt_total << ZERO_SHIFT, __ATOMIC_RELAXED);
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* a chunk's links are written at c: its page is resident again */
+static inline void rmap_keep(heap*const h, chunk const*const c)
+{
+   if (unlikely(0 != __atomic_load_n(&h->released, __ATOMIC_RELAXED))) {
+      USZ const z = ((U8 const*)c - HDATA(h)) >> ZERO_SHIFT;
+      rmap_claim(h, z, z);
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* the block [reladdr, reladdr + size) is handed out: the chunks it overlaps
+ * may not be zero anymore. With clear, zeroes the parts of the block that
+ * were not known to be zero */
+static void zmap_claim(heap*const h, USZ const reladdr, USZ const size,
+                       bool const clear)
+{
+   USZ const end = reladdr + size;
+   USZ z = reladdr >> ZERO_SHIFT;
+   USZ const last = (end - 1) >> ZERO_SHIFT;
+   if (unlikely(0 != __atomic_load_n(&h->released, __ATOMIC_RELAXED))) {
+      rmap_claim(h, z, last);
+   }
+   while (z <= last) {
+      U32 const bit = z & 31;
+      U32 const cnt = (last - z >= 31 - bit) ? 32 - bit : (U32)(last - z) + 1;
+      U32 const msk = (USZ_ALL_ONES >> (USZ_BITS - cnt)) << bit;
+      U32*const w = &ZMAP(h)[z >> 5];
+   #if defined(HEAP_THREAD_SAFE) || defined(HEAP_STRIPED) || defined(HEAP_SHARED)
+      /* a chunk of level HEAP_ZERO_LEVEL may hold blocks of other threads */
+      U32 old = __atomic_load_n(w, __ATOMIC_RELAXED);
+      if ((old & msk) != msk) {
+         old = __atomic_fetch_or(w, msk, __ATOMIC_RELAXED);
+      }
+   #else
+      U32 const old = *w;
+      *w = old | msk;
+   #endif
+      U32 dirty = clear ? old & msk : 0;
+      while (0 != dirty) {
+         U32 const b = CTZ(dirty);
+         U32 const x = ~(dirty >> b);
+         U32 const len = 0 == x ? 32 : CTZ(x);
+         USZ const zb = (z - bit) + b;
+         USZ const from = zb << ZERO_SHIFT;
+         USZ const to = (zb + len) << ZERO_SHIFT;
+         USZ const a = from > reladdr ? from : reladdr;
+         memset(HDATA(h) + a, 0, (to < end ? to : end) - a);
+         dirty &= ~((USZ_ALL_ONES >> (USZ_BITS - len)) << b);
+      }
+      z += cnt;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* zmap_claim() of the block p of size bytes, in whatever region it is */
+static inline void block_claim(heap*const h, void*const p, USZ const size,
+                               bool const clear)
+{
+   heap*const r = region_of(h, p);
+   zmap_claim(r, (U8*)p - HDATA(r), size, clear);
+}
+/* -------------------------------------------------------------------------- */
+static inline void
+chunk_remove_from_list(heap*const h, chunk const*const c, U32 const h_idx)
+{
+#ifdef HEAP_STRIPED
+   pthread_mutex_lock(&h->classes[h_idx]);
+#endif
+   chunk*const next = get_next(h, c);
+   chunk*const prev = get_prev(h, c);
+   if (NULL != next) {
+      update_prev(h, next, prev);
    }
 
-   U32 needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(BASE_SIZE_MIN - 1);
-
-   heap_lock(h);
+   if (NULL != prev) {
+      update_next(h, prev, next);
+   } else {
+      ASSERT(h_idx < h->hdcnt);
+      ASSERT(get_head(h, h_idx) == c);
+      update_head(h, h_idx, next);
+   }
+   chunk_unlisted(h, c);
+#ifdef HEAP_STRIPED
+   pthread_mutex_unlock(&h->classes[h_idx]);
+#endif
+}
+/* -------------------------------------------------------------------------- */
+static inline void
+new_head(heap*const h, chunk*const c, U32 const lvl15, U32 const tot)
+{
+   U32 const hidx = lvl15 + tot - 1;
+   ASSERT(hidx < h->hdcnt);
+   rmap_keep(h, c);
+#ifdef HEAP_STRIPED
+   pthread_mutex_lock(&h->classes[hidx]);
+#else
+   if (unlikely(HEAP_POLICY_LIFO != h->policy)) {
+      U32 const shift = ((lvl15 / 15) + 1) << 2;
+      USZ const w = ((USZ)((U8*)c - HDATA(h)) >> shift) >> 4;
+      if (w < h->lowest[hidx]) {
+         h->lowest[hidx] = w;
+      }
+   }
+#endif
+   chunk*const hd = get_head(h, hidx);
+   update_next(h, c, hd);
+   update_prev(h, c, NULL);
+   update_head(h, hidx, c);
+   if (NULL != hd) {
+      ASSERT(NULL == get_prev(h, hd));
+      update_prev(h, hd, c);
+   }
+#ifdef HEAP_STRIPED
+   pthread_mutex_unlock(&h->classes[hidx]);
+#endif
+}
+/* -------------------------------------------------------------------------- */
+#ifndef HEAP_STRIPED
+/* HEAP_POLICY_ADDRESS: the chunk of heads[index] with the lowest address. A
+ * listed chunk is a maximal run of free chunks in a bitfield word, so the
+ * words of its level are read from lowest[index] up, HEAP_POLICY_SCAN of them
+ * at most: past that, the head of the list will do, and the next allocation
+ * goes on from where this one stopped */
+static chunk*head_lowest(heap*const h, U32 const index)
+{
+   U32 const lvl = index / 15;
+   U32 const cnt = index - ((lvl << 4) - lvl) + 1;
+   U32 const shift = (lvl + 1) << 2;
+   U32 const*const bf = BITFIELD(h, lvl);
+   USZ const words = needed_bitfield_count(h->hsize, lvl);
+   USZ w = h->lowest[index];
+   USZ const end = words - w > HEAP_POLICY_SCAN ? w + HEAP_POLICY_SCAN : words;
+   for (; w < end; w++) {
+      U32 const stat = bf[w];
+      /* the high bit of each free entry, and of those that start a run */
+      U32 const fr = stat & ~(stat << 1) & ALL_FREE;
+      U32 starts = fr & ~(fr >> 2);
+      while (0 != starts) {
+         U32 const sub = CLZ(starts) >> 1;
+         U32 const bits = (stat << (sub << 1)) ^ ALL_FREE;
+         if (0 != bits && cnt == CLZ(bits) >> 1) {
+            h->lowest[index] = w;
+            return (chunk*)(HDATA(h) + ((((USZ)w << 4) + sub) << shift));
+         }
+         starts &= ~(0x80000000U >> (sub << 1));
+      }
+   }
+   h->lowest[index] = w;
+   return get_head(h, index);
+}
+/* -------------------------------------------------------------------------- */
+/* POLICY_LOWEST: the lowest of the chunks head_lowest() finds in the lists of
+ * index and above, *index becomes the list it's in */
+static chunk*heads_lowest(heap*const h, U32*const index)
+{
+   chunk*best = NULL;
+   for (U32 i = *index; i < h->hdcnt; i++) {
+      if (0 == (HEADS_BITS_LOAD(h, i / USZ_BITS) &
+                (HEADS_BITS_MSB >> (i & (USZ_BITS - 1))))) {
+         continue;
+      }
+      chunk*const c = head_lowest(h, i);
+      if (NULL == best || c < best) {
+         best = c;
+         *index = i;
+      }
+   }
+   return best;
+}
+#endif
+/* -------------------------------------------------------------------------- */
+#ifdef HEAP_STRIPED
+/* Lock order: upper, then one stripe, then one heads[] list at a time.
+ * An operation on levels >= HEAP_STRIPE_LEVEL holds the upper lock, and the
+ * lock of the one stripe chunk it walks down into, if any. An operation that
+ * starts below HEAP_STRIPE_LEVEL holds the lock of its stripe chunk, and
+ * trades it for the upper lock if freeing makes the whole stripe chunk free:
+ * none of its chunks is listed anymore, so nobody else can reach it. */
+typedef struct {
+   pthread_mutex_t*stripe;
+   bool upper;
+} stripe_ctx;
+/* -------------------------------------------------------------------------- */
+static inline pthread_mutex_t*stripe_of(heap*const h, USZ const reladdr)
+{
+   USZ const chk = reladdr >> ((HEAP_STRIPE_LEVEL + 1) << 2);
+   return &h->stripes[chk & (HEAP_STRIPE_LOCKS - 1)];
+}
+/* -------------------------------------------------------------------------- */
+/* locks the chunks of level lvl at reladdr */
+static void stripe_lock(heap*const h, stripe_ctx*const ctx, U32 const lvl,
+                        USZ const reladdr)
+{
+   ctx->stripe = NULL;
+   ctx->upper = lvl >= HEAP_STRIPE_LEVEL;
+   if (ctx->upper) {
+      pthread_mutex_lock(&h->upper);
+   } else {
+      ctx->stripe = stripe_of(h, reladdr);
+      pthread_mutex_lock(ctx->stripe);
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* about to modify the chunks of level lvl at reladdr */
+static inline void stripe_enter(heap*const h, stripe_ctx*const ctx,
+                                U32 const lvl, USZ const reladdr)
+{
+   if (lvl >= HEAP_STRIPE_LEVEL) {
+      if (unlikely(!ctx->upper)) {
+         pthread_mutex_unlock(ctx->stripe);
+         ctx->stripe = NULL;
+         pthread_mutex_lock(&h->upper);
+         ctx->upper = true;
+      }
+   } else if (unlikely(NULL == ctx->stripe)) {
+      ASSERT(ctx->upper);
+      ctx->stripe = stripe_of(h, reladdr);
+      pthread_mutex_lock(ctx->stripe);
+   } else {
+      ASSERT(ctx->stripe == stripe_of(h, reladdr));
+   }
+}
+/* -------------------------------------------------------------------------- */
+static void stripe_unlock(heap*const h, stripe_ctx*const ctx)
+{
+   if (NULL != ctx->stripe) {
+      pthread_mutex_unlock(ctx->stripe);
+   }
+   if (ctx->upper) {
+      pthread_mutex_unlock(&h->upper);
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* with the lock of its level held: is c still the chunk listed in
+ * heads[index], i.e. a maximal run of free chunks of the right count? */
+static bool chunk_is_listed(heap const*const h, chunk const*const c,
+                            U32 const index)
+{
+   U32 const lvl = index / 15;
+   U32 const cnt = index - ((lvl << 4) - lvl) + 1;
+   U32 const shift = (lvl + 1) << 2;
+   USZ const reladdr = (U8 const*)c - HDATA(h);
+   if (0 != (reladdr & (((USZ)1 << shift) - 1))) {
+      return false;
+   }
+   USZ const idx = reladdr >> shift;
+   U32 const sub = idx & 0x0FU;
+   U32 const stat = BITFIELD(h, lvl)[idx >> 4];
+   U32 const free_bits = (stat << (sub << 1)) ^ ALL_FREE;
+   if (0 == free_bits || cnt != CLZ(free_bits) >> 1) {
+      return false;
+   }
+   return 0 == sub || eSTATUS_FREE != chunk_get_status(BITFIELD(h, lvl), idx - 1);
+}
+#endif
+#ifdef HEAP_STRIPED
+   #define STRIPE_ENTER(lvl, reladdr) stripe_enter(h, &ctx, (lvl), (reladdr))
+#else
+   #define STRIPE_ENTER(lvl, reladdr) { }
+#endif
+/* -------------------------------------------------------------------------- */
+/* Allocate from a single region! needed_sz is a multiple of BASE_SIZE_MIN,
+ * the heap is locked (with HEAP_STRIPED, takes the locks it needs itself) */
+static void*region_alloc_priv(heap*const h, USZ needed_sz)
+{
+   USZ lvl_needed_sz;
+   const USZ base = (USZ)HDATA(h);
 
-   U32 const index = next_available_head_index(h, needed_sz);
+#ifdef HEAP_STRIPED
+   stripe_ctx ctx;
+   U32 index;
+   chunk*c;
+   for (;;) {
+      index = next_available_head_index(h, needed_sz);
+      ASSERT(index <= BASE_SIZES_COUNT);
+      if (unlikely(index == BASE_SIZES_COUNT)) {
+         return NULL;
+      }
+      ASSERT(index < h->hdcnt);
+      c = LINK(h, __atomic_load_n(&h->heads[index], __ATOMIC_RELAXED));
+      if (unlikely(NULL == c)) {
+         continue;
+      }
+      /* c was the head when peeked: it's still listed if its level, which
+       * its lock now freezes, shows the free run this list is for */
+      stripe_lock(h, &ctx, index / 15, (USZ)c - base);
+      if (likely(chunk_is_listed(h, c, index))) {
+         break;
+      }
+      stripe_unlock(h, &ctx);
+   }
+   USZ const found_sz = base_size_from_index(index);
+   ASSERT(found_sz >= needed_sz);
+   chunk_remove_from_list(h, c, index);
+#else
+   U32 index = next_available_head_index(h, needed_sz);
    ASSERT(index <= BASE_SIZES_COUNT);
    if (unlikely(index == BASE_SIZES_COUNT)) {
       return NULL;
    }
-   U32 const found_sz = base_size_from_index(index);
-   ASSERT(found_sz >= needed_sz);
 
    ASSERT(index < h->hdcnt);
-   chunk*c = h->heads[index];
-   ASSERT(NULL != c);
+   chunk*c;
+   if (unlikely(HEAP_POLICY_LIFO != h->policy)) {
+      c = POLICY_LOWEST == h->policy ? heads_lowest(h, &index) :
+                                       head_lowest(h, index);
+      chunk_remove_from_list(h, c, index);
+   } else {
+      c = get_head(h, index);
+      ASSERT(NULL != c);
 
-   if (NULL != c->next) {
-      update_prev(h, c->next, NULL);
-   }
+      chunk*const next = get_next(h, c);
+      if (NULL != next) {
+         update_prev(h, next, NULL);
+      }
 
-   update_head(h, index, c->next);
+      update_head(h, index, next);
+      chunk_unlisted(h, c);
+   }
+   USZ const found_sz = base_size_from_index(index);
+   ASSERT(found_sz >= needed_sz);
+#endif
 
-   U32 const extra_sz = found_sz - needed_sz;
+   USZ const extra_sz = found_sz - needed_sz;
 
-   U32 bs_level = (CTZ(found_sz) >> 2) - 1;
+   U32 bs_level = (CTZW(found_sz) >> 2) - 1;
    ASSERT(bs_level < MAIN_BASE_SIZE_COUNT);
    U32 shift = (bs_level << 2) + 4;
 
    /* the combined number of iterations for both 'for' loops in this
-    * function is 7 max, hence the 0(1) complexity */
+    * function is MAIN_BASE_SIZE_COUNT max, hence the 0(1) complexity */
    for (;; --bs_level, shift -= 4) {
+      STRIPE_ENTER(bs_level, (USZ)c - base);
       U32 const lvl_remain_sz = (extra_sz >> shift) & 0x0FU;
 
       if (0 != lvl_remain_sz) {
-         U32 const head = (bs_level << 4) - bs_level + lvl_remain_sz - 1;
-         ASSERT(head < h->hdcnt);
-         chunk*const hd = h->heads[head];
-         update_next(h, c, hd);
-         update_prev(h, c, NULL);
-         update_head(h, head, c);
-
-         if (NULL != hd) {
-            ASSERT(NULL == hd->prev);
-            update_prev(h, hd, c);
-         }
-
-         c = (chunk*)((U8*)c + (lvl_remain_sz << shift));
+         new_head(h, c, (bs_level << 4) - bs_level, lvl_remain_sz);
+         c = (chunk*)((U8*)c + ((USZ)lvl_remain_sz << shift));
       }
 
       lvl_needed_sz = (needed_sz >> shift) /* & 0x0FU */;
@@ -478,31 +1156,33 @@ void*heap_alloc(heap*const h, U32 const sz)
 
       ASSERT(0 != bs_level);
 
-      U32 const split = ((U32)c - base) >> shift;
-      bf_set_split(h->bitfield[bs_level], split);
+      USZ const split = ((USZ)c - base) >> shift;
+      bf_set_split(BITFIELD(h, bs_level), split);
    }
 
-   U32 main_bs = 1 << shift;
+   USZ main_bs = (USZ)1 << shift;
    ASSERT(is_base_size(main_bs));
    ASSERT(lvl_needed_sz < 16);
 
    void*const result = c;
-   bf_set_alloc_head(h->bitfield[bs_level],((U32)c - base) >> shift);
+   bf_set_alloc_head(BITFIELD(h, bs_level),((USZ)c - base) >> shift);
    c = (chunk*)((U8*)c + main_bs);
 
-   U32 const cnt = lvl_needed_sz - 1;
+   U32 const cnt = (U32)lvl_needed_sz - 1;
    if (0 != cnt) {
-      bf_set_alloc_multi(h->bitfield[bs_level], ((U32)c - base) >> shift, cnt);
+      bf_set_alloc_multi(BITFIELD(h, bs_level), ((USZ)c - base) >> shift, cnt);
       c = (chunk*)((U8*)c + (main_bs * cnt));
    }
 
    needed_sz -= lvl_needed_sz << shift;
    if (0 != needed_sz && 0 != bs_level) {
-      U32 const split = ((U32)c - base) >> shift;
-      bf_set_split(h->bitfield[bs_level], split);
+      USZ const split = ((USZ)c - base) >> shift;
+      bf_set_split(BITFIELD(h, bs_level), split);
    }
 
-   if (0 != bs_level) for (bs_level = bs_level - 1;; --bs_level) {
+   /* nothing left to place: the remainder has no lower bits either */
+   if (0 != bs_level && 0 != needed_sz) for (bs_level = bs_level - 1;; --bs_level) {
+      STRIPE_ENTER(bs_level, (USZ)c - base);
       shift -= 4;
       main_bs >>= 4;
       lvl_needed_sz = (needed_sz >> shift) /* & 0x0FU */;
@@ -512,7 +1192,7 @@ void*heap_alloc(heap*const h, U32 const sz)
 
       if (0 != lvl_needed_sz) {
          bf_set_alloc_multi(
-               h->bitfield[bs_level], ((U32)c - base) >> shift, lvl_needed_sz);
+               BITFIELD(h, bs_level), ((USZ)c - base) >> shift, lvl_needed_sz);
          c = (chunk*)((U8*)c + (main_bs * lvl_needed_sz));
       }
 
@@ -520,23 +1200,13 @@ void*heap_alloc(heap*const h, U32 const sz)
 
       U32 const lvl_remain_sz = (extra_sz >> shift) & 0x0FU;
       if (0 != lvl_remain_sz) {
-         U32 const head = (bs_level << 4) - bs_level + lvl_remain_sz - 1;
          chunk *new = c;
 
          if (0 != bs_level && 0 != needed_sz) {
             new = (chunk*)((U8*)new + main_bs);
          }
 
-         ASSERT(head < h->hdcnt);
-         chunk*const hd = h->heads[head];
-         update_next(h, new, hd);
-         update_prev(h, new, NULL);
-         update_head(h, head, new);
-
-         if (NULL != hd) {
-            ASSERT(NULL == hd->prev);
-            update_prev(h, hd, new);
-         }
+         new_head(h, new, (bs_level << 4) - bs_level, lvl_remain_sz);
       }
 
       if (0 == needed_sz) {
@@ -546,110 +1216,249 @@ void*heap_alloc(heap*const h, U32 const sz)
          break;
       }
 
-      U32 const split = ((U32)c - base) >> shift;
-      bf_set_split(h->bitfield[bs_level], split);
+      USZ const split = ((USZ)c - base) >> shift;
+      bf_set_split(BITFIELD(h, bs_level), split);
    }
 
-   heap_unlock(h);
+#ifdef HEAP_STRIPED
+   stripe_unlock(h, &ctx);
+#endif
+   STAT_ADD(h, allocs, 1);
    return result;
 }
 /* -------------------------------------------------------------------------- */
-static inline void
-chunk_remove_from_list(heap*const h, chunk const*const c, U32 const h_idx)
+/* level of the highest nibble of a non-zero size */
+static inline U32 size_level(USZ const sz)
+{
+   ASSERT(sz >= BASE_SIZE_MIN);
+   return ((USZ_BITS - 1 - CLZW(sz)) >> 2) - 1;
+}
+/* -------------------------------------------------------------------------- */
+/* maps size bytes aligned as heap_create() needs them, NULL on failure */
+static U8*region_map(USZ const size)
 {
-   if (NULL != c->next) {
-      update_prev(h, c->next, c->prev);
+   USZ const align = ((USZ)1 << NIBBLE_MASK) >> (CLZW(size) & NIBBLE_MASK);
+   U8*const map = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if (MAP_FAILED == map) {
+      return NULL;
    }
-
-   if (NULL != c->prev) {
-      update_next(h, c->prev, c->next);
-   } else {
-      ASSERT(h_idx < h->hdcnt);
-      ASSERT(h->heads[h_idx] == c);
-      update_head(h, h_idx, c->next);
+   U8*const data = (U8*)(((USZ)map + align - 1) & ~(align - 1));
+   USZ const lead = data - map;
+   if (0 != lead) {
+      munmap(map, lead);
+   }
+   if (align != lead) {
+      munmap(data + size, align - lead);
    }
+   return data;
 }
 /* -------------------------------------------------------------------------- */
-static inline void
-new_head(heap*const h, chunk*const c, U32 const lvl15, U32 const tot)
+/* a region of h: a heap that doesn't allocate its book-keeping keeps that of
+ * its regions in them too */
+static heap*region_create(heap const*const h, U8*const address, USZ const size)
 {
-   U32 const hidx = lvl15 + tot - 1;
-   ASSERT(hidx < h->hdcnt);
-   chunk*const hd = h->heads[hidx];
-   update_next(h, c, hd);
-   update_prev(h, c, NULL);
-   update_head(h, hidx, c);
-   if (NULL != hd) {
-      ASSERT(hd->prev == NULL);
-      update_prev(h, hd, c);
+   return META_ALLOC == h->meta ? heap_create(address, size) :
+                                  heap_create_in(address, size, NULL);
+}
+/* -------------------------------------------------------------------------- */
+/* h is out of memory: maps a new region after last, large enough for
+ * needed_sz, and allocates from it. The heap is locked (with HEAP_STRIPED,
+ * takes the lock of its regions list) */
+static void*region_grow(heap*const h, heap*last, USZ const needed_sz)
+{
+   void*result = NULL;
+#ifdef HEAP_STRIPED
+   pthread_mutex_lock(&h->regions);
+   /* other threads may have added regions since last was looked at */
+   for (heap*r = region_next(last); NULL != r; r = region_next(r)) {
+      last = r;
+      result = region_alloc_priv(r, needed_sz);
+      if (NULL != result) {
+         pthread_mutex_unlock(&h->regions);
+         return result;
+      }
+   }
+#endif
+   ASSERT(NULL == region_next(last));
+   /* a chunk more than the highest nibble of the size holds the block, and
+    * another one its book-keeping when it's kept in the region */
+   U32 const shift = (size_level(needed_sz) + 1) << 2;
+   USZ size = ((needed_sz >> shift) + 1 + (META_ALLOC != h->meta)) << shift;
+   if (size < h->grow) {
+      size = h->grow;
+   }
+   if (likely(size <= HEAP_SIZE_MAX)) {
+      heap*const r = region_create(h, NULL, size);
+      if (NULL != r) {
+         r->rel_lvl = h->rel_lvl;
+         r->rel_flags = h->rel_flags;
+         r->policy = h->policy;
+         result = region_alloc_priv(r, needed_sz);
+         __atomic_store_n(&last->next, r, __ATOMIC_RELEASE);
+      }
    }
+#ifdef HEAP_STRIPED
+   pthread_mutex_unlock(&h->regions);
+#endif
+   return result;
 }
 /* -------------------------------------------------------------------------- */
-void heap_free(heap*const h, void*const address)
+/* the region whose heads[] summary has the best fit for needed_sz */
+static heap*region_pick(heap*const h, USZ const needed_sz)
 {
-   U8 const*const a = (__typeof(a))address;
-   U32 const A = (__typeof(A))a;
-   U8*const base = h->hdata;
-   if (unlikely(a < base || a >= base + h->hsize || 0 != (A & 0x0FU))) {
-      fprintf(stderr,"ERR: %p is not an allocated address.\n", address);
-      return;
+   heap*r = region_next(h);
+   if (likely(NULL == r)) {
+      return h;
    }
-   U32 const reladdr = a - base;
-   ASSERT(A >= 4);
-   U32 lvl = (CTZ(A) >> 2) - 1;
-   ASSERT(lvl < 7);
-   U32 shift = (lvl + 1) << 2, idx;
-   for (;; --lvl, shift -= 4) {
-      idx = reladdr >> shift;
-      if (eSTATUS_ALLOC_HEAD == chunk_get_status(h->bitfield[lvl], idx)) {
-         break;
+   heap*best = h;
+   U32 best_idx = next_available_head_index(h, needed_sz);
+   for (; NULL != r; r = region_next(r)) {
+      U32 const idx = next_available_head_index(r, needed_sz);
+      if (idx < best_idx) {
+         best = r;
+         best_idx = idx;
       }
-      if (unlikely(0 == lvl)) {
-         fprintf(stderr, "ERR: %p is not an allocated address.\n", address);
-         return;
+   }
+   return best;
+}
+/* -------------------------------------------------------------------------- */
+/* Allocate! Tries the region with the best fit first, then the others, then
+ * maps a new region when growing is enabled. The heap is locked (with
+ * HEAP_STRIPED, takes the locks it needs itself) */
+static void*heap_alloc_priv(heap*const h, USZ const needed_sz)
+{
+   if (likely(NULL == region_next(h) && 0 == h->grow)) {
+      return region_alloc_priv(h, needed_sz);
+   }
+   heap*const best = region_pick(h, needed_sz);
+   void*result = region_alloc_priv(best, needed_sz);
+   /* a size spanning several levels may fit below its closest base size */
+   heap*last = h;
+   for (heap*r = h; NULL == result && NULL != r; r = region_next(r)) {
+      last = r;
+      if (r != best) {
+         result = region_alloc_priv(r, needed_sz);
       }
-      ASSERT(0 != lvl && shift >= 4);
    }
-
-   U32 const head_lvl = lvl;
-   U32 tot_size = 0;
-   U32 const sidx = idx & 0x0FU;
-   if (unlikely(15 == sidx)) {
-      tot_size = 1 << shift;
-   } else {
-      U32 const*bs_lvl = h->bitfield[lvl];
-      U32 const bits = bs_lvl[idx >> 4] << ((sidx + 1) << 1);
-      if (unlikely(0 == bits)) {
-         ASSERT(0 != sidx);
-         tot_size = (16 - sidx) << shift;
+   if (NULL == result && 0 != h->grow) {
+      result = region_grow(h, last, needed_sz);
+   }
+   return result;
+}
+/* -------------------------------------------------------------------------- */
+/* sets (or clears) the bits z to last of a zmap / rmap */
+static void map_range(U32*const map, USZ z, USZ const last, bool const set)
+{
+   while (z <= last) {
+      U32 const bit = z & 31;
+      U32 const cnt = (last - z >= 31 - bit) ? 32 - bit : (U32)(last - z) + 1;
+      U32 const msk = (USZ_ALL_ONES >> (USZ_BITS - cnt)) << bit;
+   #if defined(HEAP_THREAD_SAFE) || defined(HEAP_STRIPED) || defined(HEAP_SHARED)
+      if (set) {
+         __atomic_fetch_or(&map[z >> 5], msk, __ATOMIC_RELAXED);
       } else {
-         U32 allocs = count_leading_allocs(bits) + 1;
-         ASSERT(sidx + allocs < 16);
-         tot_size = allocs << shift;
-         while (eSTATUS_SPLIT == chunk_get_status(bs_lvl, idx + allocs)) {
-            ASSERT(0 != lvl);
-            lvl -= 1;
-            bs_lvl = h->bitfield[lvl];
-            ASSERT(shift >= 4);
-            shift -= 4;
-            idx = (reladdr + tot_size) >> shift;
-            allocs = count_leading_allocs(bs_lvl[idx >> 4]);
-            tot_size += allocs << shift;
-         }
+         __atomic_fetch_and(&map[z >> 5], ~msk, __ATOMIC_RELAXED);
+      }
+   #else
+      map[z >> 5] = set ? map[z >> 5] | msk : map[z >> 5] & ~msk;
+   #endif
+      z += cnt;
+   }
+}
+/* -------------------------------------------------------------------------- */
+static inline bool map_bit(U32 const*const map, USZ const z)
+{
+   return 0 != (__atomic_load_n(&map[z >> 5], __ATOMIC_RELAXED) & (1U << (z & 31)));
+}
+/* -------------------------------------------------------------------------- */
+/* gives the pages of the free run [reladdr, reladdr + size) back to the OS,
+ * but the first one that holds its links. The run is ours (locked, or not
+ * listed yet). Returns the number of bytes released. */
+static USZ region_release(heap*const h, USZ const reladdr, USZ const size)
+{
+   bool const lazy = 0 != (h->rel_flags & HEAP_RELEASE_LAZY);
+   /* fresh anonymous pages read as zero, those freed lazily may not */
+   bool const zeroed = h->anon && !lazy;
+   int advice = lazy ? MADV_FREE : MADV_DONTNEED;
+#ifdef HEAP_SHARED
+   /* the pages of a shared object stay in it, mapped by the other processes,
+    * unless punched out of it */
+   if (HEAP_SHARED_MAGIC == h->magic) {
+      advice = MADV_REMOVE;
+   }
+#endif
+   USZ z = (reladdr >> ZERO_SHIFT) + 1;
+   USZ const end = (reladdr + size) >> ZERO_SHIFT;
+   USZ done = 0;
+   while (z < end) {
+      if (0 == (z & 31) && end - z >= 32 &&
+          ~0U == __atomic_load_n(&RMAP(h)[z >> 5], __ATOMIC_RELAXED)) {
+         z += 32;
+         continue;
+      }
+      if (map_bit(RMAP(h), z)) {
+         z++;
+         continue;
       }
+      USZ const from = z;
+      while (z < end && !map_bit(RMAP(h), z)) {
+         z += (0 == (z & 31) && end - z >= 32 &&
+               0 == __atomic_load_n(&RMAP(h)[z >> 5], __ATOMIC_RELAXED)) ? 32 : 1;
+      }
+      if (0 != madvise(HDATA(h) + (from << ZERO_SHIFT), (z - from) << ZERO_SHIFT,
+                       advice)) {
+         continue;
+      }
+      map_range(RMAP(h), from, z - 1, true);
+      if (zeroed) {
+         map_range(ZMAP(h), from, z - 1, false);
+      }
+      done += (z - from) << ZERO_SHIFT;
+   }
+   if (0 != done) {
+      __atomic_fetch_add(&h->released, done, __ATOMIC_RELAXED);
+   }
+   return done;
+}
+/* -------------------------------------------------------------------------- */
+/* heap_free() made a free run of tot chunks of level lvl at c */
+static inline void run_freed(heap*const h, chunk const*const c, U32 const lvl,
+                             U32 const tot)
+{
+   if (unlikely(lvl >= h->rel_lvl) && 0 == (h->rel_flags & HEAP_RELEASE_DEFERRED)) {
+      (void)region_release(h, (U8 const*)c - HDATA(h),
+                           (USZ)tot << ((lvl + 1) << 2));
    }
-   ASSERT(tot_size == heap_get_alloc_size(h, address));
+}
+/* -------------------------------------------------------------------------- */
+/* frees the block of tot_size bytes at reladdr, its head entry being at
+ * head_lvl. The heap is locked (with HEAP_STRIPED, takes the locks it needs
+ * itself) */
+static void heap_release_priv(heap*const h, USZ const reladdr,
+                              U32 const head_lvl, USZ const tot_size)
+{
+   U8*const base = HDATA(h);
    ASSERT(0 != tot_size);
-   ASSERT(lvl == (CTZ(tot_size) >> 2) - 1);
+   ASSERT(tot_size == heap_get_alloc_size(h, base + reladdr));
+   ASSERT(head_lvl == size_level(tot_size));
+   STAT_ADD(h, frees, 1);
+#ifdef HEAP_STRIPED
+   stripe_ctx ctx;
+   stripe_lock(h, &ctx, head_lvl, reladdr);
+#endif
+   U32 lvl = (CTZW(tot_size) >> 2) - 1;
+   U32 shift = (lvl + 1) << 2;
    U32 sub_empty = 0;
-   U32 const bottom_addr = reladdr + tot_size;
+   USZ const bottom_addr = reladdr + tot_size;
    while (lvl < head_lvl) {
       U32 const base_size = (tot_size >> shift) & 0x0Fu;
       U32 const bsize_sub = base_size + sub_empty;
       ASSERT(0 != bsize_sub);
-      U32 const index = (bottom_addr >> shift) - base_size;
+      USZ const index = (bottom_addr >> shift) - base_size;
       ASSERT(0 == (index & 0x0Fu));
-      U32*const bf_lvl = h->bitfield[lvl];
+      STRIPE_ENTER(lvl, index << shift);
+      U32*const bf_lvl = BITFIELD(h, lvl);
       U32 next = 0;
       U32 const lvl15 = (lvl << 4) - lvl;
       U32 new_bf = 0;
@@ -665,16 +1474,17 @@ void heap_free(heap*const h, void*const address)
          new_bf |= stat & nmask;
       }
       new_bf |= ALL_FREE << (32 - bsize_sub2);
-      bf_lvl[index >> 4] = new_bf;
+      BF_STORE(&bf_lvl[index >> 4], new_bf);
       U32 const tot = next + bsize_sub;
       if (unlikely(16 == tot)) {
          sub_empty = 1;
       } else {
          chunk*const c = (chunk*)(base + (index << shift));
+         run_freed(h, c, lvl, tot);
          new_head(h, c, lvl15, tot);
          sub_empty = 0;
          ASSERT(0 != (tot_size >> (shift + 4)));
-         lvl += CTZ(tot_size >> (shift + 4)) >> 2;
+         lvl += CTZW(tot_size >> (shift + 4)) >> 2;
       }
       lvl += 1;
       shift = (lvl + 1) << 2;
@@ -684,9 +1494,10 @@ void heap_free(heap*const h, void*const address)
    for (U32 base_size = (tot_size >> shift) & 0x0Fu;;) {
       U32 const bsize_sub = base_size + sub_empty;
       ASSERT(0 != bsize_sub);
-      U32 const idx = reladdr >> shift;
+      USZ const idx = reladdr >> shift;
+      STRIPE_ENTER(lvl, idx << shift);
       U32 const sub = idx & 0x0Fu;
-      U32*const bf_lvl = h->bitfield[lvl];
+      U32*const bf_lvl = BITFIELD(h, lvl);
       U32 const lvl15 = (lvl << 4) - lvl;
       U32 prev = 0, next = 0;
       U32 const stat = bf_lvl[idx >> 4];
@@ -703,36 +1514,1979 @@ void heap_free(heap*const h, void*const address)
          U32 const nmask = (0x40000000u >> (inxt - 2)) - 1;
          new_bf |= stat & nmask;
       }
-      if (0 != sub) {
-         prev = (CTZ((stat >> ((16 - sub) << 1)) ^ ALL_FREE)) >> 1;
-         if (0 != prev) {
-            ASSERT(prev <= sub);
-            chunk*const p = (chunk*)(base + ((idx - prev) << shift));
-            chunk_remove_from_list(h, p, lvl15 + prev - 1);
-         }
-         ASSERT(prev <= sub);
-         ASSERT(sub <= 15);
-         U32 const pmask = 0xFFFFFFFCu << ((15 - sub) << 1);
-         new_bf |= stat & pmask;
+      if (0 != sub) {
+         prev = (CTZ((stat >> ((16 - sub) << 1)) ^ ALL_FREE)) >> 1;
+         if (0 != prev) {
+            ASSERT(prev <= sub);
+            chunk*const p = (chunk*)(base + ((idx - prev) << shift));
+            chunk_remove_from_list(h, p, lvl15 + prev - 1);
+         }
+         ASSERT(prev <= sub);
+         ASSERT(sub <= 15);
+         U32 const pmask = 0xFFFFFFFCu << ((15 - sub) << 1);
+         new_bf |= stat & pmask;
+      }
+      new_bf |= (ALL_FREE >> (32 - (bsize_sub << 1))) << (32 - inxt);
+      BF_STORE(&bf_lvl[idx >> 4], new_bf);
+      U32 const tot = next + prev + bsize_sub;
+      ASSERT(tot <= 16 && (tot != 16 || lvl + 1 < h->bscnt));
+      if (tot != 16) {
+         chunk*const c = (chunk*)(base + ((idx - prev) << shift));
+         run_freed(h, c, lvl, tot);
+         new_head(h, c, lvl15, tot);
+         break;
+      }
+      sub_empty = 1;
+      lvl += 1;
+      ASSERT(shift < (MAIN_BASE_SIZE_COUNT << 2));
+      shift += 4;
+      base_size = 0;
+   }
+   ASSERT(heap_get_address_status(h, base + reladdr) == eSTATUS_FREE);
+#ifdef HEAP_STRIPED
+   stripe_unlock(h, &ctx);
+#endif
+   return;
+}
+#ifdef HEAP_SLAB
+/* -------------------------------------------------------------------------- */
+static void slab_push(heap*const r, slab*const s)
+{
+   slab**const head = &r->slabs[s->size / SLAB_STEP - 1];
+   s->prev = NULL;
+   s->next = *head;
+   if (NULL != s->next) {
+      s->next->prev = s;
+   }
+   *head = s;
+}
+/* -------------------------------------------------------------------------- */
+static void slab_unlist(heap*const r, slab const*const s)
+{
+   if (NULL != s->next) {
+      s->next->prev = s->prev;
+   }
+   if (NULL != s->prev) {
+      s->prev->next = s->next;
+   } else {
+      ASSERT(r->slabs[s->size / SLAB_STEP - 1] == s);
+      r->slabs[s->size / SLAB_STEP - 1] = s->next;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* an object of sz bytes (a multiple of SLAB_STEP up to HEAP_SLAB_MAX_SIZE)
+ * from a slab with free objects of any region, or from a new slab. The heap
+ * is locked */
+static void*slab_alloc(heap*const h, USZ const sz)
+{
+   ASSERT(0 != sz && sz <= HEAP_SLAB_MAX_SIZE && 0 == (sz & (SLAB_STEP - 1)));
+   U32 const cls = sz / SLAB_STEP - 1;
+   heap*r = h;
+   while (NULL != r && NULL == r->slabs[cls]) {
+      r = region_next(r);
+   }
+   slab*s;
+   if (likely(NULL != r)) {
+      s = r->slabs[cls];
+   } else {
+      s = (slab*)heap_alloc_priv(h, SLAB_SIZE);
+      if (unlikely(NULL == s)) {
+         /* no chunk left for a slab, a block may still fit */
+         USZ const needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+         void*const p = heap_alloc_priv(h, needed_sz);
+         if (NULL != p) {
+            block_claim(h, p, needed_sz, false);
+         }
+         return p;
+      }
+      r = region_of(h, s);
+      USZ const reladdr = (U8*)s - HDATA(r);
+      zmap_claim(r, reladdr, SLAB_SIZE, false);
+      s->size = sz;
+      s->count = (SLAB_SIZE - SLAB_HEADER) / sz;
+      s->used = 0;
+      s->hint = 0;
+      for (U32 w = 0; w < SLAB_WORDS; w++) {
+         U32 const left = w << 5 < s->count ? s->count - (w << 5) : 0;
+         s->free[w] = left >= 32 ? ~0U : (1U << left) - 1;
+      }
+      map_range(r->smap, reladdr >> ZERO_SHIFT, reladdr >> ZERO_SHIFT, true);
+      slab_push(r, s);
+   }
+   U32 w = s->hint;
+   while (0 == s->free[w]) {
+      w++;
+      ASSERT(w < SLAB_WORDS);
+   }
+   U32 const b = CTZ(s->free[w]);
+   s->free[w] &= ~(1U << b);
+   s->hint = w;
+   if (++s->used == s->count) {
+      slab_unlist(r, s);
+   }
+   STAT_ADD(r, allocs, 1);
+   return (U8*)s + SLAB_HEADER + (USZ)((w << 5) + b) * sz;
+}
+/* -------------------------------------------------------------------------- */
+/* gives back the object at p of the slab s of region r, and the slab to the
+ * heap once it's empty, unless it's the last one of its size in r. The heap
+ * is locked */
+static void slab_free(heap*const r, slab*const s, void*const p)
+{
+   U32 const i = slab_index(s, p);
+   U32 const w = i >> 5;
+   U32 const bit = 1U << (i & 31);
+   if (unlikely(i >= s->count || 0 != (s->free[w] & bit))) {
+      fprintf(stderr, "ERR: %p is not an allocated address.\n", p);
+      return;
+   }
+   s->free[w] |= bit;
+   if (w < s->hint) {
+      s->hint = w;
+   }
+   STAT_ADD(r, frees, 1);
+   if (s->used-- == s->count) {
+      slab_push(r, s);
+   }
+   if (0 == s->used && (s != r->slabs[s->size / SLAB_STEP - 1] || NULL != s->next)) {
+      slab_unlist(r, s);
+      USZ const reladdr = (U8*)s - HDATA(r);
+      map_range(r->smap, reladdr >> ZERO_SHIFT, reladdr >> ZERO_SHIFT, false);
+      heap_release_priv(r, reladdr, HEAP_ZERO_LEVEL, SLAB_SIZE);
+   }
+}
+#endif
+/* -------------------------------------------------------------------------- */
+/* the heap is locked (with HEAP_STRIPED, takes the locks it needs itself) */
+static void heap_free_priv(heap*h, void*const address)
+{
+   h = region_of(h, address);
+#ifdef HEAP_SLAB
+   slab*const s = slab_of(h, address);
+   if (NULL != s) {
+      slab_free(h, s, address);
+      return;
+   }
+#endif
+   U8 const*const a = (__typeof(a))address;
+   USZ const A = (__typeof(A))a;
+   U8*const base = HDATA(h);
+   if (unlikely(a < base + h->hoff || a >= base + h->hsize ||
+                0 != (A & 0x0FU))) {
+      fprintf(stderr,"ERR: %p is not an allocated address.\n", address);
+      return;
+   }
+   USZ const reladdr = a - base;
+   U32 lvl = (CTZW(reladdr | top_level_size(h)) >> 2) - 1;
+   ASSERT(lvl < h->bscnt);
+   U32 shift = (lvl + 1) << 2;
+   USZ idx;
+   for (;; --lvl, shift -= 4) {
+      idx = reladdr >> shift;
+      if (chunk_is_head(h, lvl, idx)) {
+         break;
+      }
+      if (unlikely(0 == lvl)) {
+         fprintf(stderr, "ERR: %p is not an allocated address.\n", address);
+         return;
+      }
+      ASSERT(0 != lvl && shift >= 4);
+   }
+
+   U32 const head_lvl = lvl;
+   USZ tot_size = 0;
+   U32 const sidx = idx & 0x0FU;
+   if (unlikely(15 == sidx)) {
+      tot_size = (USZ)1 << shift;
+   } else {
+      U32 const*bs_lvl = BITFIELD(h, lvl);
+      U32 const bits = BF_LOAD(&bs_lvl[idx >> 4]) << ((sidx + 1) << 1);
+      if (unlikely(0 == bits)) {
+         ASSERT(0 != sidx);
+         tot_size = (USZ)(16 - sidx) << shift;
+      } else {
+         U32 allocs = count_leading_allocs(bits) + 1;
+         ASSERT(sidx + allocs < 16);
+         tot_size = (USZ)allocs << shift;
+         while (eSTATUS_SPLIT == chunk_get_status(bs_lvl, idx + allocs)) {
+            ASSERT(0 != lvl);
+            lvl -= 1;
+            bs_lvl = BITFIELD(h, lvl);
+            ASSERT(shift >= 4);
+            shift -= 4;
+            idx = (reladdr + tot_size) >> shift;
+            allocs = count_leading_allocs(BF_LOAD(&bs_lvl[idx >> 4]));
+            tot_size += (USZ)allocs << shift;
+         }
+      }
+   }
+   heap_release_priv(h, reladdr, head_lvl, tot_size);
+}
+/* -------------------------------------------------------------------------- */
+/* number of free chunks from entry sub of a bitfield word */
+static inline U32 free_run_length(U32 const stat, U32 const sub)
+{
+   ASSERT(sub < 16);
+   U32 const x = (stat << (sub << 1)) ^ ALL_FREE;
+   return 0 == x ? 16 : CLZ(x) >> 1;
+}
+/* -------------------------------------------------------------------------- */
+/* chunk idx of level lvl is allocated (its children are all free) and the
+ * block ends sz bytes into it: split it and list what's past the end */
+static void chunk_cut(heap*const h, U32 lvl, USZ idx, USZ const sz)
+{
+   U32 shift = (lvl + 1) << 2;
+   ASSERT(0 != sz && sz < ((USZ)1 << shift));
+   for (;;) {
+      bf_set_split(BITFIELD(h, lvl), idx);
+      lvl -= 1;
+      shift -= 4;
+      idx <<= 4;
+      ASSERT(ALL_FREE == BITFIELD(h, lvl)[idx >> 4]);
+      U32 const cnt = (sz >> shift) & 0x0FU;
+      USZ const rest = sz & (((USZ)1 << shift) - 1);
+      if (0 != cnt) {
+         bf_set_alloc_multi(BITFIELD(h, lvl), idx, cnt);
+      }
+      U32 const used = cnt + (0 != rest);
+      if (used < 16) {
+         chunk*const c = (chunk*)(HDATA(h) + ((idx + used) << shift));
+         new_head(h, c, (lvl << 4) - lvl, 16 - used);
+      }
+      if (0 == rest) {
+         break;
+      }
+      idx += cnt;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* single-level blocks carved from a chunk of the level above, the heap is
+ * locked. Only done when the best fit is above that level anyway, i.e. when
+ * the first allocation would split such a chunk: returns 0 otherwise */
+static U32 heap_carve_priv(heap*const h, USZ const needed_sz, void**const out,
+                           U32 const n)
+{
+   U32 const lvl = size_level(needed_sz);
+   U32 const shift = (lvl + 1) << 2;
+   U32 const cnt = needed_sz >> shift;
+   if (0 != (needed_sz & (((USZ)1 << shift) - 1)) || lvl + 1 >= h->bscnt) {
+      return 0;
+   }
+   U32 const per = 16 / cnt;
+   if (n < per || next_available_head_index(h, needed_sz) < (lvl + 1) * 15) {
+      return 0;
+   }
+   U8*const c = region_alloc_priv(h, (USZ)1 << (shift + 4));
+   if (NULL == c) {
+      return 0;
+   }
+   USZ const reladdr = c - HDATA(h);
+#ifdef HEAP_STRIPED
+   stripe_ctx ctx;
+   stripe_lock(h, &ctx, lvl + 1, reladdr);
+#endif
+   bf_set_split(BITFIELD(h, lvl + 1), reladdr >> (shift + 4));
+#ifdef HEAP_STRIPED
+   stripe_unlock(h, &ctx);
+#endif
+   /* the children of the chunk are ours until the rest of them is listed */
+   USZ const idx = reladdr >> shift;
+   for (U32 i = 0; i < per; i++) {
+      bf_set_alloc_head(BITFIELD(h, lvl), idx + i * cnt);
+      if (1 != cnt) {
+         bf_set_alloc_multi(BITFIELD(h, lvl), idx + i * cnt + 1, cnt - 1);
+      }
+      out[i] = c + ((USZ)(i * cnt) << shift);
+   }
+   if (per * cnt < 16) {
+      chunk*const r = (chunk*)(c + ((USZ)(per * cnt) << shift));
+      new_head(h, r, (lvl << 4) - lvl, 16 - per * cnt);
+   }
+   STAT_ADD(h, allocs, per - 1);
+   return per;
+}
+#ifndef HEAP_STRIPED
+/* -------------------------------------------------------------------------- */
+static inline U32 alloc_run_length(U32 const stat, U32 const sub)
+{
+   if (15 == sub) {
+      return 1;
+   }
+   U32 const bits = stat << ((sub + 1) << 1);
+   return 1 + (0 == bits ? 15 - sub : count_leading_allocs(bits));
+}
+/* -------------------------------------------------------------------------- */
+/* the blocks of the sorted p[] that directly follow p[0] in the bitfield word
+ * of its head are merged into it, so they're freed in a single pass. Returns
+ * how many blocks p[0] now covers, the heap is locked */
+static U32 blocks_merge(heap*const h, void*const*const p, U32 const n)
+{
+   U8 const*const a = (U8 const*)p[0];
+   U8*const base = HDATA(h);
+   if (n < 2 || a < base + h->hoff || a >= base + h->hsize ||
+       0 != ((USZ)a & 0x0FU)) {
+      return 1;
+   }
+   USZ const reladdr = a - base;
+   U32 lvl = (CTZW(reladdr | top_level_size(h)) >> 2) - 1;
+   U32 shift = (lvl + 1) << 2;
+   USZ idx;
+   for (;; --lvl, shift -= 4) {
+      idx = reladdr >> shift;
+      if (chunk_is_head(h, lvl, idx)) {
+         break;
+      }
+      if (0 == lvl) {
+         return 1;
+      }
+   }
+   U32*const bf = BITFIELD(h, lvl);
+   U32 const sub = idx & 0x0FU;
+   U32 len = alloc_run_length(bf[idx >> 4], sub);
+   U32 i = 1;
+   for (; i < n && sub + len < 16; i++) {
+      USZ const next = idx + len;
+      if ((U8 const*)p[i] != base + (next << shift) ||
+            eSTATUS_ALLOC_HEAD != chunk_get_status(bf, next)) {
+         break;
+      }
+      U32 const len_next = alloc_run_length(bf[idx >> 4], sub + len);
+      /* a block can't be a whole chunk of the level above */
+      if (16 == len + len_next) {
+         break;
+      }
+      bf_set_alloc_multi(bf, next, 1);
+      len += len_next;
+   }
+   /* one free for all of them */
+   STAT_ADD(h, frees, i - 1);
+   return i;
+}
+/* -------------------------------------------------------------------------- */
+/* chunk q of level lvl holds the last sz bytes of a block: is the rest of it
+ * free? If absorb, the whole chunk is taken by the block */
+static bool chunk_tail_free(heap*const h, U32 lvl, USZ q, USZ const sz,
+                            bool const absorb)
+{
+   U32 shift = (lvl + 1) << 2;
+   ASSERT(0 != sz && sz < ((USZ)1 << shift));
+   for (;;) {
+      lvl -= 1;
+      shift -= 4;
+      USZ const idx = q << 4;
+      U32*const bf = &BITFIELD(h, lvl)[idx >> 4];
+      U32 const cnt = (sz >> shift) & 0x0FU;
+      USZ const rest = sz & (((USZ)1 << shift) - 1);
+      U32 const used = cnt + (0 != rest);
+      if (used < 16) {
+         if (free_run_length(*bf, used) != 16 - used) {
+            ASSERT(!absorb);
+            return false;
+         }
+         if (absorb) {
+            chunk const*const c = (chunk*)(HDATA(h) + ((idx + used) << shift));
+            chunk_remove_from_list(h, c, (lvl << 4) - lvl + 15 - used);
+         }
+      }
+      if (absorb) {
+         BF_STORE(bf, ALL_FREE);
+      }
+      if (0 == rest) {
+         return true;
+      }
+      q = idx + cnt;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* chunk r of level lvl is split: are its first sz bytes free? If absorb,
+ * they're taken by the block */
+static bool chunk_head_free(heap*const h, U32 lvl, USZ r, USZ const sz,
+                            bool const absorb)
+{
+   U32 shift = (lvl + 1) << 2;
+   ASSERT(0 != sz && sz < ((USZ)1 << shift));
+   for (;;) {
+      if (eSTATUS_SPLIT != chunk_get_status(BITFIELD(h, lvl), r)) {
+         ASSERT(!absorb);
+         return false;
+      }
+      lvl -= 1;
+      shift -= 4;
+      USZ const idx = r << 4;
+      U32 const cnt = (sz >> shift) & 0x0FU;
+      USZ const rest = sz & (((USZ)1 << shift) - 1);
+      U32 const run = free_run_length(BITFIELD(h, lvl)[idx >> 4], 0);
+      if (run < cnt) {
+         ASSERT(!absorb);
+         return false;
+      }
+      bool const cut = 0 != rest && run > cnt;
+      if (absorb) {
+         U32 const lvl15 = (lvl << 4) - lvl;
+         U32 const past = cnt + (0 != rest);
+         if (0 != run) {
+            chunk_remove_from_list(h, (chunk*)(HDATA(h) + (idx << shift)),
+                                   lvl15 + run - 1);
+         }
+         if (0 != cnt) {
+            bf_set_alloc_multi(BITFIELD(h, lvl), idx, cnt);
+         }
+         if (cut) {
+            chunk_cut(h, lvl, idx + cnt, rest);
+         }
+         if (run > past) {
+            new_head(h, (chunk*)(HDATA(h) + ((idx + past) << shift)), lvl15,
+                     run - past);
+         }
+      }
+      if (0 == rest || cut) {
+         return true;
+      }
+      /* the next chunk isn't free, it must be split */
+      r = idx + cnt;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* A block is a run of chunks at the level of its highest size nibble, then
+ * the leading chunks of the split chunk that follows at each lower level.
+ * Resizing it in place only changes the levels below the highest nibble that
+ * differs between both sizes (k): above k the layout is the same. */
+/* -------------------------------------------------------------------------- */
+/* the block at reladdr of size sz keeps its first nsz bytes, the heap is
+ * locked */
+static void heap_shrink_priv(heap*const h, USZ const reladdr, USZ const sz,
+                             USZ const nsz)
+{
+   ASSERT(nsz < sz && 0 == (nsz & 0x0FU));
+   U32 const k = size_level(sz ^ nsz);
+   U32 const shift = (k + 1) << 2;
+   USZ const mask = ((USZ)1 << shift) - 1;
+   USZ const idx0 = (reladdr + (nsz & ~((((USZ)1 << shift) << 4) - 1))) >> shift;
+   U32 const n = (sz >> shift) & 0x0FU;
+   U32 const m = (nsz >> shift) & 0x0FU;
+   ASSERT(m < n);
+   USZ first = idx0 + m;
+   if (0 != (nsz & mask)) {
+      chunk_cut(h, k, first, nsz & mask);
+      first += 1;
+   }
+   /* the block may now start at a lower level */
+   U32 const top = size_level(nsz);
+   bf_set_alloc_head(BITFIELD(h, top), reladdr >> ((top + 1) << 2));
+
+   /* what's left is a block of its own: free it */
+   if (first < idx0 + n) {
+      bf_set_alloc_head(BITFIELD(h, k), first);
+      STAT_ADD(h, allocs, 1);
+      heap_free_priv(h, HDATA(h) + (first << shift));
+   } else if (0 != (sz & mask)) {
+      USZ const rel = (idx0 + n) << shift;
+      U32 const lvl = size_level(sz & mask);
+      bf_set_alloc_head(BITFIELD(h, lvl), rel >> ((lvl + 1) << 2));
+      STAT_ADD(h, allocs, 1);
+      heap_free_priv(h, HDATA(h) + rel);
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* extends the block at reladdr of size sz to nsz bytes over the free chunks
+ * that follow it if possible, the heap is locked */
+static bool heap_grow_priv(heap*const h, USZ const reladdr, USZ const sz,
+                           USZ const nsz)
+{
+   ASSERT(nsz > sz && 0 == (nsz & 0x0FU));
+   if (nsz > h->hsize - reladdr) {
+      return false;
+   }
+   /* a block is aligned on its highest nibble */
+   U32 const top = size_level(nsz);
+   U32 const top_shift = (top + 1) << 2;
+   if (0 != (reladdr & (((USZ)1 << top_shift) - 1))) {
+      return false;
+   }
+   U32 k = size_level(sz ^ nsz);
+   /* the block has no chunk at level k or below: it's the level of its
+    * lowest nibble that now continues into the split chunk that follows */
+   U32 const low = (CTZW(sz) >> 2) - 1;
+   if (low > k) {
+      k = low;
+   }
+   U32 const shift = (k + 1) << 2;
+   USZ const mask = ((USZ)1 << shift) - 1;
+   USZ const idx0 = (reladdr + (nsz & ~((((USZ)1 << shift) << 4) - 1))) >> shift;
+   U32 const sub = idx0 & 0x0FU;
+   U32 const n = (sz >> shift) & 0x0FU;
+   U32 const m = (nsz >> shift) & 0x0FU;
+   USZ const lo = sz & mask;
+   USZ const nlo = nsz & mask;
+   ASSERT(m > n || (m == n && 0 == lo && 0 != nlo));
+   U32 const end = sub + m;
+   if (end + (0 != nlo) > 16) {
+      return false;
+   }
+   /* chunks [s0, end) must be free, as well as the start of chunk end */
+   U32*const bf = BITFIELD(h, k);
+   U32 const s0 = sub + n + (0 != lo);
+   U32 const run = s0 < 16 ? free_run_length(bf[idx0 >> 4], s0) : 0;
+   if (s0 + run < end) {
+      return false;
+   }
+   USZ const wbase = idx0 - sub;
+   bool const cut = 0 != nlo && s0 + run > end;
+   if (0 != lo && !chunk_tail_free(h, k, idx0 + n, lo, false)) {
+      return false;
+   }
+   if (0 != nlo && !cut && !chunk_head_free(h, k, wbase + end, nlo, false)) {
+      return false;
+   }
+
+   if (0 != lo) {
+      (void)chunk_tail_free(h, k, idx0 + n, lo, true);
+   }
+   U32 const lvl15 = (k << 4) - k;
+   bool const take = end > s0 || cut;
+   if (take) {
+      chunk*const c = (chunk*)(HDATA(h) + ((wbase + s0) << shift));
+      chunk_remove_from_list(h, c, lvl15 + run - 1);
+   }
+   if (m > n) {
+      bf_set_alloc_multi(bf, idx0 + n, m - n);
+   }
+   if (0 != nlo) {
+      if (cut) {
+         chunk_cut(h, k, wbase + end, nlo);
+      } else {
+         (void)chunk_head_free(h, k, wbase + end, nlo, true);
+      }
+   }
+   U32 const past = end + (0 != nlo);
+   if (take && s0 + run > past) {
+      chunk*const c = (chunk*)(HDATA(h) + ((wbase + past) << shift));
+      new_head(h, c, lvl15, s0 + run - past);
+   }
+   /* the block may now start at a higher level */
+   bf_set_alloc_head(BITFIELD(h, top), reladdr >> top_shift);
+   return true;
+}
+#endif
+/* -------------------------------------------------------------------------- */
+#ifdef HEAP_THREAD_SAFE
+typedef struct _tcache {
+   heap*owner;
+   struct _tcache*prev;
+   struct _tcache*next;
+   U32 count[HEAP_TCACHE_CLASSES];
+   void*blocks[HEAP_TCACHE_CLASSES][HEAP_TCACHE_DEPTH];
+} tcache;
+
+static __thread tcache tls_tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+/* -------------------------------------------------------------------------- */
+/* a block of sz bytes (a multiple of SMALL_STEP), heap locked */
+static void*small_alloc_priv(heap*const h, USZ const sz)
+{
+#ifdef HEAP_SLAB
+   return slab_alloc(h, sz);
+#else
+   void*const p = heap_alloc_priv(h, sz);
+   if (NULL != p) {
+      block_claim(h, p, sz, false);
+   }
+   return p;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+/* gives the last cnt cached blocks of a class back to the heap, heap locked */
+static void tcache_release(heap*const h, tcache*const tc, U32 const cls,
+                           U32 const cnt)
+{
+   ASSERT(cnt <= tc->count[cls]);
+   for (U32 i = tc->count[cls] - cnt; i < tc->count[cls]; i++) {
+      heap_free_priv(h, tc->blocks[cls][i]);
+   }
+   tc->count[cls] -= cnt;
+}
+/* -------------------------------------------------------------------------- */
+static void tcache_detach(tcache*const tc)
+{
+   heap*const h = tc->owner;
+   if (NULL == h) {
+      return;
+   }
+   heap_lock(h);
+   for (U32 cls = 0; cls < HEAP_TCACHE_CLASSES; cls++) {
+      tcache_release(h, tc, cls, tc->count[cls]);
+   }
+   if (NULL != tc->next) {
+      tc->next->prev = tc->prev;
+   }
+   if (NULL != tc->prev) {
+      tc->prev->next = tc->next;
+   } else {
+      ASSERT(h->tcaches == tc);
+      h->tcaches = tc->next;
+   }
+   heap_unlock(h);
+   tc->owner = NULL;
+}
+/* -------------------------------------------------------------------------- */
+static void tcache_thread_exit(void*const arg)
+{
+   tcache_detach((tcache*)arg);
+}
+/* -------------------------------------------------------------------------- */
+static void tcache_key_create(void)
+{
+   (void)pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+/* -------------------------------------------------------------------------- */
+/* a thread's cache serves one heap at a time: using another heap flushes it */
+static void tcache_attach(heap*const h, tcache*const tc)
+{
+   tcache_detach(tc);
+   (void)pthread_once(&tcache_once, tcache_key_create);
+   (void)pthread_setspecific(tcache_key, tc);
+   heap_lock(h);
+   tc->prev = NULL;
+   tc->next = h->tcaches;
+   if (NULL != tc->next) {
+      tc->next->prev = tc;
+   }
+   h->tcaches = tc;
+   heap_unlock(h);
+   tc->owner = h;
+}
+/* -------------------------------------------------------------------------- */
+/* caches a block of size bytes (at most HEAP_TCACHE_MAX_SIZE) owned by the
+ * caller, gives half the class back to the heap when it is full */
+static void tcache_put(heap*const h, void*const address, USZ const size)
+{
+   tcache*const tc = &tls_tcache;
+   U32 const cls = size / SMALL_STEP - 1;
+   if (unlikely(tc->owner != h)) {
+      tcache_attach(h, tc);
+   }
+#ifdef DEBUG_BUILD
+   for (U32 i = 0; i < tc->count[cls]; i++) {
+      ASSERT(tc->blocks[cls][i] != address);
+   }
+#endif
+   if (unlikely(HEAP_TCACHE_DEPTH == tc->count[cls])) {
+      heap_lock(h);
+      tcache_release(h, tc, cls, HEAP_TCACHE_BATCH);
+      heap_unlock(h);
+   }
+   tc->blocks[cls][tc->count[cls]++] = address;
+}
+/* -------------------------------------------------------------------------- */
+/* the class is empty: allocate a batch of blocks with a single lock */
+static void*tcache_refill(heap*const h, tcache*const tc, U32 const cls,
+                          USZ const needed_sz)
+{
+   ASSERT(0 == tc->count[cls]);
+   heap_lock(h);
+   void*const result = small_alloc_priv(h, needed_sz);
+   if (NULL != result) {
+      for (U32 i = 1; i < HEAP_TCACHE_BATCH; i++) {
+         void*const p = small_alloc_priv(h, needed_sz);
+         if (NULL == p) {
+            break;
+         }
+         tc->blocks[cls][tc->count[cls]++] = p;
+      }
+   }
+   heap_unlock(h);
+   return result;
+}
+#endif
+#ifdef HEAP_TRACE
+/* -------------------------------------------------------------------------- */
+/* records are buffered and written by whichever thread fills the buffer */
+#ifndef HEAP_TRACE_BUFFER
+   #define HEAP_TRACE_BUFFER 4096U
+#endif
+typedef struct _trace {
+   int fd;
+   pthread_mutex_t lock;
+   U64 start;
+   U32 count;
+   heap_trace_rec buf[HEAP_TRACE_BUFFER];
+} trace;
+
+static U32 trace_threads;
+static __thread U32 trace_thread;
+/* -------------------------------------------------------------------------- */
+static U64 trace_now(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (U64)t.tv_sec * 1000000000U + t.tv_nsec;
+}
+/* -------------------------------------------------------------------------- */
+/* trace lock held */
+static void trace_flush(trace*const t)
+{
+   USZ const len = t->count * sizeof(heap_trace_rec);
+   if (len != (USZ)write(t->fd, t->buf, len)) {
+      fprintf(stderr, "ERR: couldn't write the trace.\n");
+   }
+   t->count = 0;
+}
+/* -------------------------------------------------------------------------- */
+static void trace_rec(heap*const h, U32 const op, void const*const p,
+                      USZ const size)
+{
+   trace*const t = h->trace;
+   if (unlikely(0 == trace_thread)) {
+      trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+   }
+   U64 const now = trace_now();
+   pthread_mutex_lock(&t->lock);
+   t->buf[t->count++] = (heap_trace_rec){
+      .time = now - t->start,
+      .id = (USZ)p,
+      .info = HEAP_TRACE_INFO(op, trace_thread, size),
+   };
+   if (HEAP_TRACE_BUFFER == t->count) {
+      trace_flush(t);
+   }
+   pthread_mutex_unlock(&t->lock);
+}
+   #define TRACE(h, op, p, size) \
+      if (unlikely(NULL != (h)->trace)) { trace_rec((h), (op), (p), (size)); }
+#else
+   #define TRACE(h, op, p, size) { }
+#endif
+/* -------------------------------------------------------------------------- */
+void*heap_alloc(heap*const h, USZ const sz)
+{
+   if (unlikely(0 == sz)) {
+      return NULL;
+   }
+
+   USZ const needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(needed_sz < sz)) {
+      return NULL;
+   }
+
+#if defined(HEAP_THREAD_SAFE) || defined(HEAP_SLAB)
+   if (needed_sz <= SMALL_MAX_SIZE) {
+      USZ const small_sz = SMALL_ROUND(sz);
+   #ifdef HEAP_THREAD_SAFE
+      tcache*const tc = &tls_tcache;
+      U32 const cls = small_sz / SMALL_STEP - 1;
+      ASSERT(SMALL_STEP != BASE_SIZE_MIN ||
+             cls == base_size_to_index(closest_base_size(small_sz)));
+      if (likely(tc->owner == h)) {
+         if (likely(0 != tc->count[cls])) {
+            void*const result = tc->blocks[cls][--tc->count[cls]];
+            TRACE(h, HEAP_TRACE_ALLOC, result, sz);
+            return result;
+         }
+      } else {
+         tcache_attach(h, tc);
+      }
+      void*const result = tcache_refill(h, tc, cls, small_sz);
+   #else
+      heap_lock(h);
+      void*const result = slab_alloc(h, small_sz);
+      heap_unlock(h);
+   #endif
+      TRACE(h, HEAP_TRACE_ALLOC, result, sz);
+      return result;
+   }
+#endif
+
+   heap_lock(h);
+   void*const result = heap_alloc_priv(h, needed_sz);
+   heap_unlock(h);
+   if (likely(NULL != result)) {
+      block_claim(h, result, needed_sz, false);
+   }
+   TRACE(h, HEAP_TRACE_ALLOC, result, sz);
+   return result;
+}
+/* -------------------------------------------------------------------------- */
+void*heap_calloc(heap*const h, USZ const nmemb, USZ const size)
+{
+   if (unlikely(0 != size && nmemb > SIZE_MAX / size)) {
+      return NULL;
+   }
+   USZ const sz = nmemb * size;
+   if (unlikely(0 == sz)) {
+      return NULL;
+   }
+
+   USZ const needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(needed_sz < sz)) {
+      return NULL;
+   }
+
+#if defined(HEAP_THREAD_SAFE) || defined(HEAP_SLAB)
+   /* cached blocks and slabs have been handed out already */
+   if (needed_sz <= SMALL_MAX_SIZE) {
+      void*const result = heap_alloc(h, sz);
+      if (NULL != result) {
+         memset(result, 0, sz);
+      }
+      return result;
+   }
+#endif
+
+   heap_lock(h);
+   void*const result = heap_alloc_priv(h, needed_sz);
+   heap_unlock(h);
+   if (likely(NULL != result)) {
+      block_claim(h, result, needed_sz, true);
+   }
+   TRACE(h, HEAP_TRACE_ALLOC, result, sz);
+   return result;
+}
+/* -------------------------------------------------------------------------- */
+void heap_free(heap*const h, void*const address)
+{
+   if (NULL != address) {
+      TRACE(h, HEAP_TRACE_FREE, address, 0);
+   }
+#ifdef HEAP_THREAD_SAFE
+   /* no lock needed to size a block owned by the caller: its own bitfield
+    * entries and those of its parents cannot change until it's freed, and
+    * the entries of its neighbours never read as a continuation of it */
+   USZ const size = heap_get_alloc_size(h, address);
+   if (0 != size && size <= HEAP_TCACHE_MAX_SIZE) {
+      tcache_put(h, address, size);
+      return;
+   }
+#endif
+
+   heap_lock(h);
+   heap_free_priv(h, address);
+   heap_unlock(h);
+}
+/* -------------------------------------------------------------------------- */
+void heap_free_sized(heap*const h, void*const address, USZ const size)
+{
+   USZ const needed_sz = (size + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(0 == needed_sz)) {
+      heap_free(h, address);
+      return;
+   }
+#ifdef HEAP_SLAB
+   /* a small block is a slab object, or a block when no slab could be had:
+    * sizing it tells which */
+   if (needed_sz <= HEAP_SLAB_MAX_SIZE) {
+      heap_free(h, address);
+      return;
+   }
+#endif
+   TRACE(h, HEAP_TRACE_FREE, address, 0);
+
+#ifdef HEAP_THREAD_SAFE
+   if (needed_sz <= HEAP_TCACHE_MAX_SIZE) {
+      ASSERT(needed_sz == heap_get_alloc_size(h, address));
+      tcache_put(h, address, needed_sz);
+      return;
+   }
+#endif
+
+   /* a block starts with its head entry, at the level of its highest size
+    * nibble: that entry is all we check */
+   heap*const r = region_of(h, address);
+   U8 const*const a = (__typeof(a))address;
+   U8*const base = HDATA(r);
+   USZ const reladdr = a - base;
+   U32 const head_lvl = size_level(needed_sz);
+   U32 const shift = (head_lvl + 1) << 2;
+   if (unlikely(a < base + r->hoff || a >= base + r->hsize
+                || head_lvl >= r->bscnt
+                || 0 != (reladdr & (((USZ)1 << shift) - 1))
+                || eSTATUS_ALLOC_HEAD != chunk_get_status(BITFIELD(r, head_lvl),
+                                                          reladdr >> shift))) {
+      fprintf(stderr, "ERR: %p is not an allocated address of %zu bytes.\n",
+              address, size);
+      return;
+   }
+   ASSERT(needed_sz == heap_get_alloc_size(h, address));
+
+   heap_lock(h);
+   heap_release_priv(r, reladdr, head_lvl, needed_sz);
+   heap_unlock(h);
+}
+/* -------------------------------------------------------------------------- */
+void*heap_aligned_alloc(heap*const h, USZ const alignment, USZ const sz)
+{
+   if (unlikely(0 == sz || 0 != (alignment & (alignment - 1)))) {
+      return NULL;
+   }
+
+   USZ const needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(needed_sz < sz)) {
+      return NULL;
+   }
+
+   /* the chunks of that level are aligned enough */
+   U32 const lvl = alignment <= BASE_SIZE_MIN ? 0 : (CTZW(alignment) - 1) >> 2;
+   U32 const top = size_level(needed_sz);
+   if (top >= lvl) {
+      /* a block is aligned on its highest nibble */
+   #ifdef HEAP_SLAB
+      /* a slab object on BASE_SIZE_MIN only, past its slab's header */
+      if (alignment > BASE_SIZE_MIN && needed_sz <= HEAP_SLAB_MAX_SIZE) {
+         heap_lock(h);
+         void*const p = heap_alloc_priv(h, needed_sz);
+         if (NULL != p) {
+            block_claim(h, p, needed_sz, false);
+         }
+         heap_unlock(h);
+         TRACE(h, HEAP_TRACE_ALLOC, p, sz);
+         return p;
+      }
+      return heap_alloc(h, needed_sz);
+   #else
+      return heap_alloc(h, sz);
+   #endif
+   }
+   if (unlikely(lvl >= h->bscnt)) {
+      return NULL;
+   }
+
+   /* take a whole chunk of that level and give back its end */
+   U32 const shift = (lvl + 1) << 2;
+   heap_lock(h);
+   U8*const result = heap_alloc_priv(h, (USZ)1 << shift);
+   if (likely(NULL != result)) {
+      heap*const r = region_of(h, result);
+      USZ const reladdr = result - HDATA(r);
+   #ifdef HEAP_STRIPED
+      /* its children are ours, but not the entries of its siblings */
+      stripe_ctx ctx;
+      stripe_lock(r, &ctx, lvl, reladdr);
+   #endif
+      chunk_cut(r, lvl, reladdr >> shift, needed_sz);
+      bf_set_alloc_head(BITFIELD(r, top), reladdr >> ((top + 1) << 2));
+   #ifdef HEAP_STRIPED
+      stripe_unlock(r, &ctx);
+   #endif
+   }
+   heap_unlock(h);
+   if (likely(NULL != result)) {
+      ASSERT(needed_sz == heap_get_alloc_size(h, result));
+      block_claim(h, result, needed_sz, false);
+   }
+   TRACE(h, HEAP_TRACE_ALLOC, result, sz);
+   return result;
+}
+/* -------------------------------------------------------------------------- */
+int heap_posix_memalign(heap*const h, void**const memptr, USZ const alignment,
+                        USZ const sz)
+{
+   if (0 != (alignment & (alignment - 1)) || alignment < sizeof(void*)) {
+      return EINVAL;
+   }
+   void*const result = heap_aligned_alloc(h, alignment, 0 == sz ? 1 : sz);
+   if (NULL == result) {
+      return ENOMEM;
+   }
+   *memptr = result;
+   return 0;
+}
+/* -------------------------------------------------------------------------- */
+void*heap_realloc(heap*const h, void*const address, USZ const sz)
+{
+   if (NULL == address) {
+      return heap_alloc(h, sz);
+   }
+   if (0 == sz) {
+      heap_free(h, address);
+      return NULL;
+   }
+
+   USZ const needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(needed_sz < sz)) {
+      return NULL;
+   }
+
+   heap_lock(h);
+   USZ const cur_sz = heap_get_alloc_size(h, address);
+   if (unlikely(0 == cur_sz)) {
+      heap_unlock(h);
+      fprintf(stderr, "ERR: %p is not an allocated address.\n", address);
+      return NULL;
+   }
+   bool done = needed_sz == cur_sz;
+#ifdef HEAP_SLAB
+   /* slab objects are resized by moving them */
+   bool const fixed = NULL != slab_of(region_of(h, address), address);
+   if (fixed) {
+      done = SMALL_ROUND(sz) == cur_sz;
+   }
+#elif !defined(HEAP_STRIPED)
+   bool const fixed = false;
+#endif
+#ifdef HEAP_STRIPED
+   /* resizing the block in place would need the locks of its neighbours, and
+    * it can't keep its old size either: heap_free_sized() relies on it */
+#else
+   if (!done && !fixed) {
+      heap*const r = region_of(h, address);
+      USZ const reladdr = (U8*)address - HDATA(r);
+      if (needed_sz < cur_sz) {
+         heap_shrink_priv(r, reladdr, cur_sz, needed_sz);
+         done = true;
+      } else {
+         done = heap_grow_priv(r, reladdr, cur_sz, needed_sz);
+         if (done) {
+            zmap_claim(r, reladdr + cur_sz, needed_sz - cur_sz, false);
+         }
+      }
+      ASSERT(!done || needed_sz == heap_get_alloc_size(h, address));
+   }
+#endif
+   heap_unlock(h);
+   if (done) {
+      TRACE(h, HEAP_TRACE_REALLOC, address, sz);
+      return address;
+   }
+
+   void*const result = heap_alloc(h, sz);
+   if (NULL != result) {
+      memcpy(result, address, cur_sz < sz ? cur_sz : sz);
+      heap_free_sized(h, address, cur_sz);
+   }
+   return result;
+}
+/* -------------------------------------------------------------------------- */
+void*heap_alloc_at_least(heap*const h, USZ const min, USZ*const actual)
+{
+   if (NULL != actual) {
+      *actual = 0;
+   }
+   if (unlikely(0 == min)) {
+      return NULL;
+   }
+
+   USZ const needed_sz = (min + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(needed_sz < min)) {
+      return NULL;
+   }
+
+   /* the best fit run is taken whole when its chunks are of the block's
+    * level: otherwise, the block is rounded to its closest base size so
+    * that only chunks of its level and above are split off */
+   heap_lock(h);
+   U32 const index = next_available_head_index(region_pick(h, needed_sz),
+                                               needed_sz);
+   USZ size = needed_sz;
+   if (index < BASE_SIZES_COUNT) {
+      USZ const found_sz = base_size_from_index(index);
+      size = closest_base_size(needed_sz);
+      if (size_level(found_sz) == size_level(size)) {
+         size = found_sz;
+      }
+   }
+   void*const result = heap_alloc_priv(h, size);
+   heap_unlock(h);
+   if (likely(NULL != result)) {
+      ASSERT(size == heap_get_alloc_size(h, result));
+      block_claim(h, result, size, false);
+      if (NULL != actual) {
+         *actual = size;
+      }
+   }
+   TRACE(h, HEAP_TRACE_ALLOC, result, size);
+   return result;
+}
+/* -------------------------------------------------------------------------- */
+U32 heap_alloc_batch(heap*const h, USZ const sz, U32 const n, void**const out)
+{
+   if (unlikely(0 == sz || 0 == n)) {
+      return 0;
+   }
+
+   USZ const needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(needed_sz < sz)) {
+      return 0;
+   }
+
+   U32 done = 0;
+   heap_lock(h);
+   while (done < n) {
+      U32 const carved = heap_carve_priv(region_pick(h, needed_sz), needed_sz,
+                                         out + done, n - done);
+      if (0 != carved) {
+         done += carved;
+         continue;
+      }
+      void*const p = heap_alloc_priv(h, needed_sz);
+      if (NULL == p) {
+         break;
+      }
+      out[done++] = p;
+   }
+   heap_unlock(h);
+   for (U32 i = 0; i < done; i++) {
+      block_claim(h, out[i], needed_sz, false);
+      TRACE(h, HEAP_TRACE_ALLOC, out[i], sz);
+   }
+   return done;
+}
+/* -------------------------------------------------------------------------- */
+/* Shell sort: no callback, nor recursion, nor allocation */
+static void address_sort(void**const a, U32 const n)
+{
+   static U32 const gaps[] = { 1577, 701, 301, 132, 57, 23, 10, 4, 1 };
+   for (U32 g = 0; g < sizeof(gaps) / sizeof(gaps[0]); g++) {
+      U32 const gap = gaps[g];
+      for (U32 i = gap; i < n; i++) {
+         void*const t = a[i];
+         U32 j = i;
+         for (; j >= gap && (USZ)a[j - gap] > (USZ)t; j -= gap) {
+            a[j] = a[j - gap];
+         }
+         a[j] = t;
+      }
+   }
+}
+/* -------------------------------------------------------------------------- */
+void heap_free_batch(heap*const h, void**const ptrs, U32 const n)
+{
+#ifdef HEAP_TRACE
+   for (U32 i = 0; i < n; i++) {
+      TRACE(h, HEAP_TRACE_FREE, ptrs[i], 0);
+   }
+#endif
+   address_sort(ptrs, n);
+   heap_lock(h);
+   for (U32 i = 0; i < n;) {
+   #ifdef HEAP_STRIPED
+      /* merging would need the lock of the blocks' level */
+      U32 const merged = 1;
+   #elif defined(HEAP_SLAB)
+      /* the bitfields below a slab are stale */
+      heap*const r = region_of(h, ptrs[i]);
+      U32 const merged = NULL != slab_of(r, ptrs[i]) ? 1 :
+                         blocks_merge(r, ptrs + i, n - i);
+   #else
+      U32 const merged = blocks_merge(region_of(h, ptrs[i]), ptrs + i, n - i);
+   #endif
+      heap_free_priv(h, ptrs[i]);
+      i += merged;
+   }
+   heap_unlock(h);
+}
+/* -------------------------------------------------------------------------- */
+void heap_set_zeroed(heap*const h)
+{
+   heap_lock(h);
+   memset(ZMAP(h), 0, (((h->hsize >> ZERO_SHIFT) + 32) >> 5) * sizeof(U32));
+   heap_unlock(h);
+}
+/* -------------------------------------------------------------------------- */
+void heap_tcache_flush(heap*const h)
+{
+#ifdef HEAP_THREAD_SAFE
+   if (tls_tcache.owner == h) {
+      tcache_detach(&tls_tcache);
+   }
+#endif
+}
+/* -------------------------------------------------------------------------- */
+void heap_destroy(heap *h)
+{
+   ASSERT(h != NULL);
+   heap_trace_stop(h);
+#ifdef HEAP_THREAD_SAFE
+   /* the blocks still cached by other threads go away with the heap */
+   heap_lock(h);
+   for (struct _tcache*tc = h->tcaches; NULL != tc; tc = tc->next) {
+      memset(tc->count, 0, sizeof(tc->count));
+      tc->owner = NULL;
+   }
+   heap_unlock(h);
+#endif
+   while (NULL != h) {
+      heap*const next = h->next;
+   #if defined(HEAP_THREAD_SAFE) || defined(HEAP_SHARED)
+      pthread_mutex_destroy(&h->lock);
+   #endif
+   #ifdef HEAP_SHARED
+      /* a heap file can be opened again */
+      if (h->file) {
+         msync(HDATA(h), h->hsize, MS_SYNC);
+      } else {
+         h->magic = 0;
+      }
+   #endif
+   #ifdef HEAP_STRIPED
+      pthread_mutex_destroy(&h->upper);
+      for (U32 i = 0; i < HEAP_STRIPE_LOCKS; i++) {
+         pthread_mutex_destroy(&h->stripes[i]);
+      }
+      for (U32 i = 0; i < BASE_SIZES_COUNT; i++) {
+         pthread_mutex_destroy(&h->classes[i]);
+      }
+      pthread_mutex_destroy(&h->regions);
+   #endif
+      U8*const data = HDATA(h);
+      USZ const size = h->hsize;
+      bool const mapped = h->mapped;
+      if (META_ALLOC == h->meta) {
+         HEAP_META_FREE(h, heap_bookkeeping_size(size));
+      }
+      /* with META_REGION, h goes away with its region */
+      if (mapped) {
+         munmap(data, size);
+      }
+      h = next;
+   }
+   return;
+}
+/* -------------------------------------------------------------------------- */
+int heap_add_region(heap*const h, U8*const address, USZ const size)
+{
+#ifdef HEAP_SHARED
+   /* the regions list holds the addresses of a single process */
+   if (HEAP_SHARED_MAGIC == h->magic) {
+      fprintf(stderr, "ERR: a shared heap has a single region.\n");
+      return -1;
+   }
+#endif
+   for (heap const*r = h; NULL != r; r = region_next(r)) {
+      if (address < HDATA(r) + r->hsize &&
+          HDATA(r) + r->hoff < address + size) {
+         fprintf(stderr, "ERR: region %p overlaps the heap.\n", address);
+         return -1;
+      }
+   }
+   heap*const n = region_create(h, address, size);
+   if (NULL == n) {
+      return -1;
+   }
+   n->rel_lvl = h->rel_lvl;
+   n->rel_flags = h->rel_flags;
+   n->policy = h->policy;
+#ifdef HEAP_STRIPED
+   pthread_mutex_lock(&h->regions);
+#else
+   heap_lock(h);
+#endif
+   heap*last = h;
+   while (NULL != last->next) {
+      last = last->next;
+   }
+   __atomic_store_n(&last->next, n, __ATOMIC_RELEASE);
+#ifdef HEAP_STRIPED
+   pthread_mutex_unlock(&h->regions);
+#else
+   heap_unlock(h);
+#endif
+   return 0;
+}
+/* -------------------------------------------------------------------------- */
+void heap_set_growth(heap*const h, USZ const region_size)
+{
+#ifdef HEAP_SHARED
+   if (HEAP_SHARED_MAGIC == h->magic) {
+      fprintf(stderr, "ERR: a shared heap has a single region.\n");
+      return;
+   }
+#endif
+   USZ const size = region_size & ~(USZ)(BASE_SIZE_MIN - 1);
+   h->grow = size > HEAP_SIZE_MAX ? HEAP_SIZE_MAX : size;
+}
+/* -------------------------------------------------------------------------- */
+int heap_set_release(heap*const h, USZ const min_size, U32 const flags)
+{
+   U32 lvl = RELEASE_OFF;
+   if (0 != min_size) {
+      if (sysconf(_SC_PAGESIZE) > ((long)1 << ZERO_SHIFT)) {
+         fprintf(stderr, "ERR: pages larger than %u bytes can't be released.\n",
+                 1U << ZERO_SHIFT);
+         return -1;
+      }
+      lvl = RELEASE_LEVEL_MIN;
+      while (lvl < MAIN_BASE_SIZE_COUNT && ((USZ)16 << (lvl << 2)) < min_size) {
+         lvl++;
+      }
+   }
+   heap_lock(h);
+   for (heap*r = h; NULL != r; r = region_next(r)) {
+      r->rel_lvl = lvl;
+      r->rel_flags = flags;
+   }
+   heap_unlock(h);
+   return 0;
+}
+/* -------------------------------------------------------------------------- */
+int heap_set_policy(heap*const h, U32 const policy)
+{
+   if (HEAP_POLICY_LIFO != policy && HEAP_POLICY_ADDRESS != policy) {
+      fprintf(stderr, "ERR: unknown placement policy %u.\n", policy);
+      return -1;
+   }
+#ifdef HEAP_STRIPED
+   /* the bitfield words can't be read without their stripe locks */
+   if (HEAP_POLICY_LIFO != policy) {
+      fprintf(stderr, "ERR: HEAP_STRIPED heaps only have the LIFO policy.\n");
+      return -1;
+   }
+#endif
+   heap_lock(h);
+   for (heap*r = h; NULL != r; r = region_next(r)) {
+      for (U32 i = 0; i < r->hdcnt; i++) {
+         r->lowest[i] = 0;
+      }
+      r->policy = (U8)policy;
+   }
+   heap_unlock(h);
+   return 0;
+}
+/* -------------------------------------------------------------------------- */
+#ifndef HEAP_STRIPED
+/* the entry of handle hd, NULL (and a message) if it's not one. The heap is
+ * locked */
+static hentry*handle_entry(heap const*const h, heap_handle const hd)
+{
+   hentry*const tab = (hentry*)HEAP_GET(h, htab);
+   if (unlikely(0 == hd || hd > h->hcount || 0 == tab[hd - 1].size)) {
+      fprintf(stderr, "ERR: %u is not a handle.\n", hd);
+      return NULL;
+   }
+   return &tab[hd - 1];
+}
+/* -------------------------------------------------------------------------- */
+/* doubles the handles table, a block of the heap itself. The heap is locked */
+static bool handles_grow(heap*const h)
+{
+   U32 const count = 0 == h->hcount ? 64 : 2 * h->hcount;
+   if (count < h->hcount) {
+      return false;
+   }
+   USZ const bytes = (USZ)count * sizeof(hentry);
+   hentry*const tab = heap_alloc_priv(h, bytes);
+   if (NULL == tab) {
+      return false;
+   }
+   block_claim(h, tab, bytes, false);
+   hentry*const old = (hentry*)HEAP_GET(h, htab);
+   if (NULL != old) {
+      memcpy(tab, old, h->hcount * sizeof(hentry));
+      heap_free_priv(h, old);
+   }
+   /* the new entries go to the front of the free ones, in order */
+   for (U32 i = h->hcount; i < count; i++) {
+      tab[i] = (hentry){ .next = i + 2 };
+   }
+   tab[count - 1].next = h->hfree;
+   h->hfree = h->hcount + 1;
+   h->hcount = count;
+   HEAP_SET(h, htab, tab);
+   return true;
+}
+#endif
+/* -------------------------------------------------------------------------- */
+heap_handle heap_halloc(heap*const h, USZ const sz)
+{
+#ifdef HEAP_STRIPED
+   (void)h;
+   (void)sz;
+   fprintf(stderr, "ERR: HEAP_STRIPED heaps have no handles.\n");
+   return 0;
+#else
+   USZ const needed_sz = (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+   if (unlikely(0 == sz || needed_sz < sz)) {
+      return 0;
+   }
+   heap_handle hd = 0;
+   heap_lock(h);
+   if (0 != h->hfree || handles_grow(h)) {
+      /* a block of the bitfields, never a slab object nor a cached one: it
+       * may be moved */
+      U8*const p = heap_alloc_priv(h, needed_sz);
+      if (NULL != p) {
+         block_claim(h, p, needed_sz, false);
+         hd = h->hfree;
+         hentry*const e = &((hentry*)HEAP_GET(h, htab))[hd - 1];
+         h->hfree = e->next;
+         *e = (hentry){ .off = (USZ)p - (USZ)HDATA(h), .size = needed_sz };
+      }
+   }
+   heap_unlock(h);
+   return hd;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+void*heap_hlock(heap*const h, heap_handle const hd)
+{
+#ifdef HEAP_STRIPED
+   (void)h;
+   (void)hd;
+   return NULL;
+#else
+   void*p = NULL;
+   heap_lock(h);
+   hentry*const e = handle_entry(h, hd);
+   if (NULL != e) {
+      e->locks++;
+      p = HDATA(h) + e->off;
+   }
+   heap_unlock(h);
+   return p;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+void heap_hunlock(heap*const h, heap_handle const hd)
+{
+#ifdef HEAP_STRIPED
+   (void)h;
+   (void)hd;
+#else
+   heap_lock(h);
+   hentry*const e = handle_entry(h, hd);
+   if (NULL != e) {
+      if (0 == e->locks) {
+         fprintf(stderr, "ERR: handle %u is not locked.\n", hd);
+      } else {
+         e->locks--;
+      }
+   }
+   heap_unlock(h);
+#endif
+}
+/* -------------------------------------------------------------------------- */
+void heap_hfree(heap*const h, heap_handle const hd)
+{
+#ifdef HEAP_STRIPED
+   (void)h;
+   (void)hd;
+#else
+   if (0 == hd) {
+      return;
+   }
+   heap_lock(h);
+   hentry*const e = handle_entry(h, hd);
+   if (NULL != e) {
+      if (0 != e->locks) {
+         /* its address is still in use */
+         fprintf(stderr, "ERR: handle %u is locked.\n", hd);
+      } else {
+         heap_free_priv(h, HDATA(h) + e->off);
+         *e = (hentry){ .next = h->hfree };
+         h->hfree = hd;
+      }
+   }
+   heap_unlock(h);
+#endif
+}
+/* -------------------------------------------------------------------------- */
+#ifndef HEAP_STRIPED
+/* the chunk a block keeps from merging with free chunks: from the block's
+ * head level up, the first word that has free entries holds it. In the head
+ * level's word, that's the parent of the word, the block's own chunks being
+ * replaced by others otherwise. Above, the chunk in the word that holds the
+ * block, and that its neighbours there keep from merging as well. Its start
+ * and size go to *start and *psize; returns false if there is none */
+static bool block_pins(heap const*const r, USZ const reladdr, USZ const size,
+                       USZ*const start, USZ*const psize)
+{
+   U32 const head = size_level(size);
+   for (U32 lvl = head; lvl + 1 < r->bscnt; lvl++) {
+      U32 const shift = (lvl + 1) << 2;
+      U32 const stat = BITFIELD(r, lvl)[reladdr >> (shift + 4)];
+      if (0 != (stat & ~(stat << 1) & ALL_FREE)) {
+         *psize = (USZ)1 << (lvl == head ? shift + 4 : shift);
+         *start = reladdr & ~(*psize - 1);
+         return true;
+      }
+   }
+   return false;
+}
+/* -------------------------------------------------------------------------- */
+/* the free chunk heap_alloc_priv() cuts a block of size bytes from with
+ * POLICY_LOWEST, and its size in *found. NULL if there is none */
+static chunk*lowest_fit(heap*const h, USZ const size, USZ*const found)
+{
+   heap*const r = region_pick(h, size);
+   U32 index = next_available_head_index(r, size);
+   if (index >= BASE_SIZES_COUNT) {
+      return NULL;
+   }
+   chunk*const c = heads_lowest(r, &index);
+   *found = base_size_from_index(index);
+   return c;
+}
+/* -------------------------------------------------------------------------- */
+/* moves the block p of size bytes if it keeps a chunk from merging, returns
+ * where to or NULL. The heap is locked */
+static U8*block_move(heap*const h, U8*const p, USZ const size)
+{
+   heap const*const r = region_of(h, p);
+   USZ start, psize;
+   if (!block_pins(r, p - HDATA(r), size, &start, &psize)) {
+      return NULL;
+   }
+   /* only downwards, out of the chunk it pins: blocks can't go round in
+    * circles, and the chunk can merge once the others are gone. The free
+    * chunk the block would be cut from tells without allocating */
+   U8 const*const chk = HDATA(r) + start;
+   USZ found;
+   U8 const*const c = (U8 const*)lowest_fit(h, size, &found);
+   if (NULL == c || c >= p || (c >= chk && c + found <= chk + psize)) {
+      return NULL;
+   }
+   U8*const q = heap_alloc_priv(h, size);
+   if (NULL == q) {
+      return NULL;
+   }
+   if (q >= p || (q < chk + psize && q + size > chk)) {
+      heap_free_priv(h, q);
+      return NULL;
+   }
+   block_claim(h, q, size, false);
+   memcpy(q, p, size);
+   heap_free_priv(h, p);
+   return q;
+}
+#endif
+/* -------------------------------------------------------------------------- */
+USZ heap_compact(heap*const h, USZ const budget)
+{
+#ifdef HEAP_STRIPED
+   (void)h;
+   (void)budget;
+   return 0;
+#else
+   USZ moved = 0;
+   heap_lock(h);
+   if (0 == h->hcount) {
+      heap_unlock(h);
+      return 0;
+   }
+   /* blocks move to the lowest free chunks that fit, in the regions there
+    * are */
+   U8 const policy = h->policy;
+   USZ const grow = h->grow;
+   h->grow = 0;
+   for (heap*r = h; NULL != r; r = region_next(r)) {
+      if (HEAP_POLICY_LIFO == policy) {
+         for (U32 i = 0; i < r->hdcnt; i++) {
+            r->lowest[i] = 0;
+         }
+      }
+      r->policy = POLICY_LOWEST;
+   }
+
+   /* the handles table is a block like the others */
+   USZ const tsize = (USZ)h->hcount * sizeof(hentry);
+   if (tsize <= budget) {
+      U8*const t = block_move(h, (U8*)HEAP_GET(h, htab), tsize);
+      if (NULL != t) {
+         HEAP_SET(h, htab, (hentry*)t);
+         moved += tsize;
+      }
+   }
+   hentry*const tab = (hentry*)HEAP_GET(h, htab);
+   for (U32 n = 0; n < h->hcount && moved < budget; n++) {
+      hentry*const e = &tab[h->hnext];
+      h->hnext = h->hnext + 1 < h->hcount ? h->hnext + 1 : 0;
+      if (0 == e->size || 0 != e->locks || e->size > budget - moved) {
+         continue;
+      }
+      U8*const q = block_move(h, HDATA(h) + e->off, e->size);
+      if (NULL != q) {
+         e->off = (USZ)q - (USZ)HDATA(h);
+         moved += e->size;
+      }
+   }
+
+   for (heap*r = h; NULL != r; r = region_next(r)) {
+      r->policy = policy;
+   }
+   h->grow = grow;
+   heap_unlock(h);
+   return moved;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+USZ heap_trim(heap*const h)
+{
+   USZ done = 0;
+   heap_lock(h);
+   for (heap*r = h; NULL != r; r = region_next(r)) {
+      if (r->rel_lvl >= r->bscnt) {
+         continue;
+      }
+      for (U32 i = r->rel_lvl * 15; i < r->hdcnt; i++) {
+         USZ const size = (USZ)(i % 15 + 1) << ((i / 15 + 1) << 2);
+      #ifdef HEAP_STRIPED
+         /* a listed run can't be taken or merged without that lock */
+         pthread_mutex_lock(&r->classes[i]);
+      #endif
+         for (chunk const*c = get_head(r, i); NULL != c; c = get_next(r, c)) {
+            done += region_release(r, (U8 const*)c - HDATA(r), size);
+         }
+      #ifdef HEAP_STRIPED
+         pthread_mutex_unlock(&r->classes[i]);
+      #endif
+      }
+   }
+   heap_unlock(h);
+   return done;
+}
+/* -------------------------------------------------------------------------- */
+void heap_get_release_stats(heap*const h, USZ*const resident,
+                            USZ*const released)
+{
+   USZ total = 0, rel = 0;
+   for (heap const*r = h; NULL != r; r = region_next(r)) {
+      total += r->hsize - r->hoff;
+      rel += __atomic_load_n(&r->released, __ATOMIC_RELAXED);
+   }
+   *resident = total - rel;
+   *released = rel;
+}
+/* -------------------------------------------------------------------------- */
+/* the base size of the highest list of r headsbits shows as not empty */
+static USZ region_largest_free(heap const*const r)
+{
+   for (U32 w = (r->hdcnt + USZ_BITS - 1) / USZ_BITS; w-- > 0;) {
+      USZ x = HEADS_BITS_LOAD(r, w);
+      U32 const used = r->hdcnt - w * USZ_BITS;
+      if (used < USZ_BITS) {
+         x &= ~(USZ_ALL_ONES >> used);
+      }
+      if (0 != x) {
+         return base_size_from_index(w * USZ_BITS + USZ_BITS - 1 - CTZW(x));
+      }
+   }
+   return 0;
+}
+/* -------------------------------------------------------------------------- */
+USZ heap_largest_free(heap*const h)
+{
+   USZ largest = 0;
+   heap_lock(h);
+   for (heap const*r = h; NULL != r; r = region_next(r)) {
+      USZ const size = region_largest_free(r);
+      if (size > largest) {
+         largest = size;
+      }
+   }
+   heap_unlock(h);
+   return largest;
+}
+/* -------------------------------------------------------------------------- */
+_Static_assert(BASE_SIZES_COUNT <= HEAP_STATS_CLASSES, "FIXME");
+void heap_get_stats(heap*const h, heap_stats*const stats)
+{
+   memset(stats, 0, sizeof(*stats));
+   heap_lock(h);
+   for (heap*r = h; NULL != r; r = region_next(r)) {
+      stats->size += r->hsize - r->hoff;
+      stats->released += __atomic_load_n(&r->released, __ATOMIC_RELAXED);
+   #ifdef HEAP_STATS
+      stats->allocs += __atomic_load_n(&r->allocs, __ATOMIC_RELAXED);
+      stats->frees += __atomic_load_n(&r->frees, __ATOMIC_RELAXED);
+   #endif
+      /* only the lists headsbits shows as not empty */
+      for (U32 w = 0; w < HEADS_BITS_SIZE; w++) {
+         USZ x = HEADS_BITS_LOAD(r, w);
+         while (0 != x) {
+            U32 const i = w * USZ_BITS + CLZW(x);
+            x &= ~(HEADS_BITS_MSB >> CLZW(x));
+            if (i >= r->hdcnt) {
+               break;
+            }
+            U32 n = 0;
+         #ifdef HEAP_STRIPED
+            pthread_mutex_lock(&r->classes[i]);
+         #endif
+            for (chunk const*c = get_head(r, i); NULL != c; c = get_next(r, c)) {
+               n++;
+            }
+         #ifdef HEAP_STRIPED
+            pthread_mutex_unlock(&r->classes[i]);
+         #endif
+            USZ const size = base_size_from_index(i);
+            stats->free_runs[i] += n;
+            stats->free += n * size;
+            if (0 != n && size > stats->largest_free) {
+               stats->largest_free = size;
+            }
+         }
+      }
+   }
+   heap_unlock(h);
+   stats->allocated = stats->size - stats->free;
+   stats->live_blocks = stats->allocs - stats->frees;
+   if (0 != stats->free) {
+      stats->fragmentation = 1.0 - (double)stats->largest_free / stats->free;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* a walk in address order: the last block seen is only reported once the
+ * next one starts, as a block's tail may lie in the children of a split
+ * chunk and a free run may span several chunks of its level */
+typedef struct {
+   heap_walk_cb cb;
+   void*ctx;
+   U8*start;  /* of the region, its first block may start below */
+   U8*addr;
+   USZ size;  /* 0: nothing pending */
+   int used;
+   U32 lvl;   /* of a pending free run, which never leaves its word */
+   USZ word;
+} walk_st;
+/* -------------------------------------------------------------------------- */
+static int walk_flush(walk_st*const w)
+{
+   if (0 == w->size) {
+      return 0;
+   }
+   USZ size = w->size;
+   w->size = 0;
+   if (w->addr < w->start) {
+      USZ const below = w->start - w->addr;
+      if (size <= below) {
+         return 0;
+      }
+      w->addr = w->start;
+      size -= below;
+   }
+   return w->cb(w->ctx, w->addr, size, w->used);
+}
+/* -------------------------------------------------------------------------- */
+static int walk_start(walk_st*const w, U8*const addr, USZ const size,
+                      int const used, U32 const lvl, USZ const word)
+{
+   int const r = walk_flush(w);
+   w->addr = addr;
+   w->size = size;
+   w->used = used;
+   w->lvl = lvl;
+   w->word = word;
+   return r;
+}
+/* -------------------------------------------------------------------------- */
+static int walk_chunks(heap const*const h, walk_st*const w, U32 const lvl,
+                       USZ const idx, USZ const n)
+{
+   U32 const shift = (lvl + 1) << 2;
+   U32 const*const bf = BITFIELD(h, lvl);
+   int r = 0;
+   for (USZ i = 0; i < n && 0 == r; i++) {
+      USZ const c = idx + i;
+      U8*const addr = HDATA(h) + (c << shift);
+      /* whole words: the tail of a block, or a free top of the heap */
+      if (0 == (c & 0x0FU) && n - i >= 16) {
+         U32 const word = bf[c >> 4];
+         if (ALL_ALLOC == word) {
+            ASSERT(0 != w->size && w->used);
+            w->size += (USZ)16 << shift;
+            i += 15;
+            continue;
+         }
+         if (ALL_FREE == word) {
+            r = walk_start(w, addr, (USZ)16 << shift, 0, lvl, c >> 4);
+            i += 15;
+            continue;
+         }
+      }
+      switch (chunk_get_status(bf, c)) {
+      case eSTATUS_FREE:
+         if (0 != w->size && !w->used && w->lvl == lvl && w->word == c >> 4) {
+            w->size += (USZ)1 << shift;
+         } else {
+            r = walk_start(w, addr, (USZ)1 << shift, 0, lvl, c >> 4);
+         }
+         break;
+      case eSTATUS_ALLOC_HEAD:
+         r = walk_start(w, addr, (USZ)1 << shift, 1, lvl, c >> 4);
+         break;
+      case eSTATUS_ALLOC:
+         ASSERT(0 != w->size && w->used);
+         w->size += (USZ)1 << shift;
+         break;
+      default:
+         ASSERT(0 != lvl);
+         r = walk_chunks(h, w, lvl - 1, c << 4, 16);
+         break;
+      }
+   }
+   return r;
+}
+/* -------------------------------------------------------------------------- */
+/* the chunks of each level that aren't part of a chunk of the level above:
+ * the heap's size, nibble by nibble. The heap is locked */
+static int region_walk(heap*const h, walk_st*const w)
+{
+#ifdef HEAP_STRIPED
+   pthread_mutex_lock(&h->upper);
+   for (U32 i = 0; i < HEAP_STRIPE_LOCKS; i++) {
+      pthread_mutex_lock(&h->stripes[i]);
+   }
+#endif
+   int r = 0;
+   w->start = HDATA(h) + h->hoff;
+   for (U32 lvl = h->bscnt; lvl-- > 0 && 0 == r;) {
+      U32 const shift = (lvl + 1) << 2;
+      USZ const n = (h->hsize >> shift) & 0x0FU;
+      if (0 != n) {
+         r = walk_chunks(h, w, lvl, (h->hsize >> (shift + 4)) << 4, n);
+      }
+   }
+   if (0 == r) {
+      r = walk_flush(w);
+   }
+   w->size = 0;
+#ifdef HEAP_STRIPED
+   for (U32 i = HEAP_STRIPE_LOCKS; i-- > 0;) {
+      pthread_mutex_unlock(&h->stripes[i]);
+   }
+   pthread_mutex_unlock(&h->upper);
+#endif
+   return r;
+}
+/* -------------------------------------------------------------------------- */
+int heap_walk(heap*const h, heap_walk_cb const cb, void*const ctx)
+{
+   walk_st w = { .cb = cb, .ctx = ctx, .size = 0 };
+   int r = 0;
+   heap_lock(h);
+   for (heap*rg = h; NULL != rg && 0 == r; rg = region_next(rg)) {
+      r = region_walk(rg, &w);
+   }
+   heap_unlock(h);
+   return r;
+}
+/* -------------------------------------------------------------------------- */
+/* the map is written cell by cell as the walk goes */
+typedef struct {
+   FILE*out;
+   U8 const*base;
+   U32 shift;    /* of a cell */
+   USZ cell;     /* being filled */
+   USZ used;     /* bytes of it allocated */
+   USZ count;    /* cells in the region */
+   U32 format;
+} map_st;
+/* -------------------------------------------------------------------------- */
+static void map_cell(map_st*const m)
+{
+   USZ const size = (USZ)1 << m->shift;
+   if (HEAP_MAP_CSV == m->format) {
+      fprintf(m->out, "%p,%zu,%zu,%zu\n", (void const*)m->base,
+              m->cell << m->shift, size, m->used);
+      return;
+   }
+   if (0 == (m->cell & 63)) {
+      fprintf(m->out, "%12zx ", m->cell << m->shift);
+   }
+   fputc(0 == m->used ? '.' : size == m->used ? '#'
+         : (int)('1' + ((m->used * 9) >> m->shift)), m->out);
+   if (63 == (m->cell & 63) || m->cell + 1 == m->count) {
+      fputc('\n', m->out);
+   }
+}
+/* -------------------------------------------------------------------------- */
+static int map_block(void*const ctx, void*const address, USZ const size,
+                     int const used)
+{
+   map_st*const m = (map_st*)ctx;
+   USZ off = (U8 const*)address - m->base;
+   USZ const end = off + size;
+   while (off < end) {
+      USZ const cell = off >> m->shift;
+      if (cell != m->cell) {
+         ASSERT(cell == m->cell + 1);
+         map_cell(m);
+         m->cell = cell;
+         m->used = 0;
+      }
+      USZ const next = (cell + 1) << m->shift;
+      USZ const len = (end < next ? end : next) - off;
+      if (used) {
+         m->used += len;
       }
-      new_bf |= (ALL_FREE >> (32 - (bsize_sub << 1))) << (32 - inxt);
-      bf_lvl[idx >> 4] = new_bf;
-      U32 const tot = next + prev + bsize_sub;
-      ASSERT(tot <= 16 && (tot != 16 || lvl < MAIN_BASE_SIZE_COUNT));
-      if (tot != 16) {
-         chunk*const c = (chunk*)(base + ((idx - prev) << shift));
-         new_head(h, c, lvl15, tot);
-         break;
+      off += len;
+   }
+   return 0;
+}
+/* -------------------------------------------------------------------------- */
+int heap_dump_map(heap*const h, FILE*const out, U32 const lvl,
+                  U32 const format)
+{
+   if (lvl >= MAIN_BASE_SIZE_COUNT || format > HEAP_MAP_CSV) {
+      return -1;
+   }
+   map_st m = { .out = out, .shift = (lvl + 1) << 2, .format = format };
+   walk_st w = { .cb = map_block, .ctx = &m, .size = 0 };
+   if (HEAP_MAP_CSV == format) {
+      fprintf(out, "region,offset,size,allocated\n");
+   }
+   heap_lock(h);
+   for (heap*r = h; NULL != r; r = region_next(r)) {
+      m.base = HDATA(r);
+      m.cell = 0;
+      m.used = 0;
+      m.count = (r->hsize + ((USZ)1 << m.shift) - 1) >> m.shift;
+      if (HEAP_MAP_ASCII == format) {
+         fprintf(out, "region %p, %zu bytes, %zu bytes per cell "
+                 "('.' free, '#' allocated, 1-9 partly allocated):\n",
+                 (void const*)HDATA(r), r->hsize, (USZ)1 << m.shift);
       }
-      sub_empty = 1;
-      lvl += 1;
-      ASSERT(shift < 28);
-      shift += 4;
-      base_size = 0;
+      region_walk(r, &w);
+      map_cell(&m);
    }
-   ASSERT(heap_get_address_status(h, address) == eSTATUS_FREE);
    heap_unlock(h);
-   return;
+   return 0;
+}
+/* -------------------------------------------------------------------------- */
+int heap_trace_start(heap*const h, char const*const path)
+{
+#ifdef HEAP_TRACE
+   if (NULL != h->trace) {
+      heap_trace_stop(h);
+   }
+   trace*const t = (trace*)HEAP_META_ALLOC(sizeof(trace));
+   if (NULL == t) {
+      return -1;
+   }
+   t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (t->fd < 0) {
+      fprintf(stderr, "ERR: couldn't create %s.\n", path);
+      HEAP_META_FREE(t, sizeof(trace));
+      return -1;
+   }
+   pthread_mutex_init(&t->lock, NULL);
+   t->start = trace_now();
+   t->buf[0] = (heap_trace_rec){ .id = HEAP_TRACE_MAGIC,
+                                 .info = sizeof(heap_trace_rec) };
+   t->count = 1;
+   h->trace = t;
+   return 0;
+#else
+   (void)h; (void)path;
+   fprintf(stderr, "ERR: built without HEAP_TRACE.\n");
+   return -1;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+void heap_trace_stop(heap*const h)
+{
+#ifdef HEAP_TRACE
+   trace*const t = h->trace;
+   if (NULL == t) {
+      return;
+   }
+   h->trace = NULL;
+   trace_flush(t);
+   close(t->fd);
+   pthread_mutex_destroy(&t->lock);
+   HEAP_META_FREE(t, sizeof(trace));
+#else
+   (void)h;
+#endif
 }
 /* -------------------------------------------------------------------------- */
 #if 0
@@ -745,9 +3499,9 @@ void heap_free1(heap*const h, void*const address)
    U8 const*const a = (__typeof(a))address;
    U32 sub_empty = 0;
 
-   U8*const base = h->hdata;
+   U8*const base = HDATA(h);
 
-   if (unlikely(a < base || a >= base + h->hsize)) {
+   if (unlikely(a < base + h->hoff || a >= base + h->hsize)) {
       fprintf(stderr,"0x%08X is not an address within heap boundaries.\n",
                (U32)address);
       return;
@@ -780,8 +3534,8 @@ void heap_free1(heap*const h, void*const address)
 
       U32 const index = (addr - base) >> shift;
       U32 const sub = index & 0x0F;
-      U32 const stat = h->bitfield[lvl][index >> 4] ^ ~ALL_FREE;
-      bf_set_free_multi(h->bitfield[lvl], index, base_size);
+      U32 const stat = BITFIELD(h, lvl)[index >> 4] ^ ~ALL_FREE;
+      bf_set_free_multi(BITFIELD(h, lvl), index, base_size);
       U32 prev = 0, next = 0;
       U32 const inxt = sub + base_size;
       U32 const lvl15 = (lvl << 4) - lvl;
@@ -815,15 +3569,16 @@ void heap_free1(heap*const h, void*const address)
          chunk*const c = (chunk*)addr;
          U32 const hidx = lvl15 + tot - 1;
          ASSERT(hidx < h->hdcnt);
-         update_next(h, c, h->heads[hidx]);
+         chunk*const hd = get_head(h, hidx);
+         update_next(h, c, hd);
          update_prev(h, c, NULL);
          sub_empty = 0;
 
          update_head(h, hidx, c);
 
-         if (NULL != c->next) {
-            ASSERT(c->next->prev == NULL);
-            update_prev(h, c->next, c);
+         if (NULL != hd) {
+            ASSERT(NULL == get_prev(h, hd));
+            update_prev(h, hd, c);
          }
       }
    }
@@ -836,32 +3591,32 @@ void heap_free1(heap*const h, void*const address)
 }
 #endif
 /* -------------------------------------------------------------------------- */
-static void set_bf_ptr(U32 const index, U32 const lvl_bf_count, heap*const H,
-                       U32 const start, void*const mem, U32 const size)
+static void set_bf_ptr(U32 const index, USZ const lvl_bf_count, heap*const H,
+                       USZ const start, void*const mem, USZ const size)
 {
    if (0 != lvl_bf_count) {
-      H->bitfield[index] = &(((U32*)mem)[start]);
+      HEAP_SET(H, bitfield[index], &(((U32*)mem)[start]));
       H->bscnt = index + 1;
-      U32 const lvl_chunk_cnt = size >> ((index + 1) << 2);
-      for (U32 i = 0; i < (lvl_chunk_cnt >> 4); i++) {
-         H->bitfield[index][i] = ALL_FREE;
+      USZ const lvl_chunk_cnt = size >> ((index + 1) << 2);
+      for (USZ i = 0; i < (lvl_chunk_cnt >> 4); i++) {
+         BITFIELD(H, index)[i] = ALL_FREE;
       }
       if (0 != (lvl_chunk_cnt & 0x0FU)) {
-         U32 const idx = lvl_chunk_cnt & ~0x0FU;
+         USZ const idx = lvl_chunk_cnt & ~(USZ)0x0FU;
          U32 const sub = lvl_chunk_cnt &  0x0FU;
-         bf_set_free_multi(H->bitfield[index], idx, sub);
-         bf_set_alloc_head_multi(H->bitfield[index], idx + sub, 16 - sub);
+         bf_set_free_multi(BITFIELD(H, index), idx, sub);
+         bf_set_alloc_head_multi(BITFIELD(H, index), idx + sub, 16 - sub);
       }
    } else {
-      H->bitfield[index] = NULL;
+      HEAP_SET(H, bitfield[index], NULL);
    }
 }
 /* -------------------------------------------------------------------------- */
-static void populate_heads(heap *const h, void const*const data, U32 const size)
+static void populate_heads(heap *const h, void const*const data, USZ const size)
 {
    ASSERT((size & (BASE_SIZE_MIN - 1)) == 0);
 
-   U32 used_size = closest_base_size(size);
+   USZ used_size = closest_base_size(size);
    U32 i = base_size_to_index(used_size);
 
    if (used_size != size) {
@@ -872,11 +3627,12 @@ static void populate_heads(heap *const h, void const*const data, U32 const size)
    }
 
    ASSERT(i < h->hdcnt);
-   ASSERT(h->heads[i] == NULL);
-   h->heads[i] = (chunk*)data;
-   h->headsbits[i >> 5] |= 0x80000000U >> (i & 31);
-   h->heads[i]->prev = NULL;
-   h->heads[i]->next = NULL;
+   ASSERT(get_head(h, i) == NULL);
+   chunk*const c = (chunk*)data;
+   h->heads[i] = LINK_OF(h, c);
+   h->headsbits[i / USZ_BITS] |= HEADS_BITS_MSB >> (i & (USZ_BITS - 1));
+   c->prev = LINK_OF(h, NULL);
+   c->next = LINK_OF(h, NULL);
 
    if (used_size != size) {
       return populate_heads(h, (U8*)data + used_size, size - used_size);
@@ -885,65 +3641,688 @@ static void populate_heads(heap *const h, void const*const data, U32 const size)
    return;
 }
 /* -------------------------------------------------------------------------- */
-/* Never been tested with size > UINT32_MAX (4GB). That will likely not work. */
-heap*heap_create(U8*const address, U32 const size)
+/* free lists of a heap of size bytes: 15 per level below its highest nibble,
+ * and as many as that nibble for its level */
+static U32 heads_count(USZ const size)
 {
-   heap *new_heap = NULL;
-
-   if (0 == size || 0 != (size & (BASE_SIZE_MIN - 1))) {
+   U32 const cs = CLZW(size) & NIBBLE_MASK;
+   return ((NIBBLE_MASK - 4 - cs) >> 2) * 15 +
+          ((size >> (NIBBLE_MASK - cs)) & 0x0FU);
+}
+/* -------------------------------------------------------------------------- */
+/* the book-keeping is the heap_st with its heads[], then the bitfields
+ * followed by the page maps, each rounded to BASE_SIZE_MIN */
+static USZ meta_heap_size(USZ const size)
+{
+   USZ const sz = sizeof(heap) + heads_count(size) * sizeof(chunk*);
+   return (sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+}
+static USZ meta_zmap_count(USZ const size)
+{
+   return ((size >> ZERO_SHIFT) + 32) >> 5;
+}
+static USZ meta_bf_size(USZ const size)
+{
+   USZ const cnt = total_bitfield_count(size) + ZERO_MAPS * meta_zmap_count(size);
+   return (cnt * sizeof(U32) + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1);
+}
+/* -------------------------------------------------------------------------- */
+size_t heap_bookkeeping_size(size_t const size)
+{
+   if (0 == size || 0 != (size & (BASE_SIZE_MIN - 1)) || size > HEAP_SIZE_MAX) {
+      return 0;
+   }
+   return meta_heap_size(size) + meta_bf_size(size);
+}
+/* -------------------------------------------------------------------------- */
+/* the alignment heap_create() needs for a heap of size bytes: the chunk size
+ * of its highest nibble */
+static USZ region_align(USZ const size)
+{
+   return ((USZ)1 << NIBBLE_MASK) >> (CLZW(size) & NIBBLE_MASK);
+}
+/* -------------------------------------------------------------------------- */
+/* a region at address that isn't aligned is managed from the aligned address
+ * below it: returns how far below. The alignment grows with the size to
+ * manage, so does the distance, until both settle */
+static USZ region_below(U8 const*const address, USZ const size)
+{
+   USZ below = 0;
+   for (;;) {
+      USZ const b = (USZ)address & (region_align(size + below) - 1);
+      if (b == below || size + b > HEAP_SIZE_MAX) {
+         return b;
+      }
+      below = b;
+   }
+}
+/* -------------------------------------------------------------------------- */
+size_t heap_bookkeeping_size_at(uint8_t const*const address, size_t const size)
+{
+   if (0 == size || 0 != (size & (BASE_SIZE_MIN - 1)) ||
+       0 != ((USZ)address & (BASE_SIZE_MIN - 1))) {
+      return 0;
+   }
+   return heap_bookkeeping_size(size + region_below(address, size));
+}
+/* -------------------------------------------------------------------------- */
+/* the first n bytes of the region are a block that is never freed: what lies
+ * below the region when it isn't aligned, then its book-keeping when it's
+ * kept there. The region starts with a run of chunks of its highest level:
+ * the first one is allocated and cut to n bytes. No links are written below
+ * n */
+static void head_carve(heap*const h, USZ const n)
+{
+   U32 const lvl = size_level(h->hsize);
+   U32 const shift = (lvl + 1) << 2;
+   USZ const cnt = h->hsize >> shift;
+   USZ const run = cnt << shift;
+   bf_set_alloc_head(BITFIELD(h, lvl), 0);
+   if (cnt > 1) {
+      new_head(h, (chunk*)(HDATA(h) + ((USZ)1 << shift)), (lvl << 4) - lvl,
+               cnt - 1);
+   }
+   if (run != h->hsize) {
+      populate_heads(h, HDATA(h) + run, h->hsize - run);
+   }
+   if (n < ((USZ)1 << shift)) {
+      chunk_cut(h, lvl, 0, n);
+      bf_set_alloc_head(BITFIELD(h, size_level(n)), 0);
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* meta is where the book-keeping goes (NULL to allocate it) and how */
+static heap*heap_create_priv(U8*address, USZ const rsize, void*meta,
+                             U8 const how)
+{
+   if (0 == rsize || 0 != (rsize & (BASE_SIZE_MIN - 1)) ||
+       0 != ((USZ)address & (BASE_SIZE_MIN - 1))) {
       fprintf(stderr, "heap size must be multiple of %u bytes.\n", BASE_SIZE_MIN);
       return NULL;
    }
 
-   U32 const cs = CLZ(size) & 0x1CU;
-   U32 const largest = 0x10000000 >> cs;
-   if (0 != ((U32)address & (largest - 1))) {
-      fprintf(stderr, "heap with size %u must be aligned on 0x%08X\n",
-               size, largest);
+   /* a region that isn't aligned is managed from the aligned address below
+    * it, the bytes in between are allocated for good */
+   USZ const below = region_below(address, rsize);
+   USZ const size = rsize + below;
+   if (size > HEAP_SIZE_MAX) {
+      fprintf(stderr, "heap size must not exceed %zu bytes.\n", HEAP_SIZE_MAX);
+      return NULL;
+   }
+
+   if (0 != ((USZ)meta & (BASE_SIZE_MIN - 1))) {
+      fprintf(stderr, "ERR: book-keeping %p must be aligned on %u bytes.\n",
+              meta, BASE_SIZE_MIN);
       return NULL;
    }
-   U32 const hd_cnt = ((24 - cs) >> 2) * 15 + ((size >> (28 - cs)) & 0x0FU);
-   /* we use an externally allocated buffer for the book-keeping */
-   new_heap = (heap*)malloc(sizeof(*new_heap) + (hd_cnt * sizeof(chunk*)));
 
-   if (NULL == new_heap) {
-      fprintf(stderr, "couldn't alloc %zu bytes for the heap.\n", sizeof(heap));
+   USZ const meta_size = heap_bookkeeping_size(size);
+   USZ const head = below + (META_REGION == how ? meta_size : 0);
+   if (head > region_align(size)) {
+      fprintf(stderr, "ERR: heap of %zu bytes too small for its %zu bytes "
+              "of book-keeping.\n", rsize, meta_size);
       return NULL;
    }
 
+   bool const mapped = NULL == address;
+   if (mapped) {
+      address = region_map(size);
+      if (NULL == address) {
+         fprintf(stderr, "couldn't map %zu bytes for the heap.\n", size);
+         return NULL;
+      }
+   }
+   ASSERT(0 == ((USZ)(address - below) & (region_align(size) - 1)));
+   U32 const hd_cnt = heads_count(size);
+   if (META_ALLOC == how) {
+      /* an externally allocated buffer for the book-keeping */
+      meta = HEAP_META_ALLOC(meta_size);
+      if (NULL == meta) {
+         fprintf(stderr, "couldn't alloc %zu bytes for the book-keeping.\n",
+                 meta_size);
+         if (mapped) {
+            munmap(address, size);
+         }
+         return NULL;
+      }
+   } else if (META_REGION == how) {
+      meta = address;
+   }
+   heap*const new_heap = (heap*)meta;
+
    new_heap->hdcnt = hd_cnt;
 
-   U32 const tot_bf_count = total_bitfield_count(size);
-   void*const mem_bf = malloc(tot_bf_count * sizeof(U32));
+   /* the known-zero map follows the bitfields */
+   USZ const zmap_count = meta_zmap_count(size);
+   void*const mem_bf = (U8*)meta + meta_heap_size(size);
 
-   PRINTF("This %u bytes heap requires %zu bytes for its base "
+   PRINTF("This %zu bytes heap requires %zu bytes for its base "
           "structure plus %zu bytes (%.2f%%) for book-keeping."
           "There are %u base sizes.\n",
-          size, sizeof(*new_heap) + (hd_cnt * sizeof(chunk*)),
-          tot_bf_count * sizeof(U32),
-          100.0 * (tot_bf_count * sizeof(U32)) / size, hd_cnt);
+          size, meta_heap_size(size), meta_bf_size(size),
+          100.0 * meta_bf_size(size) / size, hd_cnt);
 
-   for (U32 i = 0, start = 0; i < MAIN_BASE_SIZE_COUNT; ++i) {
-      U32 const nbc = needed_bitfield_count(size, i);
+   USZ start = 0;
+   for (U32 i = 0; i < MAIN_BASE_SIZE_COUNT; ++i) {
+      USZ const nbc = needed_bitfield_count(size, i);
       set_bf_ptr(i, nbc, new_heap, start, mem_bf, size);
       start += nbc;
    }
+   /* nothing is known about the memory given to the heap, fresh mappings
+    * read as zero */
+   HEAP_SET(new_heap, zmap, &(((U32*)mem_bf)[start]));
+   memset(ZMAP(new_heap), mapped ? 0 : 0xFF, zmap_count * sizeof(U32));
+   /* and the release map follows it */
+   HEAP_SET(new_heap, rmap, ZMAP(new_heap) + zmap_count);
+   memset(RMAP(new_heap), 0, zmap_count * sizeof(U32));
+#ifdef HEAP_SLAB
+   /* then the slab map */
+   new_heap->smap = RMAP(new_heap) + zmap_count;
+   memset(new_heap->smap, 0, zmap_count * sizeof(U32));
+   for (U32 i = 0; i < SLAB_CLASSES; i++) {
+      new_heap->slabs[i] = NULL;
+   }
+#endif
+   new_heap->released = 0;
+   new_heap->rel_lvl = RELEASE_OFF;
+   new_heap->rel_flags = 0;
+   new_heap->policy = HEAP_POLICY_LIFO;
+   HEAP_SET(new_heap, htab, NULL);
+   new_heap->hcount = 0;
+   new_heap->hfree = 0;
+   new_heap->hnext = 0;
 
    for (U32 i = 0; i < hd_cnt; i++) {
-      new_heap->heads[i] = NULL;
+      new_heap->heads[i] = LINK_OF(new_heap, NULL);
+      new_heap->lowest[i] = 0;
    }
 
-   new_heap->headsbits[0] = 0;
-   new_heap->headsbits[1] = 0;
-   new_heap->headsbits[2] = 0;
-   new_heap->headsbits[3] = 0x007FFFFFU;
+   for (U32 i = 0; i < HEADS_BITS_SIZE - 1; i++) {
+      new_heap->headsbits[i] = 0;
+   }
+   new_heap->headsbits[HEADS_BITS_SIZE - 1] =
+                              USZ_ALL_ONES >> (BASE_SIZES_COUNT % USZ_BITS);
    ASSERT(hd_cnt <= BASE_SIZES_COUNT);
 
-   populate_heads(new_heap, address, size);
-
-   new_heap->hdata = address;
+   HEAP_SET(new_heap, hdata, address - below);
    new_heap->hsize = size;
+   new_heap->hoff = below;
+   new_heap->next = NULL;
+   new_heap->grow = 0;
+   new_heap->mapped = mapped;
+   new_heap->anon = mapped;
+   new_heap->meta = how;
+#ifdef HEAP_TRACE
+   new_heap->trace = NULL;
+#endif
+#ifdef HEAP_STATS
+   new_heap->allocs = 0;
+   new_heap->frees = 0;
+#endif
+
+#ifdef HEAP_THREAD_SAFE
+   pthread_mutex_init(&new_heap->lock, NULL);
+   new_heap->tcaches = NULL;
+#endif
+#ifdef HEAP_SHARED
+   /* other processes may lock it */
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutex_init(&new_heap->lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+   new_heap->magic = 0;
+   new_heap->file = false;
+   new_heap->root = 0;
+#endif
+#ifdef HEAP_STRIPED
+   pthread_mutex_init(&new_heap->upper, NULL);
+   for (U32 i = 0; i < HEAP_STRIPE_LOCKS; i++) {
+      pthread_mutex_init(&new_heap->stripes[i], NULL);
+   }
+   for (U32 i = 0; i < BASE_SIZES_COUNT; i++) {
+      pthread_mutex_init(&new_heap->classes[i], NULL);
+   }
+   pthread_mutex_init(&new_heap->regions, NULL);
+#endif
+
+   if (0 != head) {
+      head_carve(new_heap, head);
+   } else {
+      populate_heads(new_heap, address, size);
+   }
+   if (META_REGION == how) {
+      zmap_claim(new_heap, below, meta_size, false);
+      STAT_ADD(new_heap, allocs, 1);
+   }
 
    return new_heap;
 }
 /* -------------------------------------------------------------------------- */
+heap*heap_create(U8*const address, USZ const size)
+{
+   return heap_create_priv(address, size, NULL, META_ALLOC);
+}
+/* -------------------------------------------------------------------------- */
+heap*heap_create_in(U8*const address, USZ const size, void*const meta)
+{
+   return heap_create_priv(address, size, meta,
+                           NULL == meta ? META_REGION : META_CALLER);
+}
+/* -------------------------------------------------------------------------- */
+heap*heap_create_shared(U8*const address, USZ const size)
+{
+#ifdef HEAP_SHARED
+   if (NULL == address) {
+      fprintf(stderr, "ERR: a shared heap needs the address of its mapping.\n");
+      return NULL;
+   }
+   heap*const h = heap_create_priv(address, size, NULL, META_REGION);
+   if (NULL != h) {
+      __atomic_store_n(&h->magic, HEAP_SHARED_MAGIC, __ATOMIC_RELEASE);
+   }
+   return h;
+#else
+   (void)address;
+   (void)size;
+   fprintf(stderr, "ERR: built without HEAP_SHARED.\n");
+   return NULL;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+heap*heap_attach(U8*const address)
+{
+#ifdef HEAP_SHARED
+   heap*const h = (heap*)address;
+   if (NULL == h ||
+       HEAP_SHARED_MAGIC != __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE)) {
+      fprintf(stderr, "ERR: no shared heap at %p.\n", address);
+      return NULL;
+   }
+   /* the heap is managed from the same aligned address below this mapping
+    * as below the creator's */
+   USZ const align = region_align(h->hsize);
+   if (0 != ((USZ)HDATA(h) & (align - 1))) {
+      fprintf(stderr, "ERR: mapping %p must be at 0x%zX modulo 0x%zX.\n",
+              address, h->hoff, align);
+      return NULL;
+   }
+   return h;
+#else
+   (void)address;
+   fprintf(stderr, "ERR: built without HEAP_SHARED.\n");
+   return NULL;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+#ifdef HEAP_SHARED
+/* the file at path holds the heap created at its start by this build */
+static heap*heap_reopen(U8*const address, USZ const size, char const*const path)
+{
+   heap*const h = (heap*)address;
+   if (HEAP_SHARED_MAGIC != h->magic || size != h->hsize ||
+       HDATA(h) != address ||
+       BITFIELD(h, 0) != (U32*)(address + meta_heap_size(size))) {
+      fprintf(stderr, "ERR: %s doesn't hold a heap.\n", path);
+      return NULL;
+   }
+   /* the lock was left as the last process to use the file had it */
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutex_init(&h->lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+   return h;
+}
+#endif
+/* -------------------------------------------------------------------------- */
+heap*heap_create_persistent(char const*const path, USZ size)
+{
+#ifdef HEAP_SHARED
+   int const fd = open(path, O_RDWR | O_CREAT, 0600);
+   if (fd < 0) {
+      fprintf(stderr, "ERR: couldn't open %s.\n", path);
+      return NULL;
+   }
+   struct stat st;
+   if (0 != fstat(fd, &st)) {
+      fprintf(stderr, "ERR: couldn't read the size of %s.\n", path);
+      close(fd);
+      return NULL;
+   }
+   bool const fresh = 0 == st.st_size;
+   if (!fresh && 0 == size) {
+      size = st.st_size;
+   }
+   if (0 == size || 0 != (size & (BASE_SIZE_MIN - 1)) || size > HEAP_SIZE_MAX ||
+       (!fresh && (USZ)st.st_size != size) ||
+       (fresh && 0 != ftruncate(fd, size))) {
+      fprintf(stderr, "ERR: %s can't hold a heap of %zu bytes.\n", path, size);
+      close(fd);
+      return NULL;
+   }
+   /* an aligned range, replaced by the file */
+   U8*address = region_map(size);
+   if (NULL != address &&
+       MAP_FAILED == mmap(address, size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED, fd, 0)) {
+      munmap(address, size);
+      address = NULL;
+   }
+   close(fd);
+   if (NULL == address) {
+      fprintf(stderr, "ERR: couldn't map %s.\n", path);
+      return NULL;
+   }
+   heap*const h = fresh ? heap_create_shared(address, size) :
+                          heap_reopen(address, size, path);
+   if (NULL == h) {
+      munmap(address, size);
+      if (fresh) {
+         int const rc __attribute((unused)) = truncate(path, 0);
+      }
+      return NULL;
+   }
+   if (fresh) {
+      /* a new file reads as zero */
+      heap_set_zeroed(h);
+   }
+   /* but its pages are the file's: h->anon stays false */
+   h->mapped = true;
+   h->file = true;
+   return h;
+#else
+   (void)path;
+   (void)size;
+   fprintf(stderr, "ERR: built without HEAP_SHARED.\n");
+   return NULL;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+int heap_sync(heap*const h)
+{
+#ifdef HEAP_SHARED
+   if (!h->file) {
+      return -1;
+   }
+   heap_lock(h);
+   int const rc = msync(HDATA(h), h->hsize, MS_SYNC);
+   heap_unlock(h);
+   return 0 == rc ? 0 : -1;
+#else
+   (void)h;
+   return -1;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+void heap_set_root(heap*const h, void*const p)
+{
+#ifdef HEAP_SHARED
+   __atomic_store_n(&h->root, NULL == p ? 0 : (USZ)((U8*)p - HDATA(h)) + 1,
+                    __ATOMIC_RELEASE);
+#else
+   (void)h;
+   (void)p;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+void*heap_get_root(heap*const h)
+{
+#ifdef HEAP_SHARED
+   USZ const root = __atomic_load_n(&h->root, __ATOMIC_ACQUIRE);
+   return 0 == root ? NULL : HDATA(h) + root - 1;
+#else
+   (void)h;
+   return NULL;
+#endif
+}
+/* -------------------------------------------------------------------------- */
+#ifdef HEAP_ARENAS
+/* one heap per thread over disjoint, equally sized sub-regions. Blocks freed
+ * by a thread that doesn't own them are pushed on the owner's lock-free
+ * stack, and the owner frees (and coalesces) them on its next allocation.
+ * Threads beyond the arenas count share a locked overflow heap until an arena
+ * is released. */
+typedef union {
+   struct {
+      heap*h;
+      _Atomic(void*) remote;   /* blocks freed by other threads, linked
+                                  through their first word */
+      struct _arena_tls*tls;   /* thread owning this arena, if any */
+   };
+   U8 line[64];                /* no false sharing between arenas */
+} arena;
+
+struct heap_arenas_st {
+   U8 *hdata;
+   USZ asize;
+   U32 count;
+   U32 owned;                  /* arenas with an owner */
+   heap*shared;                /* overflow heap, mapped on first use */
+   pthread_mutex_t shared_lock;
+   arena arenas[0];
+};
+
+typedef struct _arena_tls {
+   heap_arenas*set;
+   arena*ar;                   /* NULL: the thread uses the overflow heap */
+} arena_tls;
+
+/* sets a thread keeps its arena in at once: alternating between them doesn't
+ * release and claim arenas again */
+#ifndef HEAP_ARENAS_SETS
+   #define HEAP_ARENAS_SETS 4U
+#endif
+static __thread arena_tls tls_arenas[HEAP_ARENAS_SETS];
+static __thread U32 tls_arenas_next;   /* slot reused when all are taken */
+/* serializes claiming / releasing arenas and destroying sets: rare events */
+static pthread_mutex_t arenas_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arenas_key;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+/* -------------------------------------------------------------------------- */
+/* arenas mutex held */
+static void arena_release(arena_tls*const tls)
+{
+   if (NULL != tls->ar) {
+      ASSERT(tls->ar->tls == tls);
+      tls->ar->tls = NULL;
+      __atomic_fetch_sub(&tls->set->owned, 1, __ATOMIC_RELAXED);
+   }
+   tls->set = NULL;
+   tls->ar = NULL;
+}
+/* -------------------------------------------------------------------------- */
+static void arena_thread_exit(void*const arg)
+{
+   arena_tls*const tls = (arena_tls*)arg;
+   pthread_mutex_lock(&arenas_mtx);
+   for (U32 i = 0; i < HEAP_ARENAS_SETS; i++) {
+      arena_release(&tls[i]);
+   }
+   pthread_mutex_unlock(&arenas_mtx);
+}
+/* -------------------------------------------------------------------------- */
+static void arenas_key_create(void)
+{
+   (void)pthread_key_create(&arenas_key, arena_thread_exit);
+}
+/* -------------------------------------------------------------------------- */
+/* the calling thread's slot of the set, NULL if it has none */
+static inline arena_tls*arena_slot(heap_arenas const*const a)
+{
+   for (U32 i = 0; i < HEAP_ARENAS_SETS; i++) {
+      if (tls_arenas[i].set == a) {
+         return &tls_arenas[i];
+      }
+   }
+   return NULL;
+}
+/* -------------------------------------------------------------------------- */
+/* the arena owned by the calling thread, claimed on its first use of the set.
+ * NULL while more threads than arenas use the set: it retries when one is
+ * released. */
+static arena*arena_get(heap_arenas*const a)
+{
+   arena_tls*tls = arena_slot(a);
+   if (likely(NULL != tls)) {
+      if (likely(NULL != tls->ar) ||
+          __atomic_load_n(&a->owned, __ATOMIC_RELAXED) == a->count) {
+         return tls->ar;
+      }
+   } else {
+      tls = arena_slot(NULL);
+      if (NULL == tls) {
+         tls = &tls_arenas[tls_arenas_next++ % HEAP_ARENAS_SETS];
+      }
+   }
+   (void)pthread_once(&arenas_once, arenas_key_create);
+   (void)pthread_setspecific(arenas_key, tls_arenas);
+   pthread_mutex_lock(&arenas_mtx);
+   arena_release(tls);
+   tls->set = a;
+   for (U32 i = 0; i < a->count; i++) {
+      if (NULL == a->arenas[i].tls) {
+         a->arenas[i].tls = tls;
+         tls->ar = &a->arenas[i];
+         __atomic_fetch_add(&a->owned, 1, __ATOMIC_RELAXED);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&arenas_mtx);
+   return tls->ar;
+}
+/* -------------------------------------------------------------------------- */
+static void arena_push_remote(arena*const ar, void*const address)
+{
+   void**const node = (void**)address;
+   void*head = atomic_load_explicit(&ar->remote, memory_order_relaxed);
+   do {
+      *node = head;
+   } while (!atomic_compare_exchange_weak_explicit(&ar->remote, &head, address,
+                                  memory_order_release, memory_order_relaxed));
+}
+/* -------------------------------------------------------------------------- */
+/* only called by the owner: it takes the whole stack at once, so no ABA */
+static void arena_drain_remote(arena*const ar)
+{
+   void*p = atomic_exchange_explicit(&ar->remote, NULL, memory_order_acquire);
+   while (NULL != p) {
+      void*const next = *(void**)p;
+      heap_free(ar->h, p);
+      p = next;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* the overflow heap: an arena's size, growing by as much */
+static void*arena_shared_alloc(heap_arenas*const a, USZ const sz)
+{
+   void*p = NULL;
+   pthread_mutex_lock(&a->shared_lock);
+   if (unlikely(NULL == a->shared)) {
+      a->shared = heap_create(NULL, a->asize);
+      if (NULL != a->shared) {
+         heap_set_growth(a->shared, a->asize);
+      }
+   }
+   if (likely(NULL != a->shared)) {
+      p = heap_alloc(a->shared, sz);
+   }
+   pthread_mutex_unlock(&a->shared_lock);
+   return p;
+}
+/* -------------------------------------------------------------------------- */
+void*heap_arenas_alloc(heap_arenas*const a, USZ const sz)
+{
+   arena*const ar = arena_get(a);
+   if (unlikely(NULL == ar)) {
+      return arena_shared_alloc(a, sz);
+   }
+   if (unlikely(NULL != atomic_load_explicit(&ar->remote, memory_order_relaxed))) {
+      arena_drain_remote(ar);
+   }
+   return heap_alloc(ar->h, sz);
+}
+/* -------------------------------------------------------------------------- */
+void heap_arenas_free(heap_arenas*const a, void*const address)
+{
+   U8*const p = (U8*)address;
+   if (unlikely(p < a->hdata || p >= a->hdata + (a->asize * a->count))) {
+      pthread_mutex_lock(&a->shared_lock);
+      heap*const s = a->shared;
+      bool const shared = NULL != s && region_has(region_of(s, p), p);
+      if (likely(shared)) {
+         heap_free(s, address);
+      }
+      pthread_mutex_unlock(&a->shared_lock);
+      if (unlikely(!shared)) {
+         fprintf(stderr, "ERR: %p is not an allocated address.\n", address);
+      }
+      return;
+   }
+   arena*const ar = &a->arenas[(USZ)(p - a->hdata) / a->asize];
+   arena_tls const*const tls = arena_slot(a);
+   if (NULL != tls && ar == tls->ar) {
+      heap_free(ar->h, address);
+   } else {
+      arena_push_remote(ar, address);
+   }
+}
+/* -------------------------------------------------------------------------- */
+void heap_arenas_destroy(heap_arenas*const a)
+{
+   ASSERT(NULL != a);
+   pthread_mutex_lock(&arenas_mtx);
+   for (U32 i = 0; i < a->count; i++) {
+      if (NULL != a->arenas[i].tls) {
+         arena_release(a->arenas[i].tls);
+      }
+      heap_destroy(a->arenas[i].h);
+   }
+   pthread_mutex_unlock(&arenas_mtx);
+   if (NULL != a->shared) {
+      heap_destroy(a->shared);
+   }
+   pthread_mutex_destroy(&a->shared_lock);
+   HEAP_META_FREE(a, sizeof(*a) + (a->count * sizeof(arena)));
+}
+/* -------------------------------------------------------------------------- */
+heap_arenas*heap_arenas_create(U8*const address, USZ const size, U32 const count)
+{
+   if (0 == count || size / count < BASE_SIZE_MIN) {
+      fprintf(stderr, "cannot split %zu bytes in %u arenas.\n", size, count);
+      return NULL;
+   }
+   /* arenas sizes are base sizes so that they are all equally aligned */
+   USZ const sub = size / count;
+   USZ const asize = sub & ~((USZ_ALL_ONES >> 4) >> (CLZW(sub) & NIBBLE_MASK));
+   heap_arenas*const a =
+            (heap_arenas*)HEAP_META_ALLOC(sizeof(*a) + (count * sizeof(arena)));
+   if (NULL == a) {
+      fprintf(stderr, "couldn't alloc %zu bytes for the arenas.\n",
+               sizeof(*a) + (count * sizeof(arena)));
+      return NULL;
+   }
+   a->hdata = address;
+   a->asize = asize;
+   a->count = count;
+   a->owned = 0;
+   a->shared = NULL;
+   pthread_mutex_init(&a->shared_lock, NULL);
+   for (U32 i = 0; i < count; i++) {
+      arena*const ar = &a->arenas[i];
+      ar->h = heap_create(address + (i * asize), asize);
+      if (NULL == ar->h) {
+         while (i > 0) {
+            heap_destroy(a->arenas[--i].h);
+         }
+         pthread_mutex_destroy(&a->shared_lock);
+         HEAP_META_FREE(a, sizeof(*a) + (count * sizeof(arena)));
+         return NULL;
+      }
+      atomic_init(&ar->remote, NULL);
+      ar->tls = NULL;
+   }
+   return a;
+}
+/* -------------------------------------------------------------------------- */
+#endif
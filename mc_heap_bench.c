@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2010-2021 Yann Poupet
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIEDi
+ *    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ *    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* allocator benchmark: the same seeded workloads against MC-Heap, with the
+ * LIFO (mc-heap) and the address ordered (mc-addr) placement policies, and the
+ * libc malloc, each one in a child process of its own so that their peak RSS
+ * can be told apart:
+ *
+ *    ./heap-bench [-mc] [ops per workload]
+ *
+ * -mc leaves the libc out, to compare builds of MC-Heap with different
+ * compile time parameters (HEAP_LEVELS, HEAP_SLAB...) quicker.
+ *
+ * Every alloc and free is timed with the time stamp counter on x86 (reference
+ * cycles, minus the cost of reading it), in nanoseconds elsewhere. ops/s is
+ * the wall time of the whole workload, timing included. Peak RSS is the
+ * growth of the child's high-water mark once the workload started, the
+ * heap's own book-keeping included. frag is the heap's fragmentation (see
+ * heap_get_stats()) at the end of the workload, before it frees the blocks
+ * it still holds. */
+#define PRINTF(...) { }
+#include "mc_heap.c"
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+   #include <x86intrin.h>
+#endif
+
+#ifndef HEAP_THREAD_SAFE
+   #error "the benchmark needs HEAP_THREAD_SAFE"
+#endif
+
+#define BENCH_OPS_DEFAULT (1024U * 1024U)
+#define BENCH_SLOTS (4096U)
+#define BENCH_THREADS (4U)
+#define BENCH_RING (1024U)
+/* 256MB regions, or the largest chunk with fewer levels */
+#define BENCH_HEAP_SIZE ((USZ)1 << (LEVEL_SHIFT(HEAP_LEVELS - 1) < 28 ? \
+                                    LEVEL_SHIFT(HEAP_LEVELS - 1) : 28))
+
+/* -------------------------------------------------------------------------- */
+/* the allocator under test */
+typedef struct {
+   char const*name;
+   void*(*alloc)(USZ sz);
+   void (*free)(void*p);
+   U32 policy;   /* HEAP_POLICY_* of the MC-Heap ones */
+} allocator;
+
+static heap*bench_heap;
+static void*mc_alloc(USZ const sz) { return heap_alloc(bench_heap, sz); }
+static void mc_free(void*const p) { heap_free(bench_heap, p); }
+static void*libc_alloc(USZ const sz) { return malloc(sz); }
+static void libc_free(void*const p) { free(p); }
+
+static allocator const allocators[] = {
+   { "mc-heap", mc_alloc, mc_free, HEAP_POLICY_LIFO },
+   { "mc-addr", mc_alloc, mc_free, HEAP_POLICY_ADDRESS },
+   { "libc", libc_alloc, libc_free, 0 },
+};
+/* -------------------------------------------------------------------------- */
+#if defined(__x86_64__) || defined(__i386__)
+   #define TICKS_UNIT "cycles"
+static inline U64 ticks(void)
+{
+   return __rdtsc();
+}
+#else
+   #define TICKS_UNIT "ns"
+static inline U64 ticks(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (U64)t.tv_sec * 1000000000U + t.tv_nsec;
+}
+#endif
+static U64 ticks_cost;
+/* -------------------------------------------------------------------------- */
+/* the cheapest of back to back reads */
+static void ticks_calibrate(void)
+{
+   ticks_cost = ~(U64)0;
+   for (U32 i = 0; i < 4096; i++) {
+      U64 const t0 = ticks();
+      U64 const t1 = ticks();
+      if (t1 - t0 < ticks_cost) {
+         ticks_cost = t1 - t0;
+      }
+   }
+}
+/* -------------------------------------------------------------------------- */
+static inline U32 elapsed(U64 const t0, U64 const t1)
+{
+   U64 const d = t1 - t0;
+   return d <= ticks_cost ? 0 : d - ticks_cost > 0xFFFFFFFFU ? 0xFFFFFFFFU
+                                                              : d - ticks_cost;
+}
+/* -------------------------------------------------------------------------- */
+/* xorshift64*: the same sequence for every allocator */
+static inline U64 rnd(U64*const s)
+{
+   U64 x = *s;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   *s = x;
+   return x * 0x2545F4914F6CDD1DU;
+}
+/* -------------------------------------------------------------------------- */
+/* mostly small blocks, a few up to 1MB: the size range halves its odds each
+ * time it doubles */
+static inline USZ power_law_size(U64*const s)
+{
+   U32 const e = CTZW((USZ)(rnd(s) >> 48) | ((USZ)1 << 16));
+   return (USZ)(rnd(s) % ((USZ)16 << e)) + 1;
+}
+/* -------------------------------------------------------------------------- */
+/* the latencies of one thread, mapped so the libc heap doesn't see them */
+typedef struct {
+   allocator const*a;
+   U32 ops;
+   U32 nalloc;
+   U32 nfree;
+   U32 failed;
+   U64 seed;
+   U32*alloc_lat;
+   U32*free_lat;
+   double frag;   /* see bench_sample(), -1 if not sampled */
+} bench_thread;
+
+typedef void (*workload_fn)(bench_thread*t);
+
+static inline void*timed_alloc(bench_thread*const t, USZ const sz)
+{
+   U64 const t0 = ticks();
+   U8*const p = t->a->alloc(sz);
+   U64 const t1 = ticks();
+   t->alloc_lat[t->nalloc++] = elapsed(t0, t1);
+   if (NULL == p) {
+      t->failed++;
+   } else {
+      p[0] = 1;
+   }
+   return p;
+}
+static inline void timed_free(bench_thread*const t, void*const p)
+{
+   U64 const t0 = ticks();
+   t->a->free(p);
+   U64 const t1 = ticks();
+   t->free_lat[t->nfree++] = elapsed(t0, t1);
+}
+/* -------------------------------------------------------------------------- */
+/* the workload is about to free what it holds */
+static void bench_sample(bench_thread*const t)
+{
+   if (mc_alloc == t->a->alloc) {
+      heap_stats st;
+      heap_get_stats(bench_heap, &st);
+      t->frag = st.fragmentation;
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* a pool of live blocks, each op replaces one of them */
+static void churn(bench_thread*const t, USZ (*size)(U64*))
+{
+   void*slots[BENCH_SLOTS] = { NULL };
+   for (U32 i = 0; i < t->ops; i++) {
+      U32 const k = rnd(&t->seed) % BENCH_SLOTS;
+      if (NULL != slots[k]) {
+         timed_free(t, slots[k]);
+      }
+      slots[k] = timed_alloc(t, size(&t->seed));
+   }
+   bench_sample(t);
+   for (U32 k = 0; k < BENCH_SLOTS; k++) {
+      if (NULL != slots[k]) {
+         timed_free(t, slots[k]);
+      }
+   }
+}
+static USZ uniform_size(U64*const s)
+{
+   return (USZ)(rnd(s) % 4096) + 1;
+}
+static void workload_uniform(bench_thread*const t)
+{
+   churn(t, uniform_size);
+}
+static void workload_power_law(bench_thread*const t)
+{
+   churn(t, power_law_size);
+}
+/* -------------------------------------------------------------------------- */
+/* most blocks die young, one in 16 joins a large pool of long-lived ones */
+#define LONG_SLOTS (65536U)
+#define SHORT_SLOTS (16U)
+static void workload_lifetimes(bench_thread*const t)
+{
+   USZ const bytes = LONG_SLOTS * sizeof(void*);
+   void**const long_lived = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   void*short_lived[SHORT_SLOTS] = { NULL };
+   if (MAP_FAILED == long_lived) {
+      return;
+   }
+   for (U32 i = 0; i < t->ops; i++) {
+      U64 const r = rnd(&t->seed);
+      void**const slot = 0 == (r & 0x0FU) ? &long_lived[(r >> 8) % LONG_SLOTS]
+                                          : &short_lived[i % SHORT_SLOTS];
+      if (NULL != *slot) {
+         timed_free(t, *slot);
+      }
+      *slot = timed_alloc(t, power_law_size(&t->seed));
+   }
+   bench_sample(t);
+   for (U32 k = 0; k < SHORT_SLOTS; k++) {
+      if (NULL != short_lived[k]) {
+         timed_free(t, short_lived[k]);
+      }
+   }
+   for (U32 k = 0; k < LONG_SLOTS; k++) {
+      if (NULL != long_lived[k]) {
+         timed_free(t, long_lived[k]);
+      }
+   }
+   munmap(long_lived, bytes);
+}
+/* -------------------------------------------------------------------------- */
+/* a producer thread allocates, a consumer thread frees: every block is freed
+ * by another thread than the one that allocated it */
+typedef struct {
+   void*ring[BENCH_RING];
+   U32 head; /* written by the producer */
+   U32 tail; /* written by the consumer */
+} bench_ring;
+static bench_ring ring;
+/* -------------------------------------------------------------------------- */
+static void*consumer(void*const arg)
+{
+   bench_thread*const t = (bench_thread*)arg;
+   for (U32 i = 0; i < t->ops; i++) {
+      U32 const tail = ring.tail;
+      while (__atomic_load_n(&ring.head, __ATOMIC_ACQUIRE) == tail) {
+         sched_yield();
+      }
+      void*const p = ring.ring[tail % BENCH_RING];
+      __atomic_store_n(&ring.tail, tail + 1, __ATOMIC_RELEASE);
+      if (NULL != p) {
+         timed_free(t, p);
+      }
+   }
+   return NULL;
+}
+/* -------------------------------------------------------------------------- */
+static void producer(bench_thread*const t)
+{
+   for (U32 i = 0; i < t->ops; i++) {
+      U32 const head = ring.head;
+      while (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == BENCH_RING) {
+         sched_yield();
+      }
+      ring.ring[head % BENCH_RING] = timed_alloc(t, uniform_size(&t->seed));
+      __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+   }
+   bench_sample(t);
+}
+/* -------------------------------------------------------------------------- */
+static void*thread_main(void*const arg)
+{
+   bench_thread*const t = (bench_thread*)arg;
+   churn(t, uniform_size);
+   return NULL;
+}
+/* -------------------------------------------------------------------------- */
+typedef struct {
+   char const*name;
+   workload_fn run; /* single threaded */
+   U32 threads;     /* or that many threads doing the uniform churn */
+   bool pipeline;   /* or a producer and a consumer */
+} workload;
+
+static workload const workloads[] = {
+   { "uniform",      workload_uniform,   0, false },
+   { "power-law",    workload_power_law, 0, false },
+   { "lifetimes",    workload_lifetimes, 0, false },
+   { "prod/cons",    NULL,               0, true  },
+   { "threads",      NULL,   BENCH_THREADS, false },
+};
+/* -------------------------------------------------------------------------- */
+/* written by the child, read by the parent */
+typedef struct {
+   double ops_per_s;
+   U32 alloc_pct[4];
+   U32 free_pct[4];
+   U32 failed;
+   USZ peak_kb;
+   double frag;   /* the largest of the threads', -1 for the libc */
+} bench_result;
+/* -------------------------------------------------------------------------- */
+static void*bench_map(USZ const bytes)
+{
+   void*const p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (MAP_FAILED == p) {
+      fprintf(stderr, "ERR: couldn't map %zu bytes.\n", bytes);
+      exit(1);
+   }
+   /* faulted in now, not while measuring */
+   memset(p, 0, bytes);
+   return p;
+}
+/* -------------------------------------------------------------------------- */
+static int cmp_u32(void const*const a, void const*const b)
+{
+   U32 const x = *(U32 const*)a, y = *(U32 const*)b;
+   return x < y ? -1 : x > y;
+}
+/* -------------------------------------------------------------------------- */
+/* p50, p99, p99.9 and max */
+static void percentiles(U32*const lat, USZ const n, U32 out[4])
+{
+   if (0 == n) {
+      memset(out, 0, 4 * sizeof(U32));
+      return;
+   }
+   qsort(lat, n, sizeof(U32), cmp_u32);
+   out[0] = lat[n * 50 / 100];
+   out[1] = lat[n * 99 / 100];
+   out[2] = lat[n * 999 / 1000];
+   out[3] = lat[n - 1];
+}
+/* -------------------------------------------------------------------------- */
+static USZ resident_kb(void)
+{
+   long pages = 0, rss = 0;
+   FILE*const f = fopen("/proc/self/statm", "r");
+   if (NULL != f) {
+      if (2 != fscanf(f, "%ld %ld", &pages, &rss)) {
+         rss = 0;
+      }
+      fclose(f);
+   }
+   return (USZ)rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+/* -------------------------------------------------------------------------- */
+static void bench_child(workload const*const w, allocator const*const a,
+                        U32 const ops, bench_result*const res)
+{
+   U32 const nthreads = w->pipeline ? 2 : 0 != w->threads ? w->threads : 1;
+   /* a churn frees all its slots at the end, lifetimes its pools */
+   USZ const cap = (USZ)ops + LONG_SLOTS + BENCH_SLOTS;
+   bench_thread t[BENCH_THREADS];
+   for (U32 i = 0; i < nthreads; i++) {
+      t[i] = (bench_thread){ .a = a, .ops = ops, .seed = 0x9E3779B97F4A7C15U + i,
+                             .frag = -1 };
+      t[i].alloc_lat = bench_map(cap * sizeof(U32));
+      t[i].free_lat = bench_map(cap * sizeof(U32));
+   }
+   USZ const base_kb = resident_kb();
+   if (mc_alloc == a->alloc) {
+      bench_heap = heap_create(NULL, BENCH_HEAP_SIZE);
+      if (NULL == bench_heap) {
+         exit(1);
+      }
+      heap_set_growth(bench_heap, BENCH_HEAP_SIZE);
+      heap_set_policy(bench_heap, a->policy);
+   }
+
+   struct timespec t0, t1;
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   if (NULL != w->run) {
+      w->run(&t[0]);
+   } else {
+      pthread_t th[BENCH_THREADS];
+      U32 const spawned = w->pipeline ? 1 : nthreads;
+      for (U32 i = 0; i < spawned; i++) {
+         pthread_create(&th[i], NULL, w->pipeline ? consumer : thread_main,
+                        &t[w->pipeline ? 1 : i]);
+      }
+      if (w->pipeline) {
+         producer(&t[0]);
+      }
+      for (U32 i = 0; i < spawned; i++) {
+         pthread_join(th[i], NULL);
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+
+   struct rusage ru;
+   getrusage(RUSAGE_SELF, &ru);
+   res->peak_kb = (USZ)ru.ru_maxrss > base_kb ? (USZ)ru.ru_maxrss - base_kb : 0;
+
+   /* all the threads' latencies in one, after the peak was read */
+   USZ na = 0, nf = 0;
+   res->frag = -1;
+   for (U32 i = 0; i < nthreads; i++) {
+      na += t[i].nalloc;
+      nf += t[i].nfree;
+      res->failed += t[i].failed;
+      if (t[i].frag > res->frag) {
+         res->frag = t[i].frag;
+      }
+   }
+   U64 const ops_done = na + nf;
+   U32*alloc_lat = t[0].alloc_lat, *free_lat = t[0].free_lat;
+   if (1 < nthreads) {
+      alloc_lat = bench_map((na + 1) * sizeof(U32));
+      free_lat = bench_map((nf + 1) * sizeof(U32));
+      na = nf = 0;
+      for (U32 i = 0; i < nthreads; i++) {
+         memcpy(alloc_lat + na, t[i].alloc_lat, t[i].nalloc * sizeof(U32));
+         memcpy(free_lat + nf, t[i].free_lat, t[i].nfree * sizeof(U32));
+         na += t[i].nalloc;
+         nf += t[i].nfree;
+      }
+   }
+   res->ops_per_s = ops_done / ((t1.tv_sec - t0.tv_sec) +
+                                (t1.tv_nsec - t0.tv_nsec) * 1e-9);
+   percentiles(alloc_lat, na, res->alloc_pct);
+   percentiles(free_lat, nf, res->free_pct);
+}
+/* -------------------------------------------------------------------------- */
+int main(int argc, char*argv[])
+{
+   bool const mc_only = argc > 1 && 0 == strcmp(argv[1], "-mc");
+   U32 const first = mc_only ? 2 : 1;
+   U32 const ops = argc > first ? (U32)strtoul(argv[first], NULL, 0) :
+                                  BENCH_OPS_DEFAULT;
+   if (0 == ops) {
+      fprintf(stderr, "usage: %s [-mc] [ops per workload]\n", argv[0]);
+      return 1;
+   }
+   ticks_calibrate();
+   bench_result*const res = mmap(NULL, sizeof(*res), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (MAP_FAILED == res) {
+      return 1;
+   }
+
+   printf("%u ops per workload and thread, latencies in " TICKS_UNIT
+          " (reading the counter costs %llu)\n", ops,
+          (unsigned long long)ticks_cost);
+   USZ const bf = total_bitfield_count(BENCH_HEAP_SIZE) * sizeof(U32);
+   printf("mc-heap: %u levels, %u byte granularity%s, %zuMB regions "
+          "with %zuKB of book-keeping\n\n", HEAP_LEVELS,
+   #ifdef HEAP_SLAB
+          SLAB_STEP, " (slabs up to 256 bytes)",
+   #else
+          BASE_SIZE_MIN, "",
+   #endif
+          BENCH_HEAP_SIZE >> 20, bf >> 10);
+   printf("%-10s %-8s %10s | %-27s | %-27s | %9s %6s %6s\n", "workload",
+          "alloc", "ops/s", "alloc p50/p99/p99.9/max", "free p50/p99/p99.9/max",
+          "peak RSS", "frag", "failed");
+   /* the MC-Heap ones come first */
+   U32 const nallocs = mc_only ? 2 : sizeof(allocators) / sizeof(allocators[0]);
+   for (U32 i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+      for (U32 j = 0; j < nallocs; j++) {
+         memset(res, 0, sizeof(*res));
+         fflush(stdout);
+         pid_t const pid = fork();
+         if (0 == pid) {
+            bench_child(&workloads[i], &allocators[j], ops, res);
+            _exit(0);
+         }
+         int status;
+         if (pid < 0 || pid != waitpid(pid, &status, 0) || !WIFEXITED(status)
+               || 0 != WEXITSTATUS(status)) {
+            fprintf(stderr, "ERR: %s with %s failed.\n", workloads[i].name,
+                    allocators[j].name);
+            continue;
+         }
+         char frag[16] = "-";
+         if (res->frag >= 0) {
+            snprintf(frag, sizeof(frag), "%.1f%%", 100.0 * res->frag);
+         }
+         printf("%-10s %-8s %10.0f | %5u %6u %6u %7u | %5u %6u %6u %7u |"
+                " %7zuKB %6s %6u\n", workloads[i].name, allocators[j].name,
+                res->ops_per_s, res->alloc_pct[0], res->alloc_pct[1],
+                res->alloc_pct[2], res->alloc_pct[3], res->free_pct[0],
+                res->free_pct[1], res->free_pct[2], res->free_pct[3],
+                res->peak_kb, frag, res->failed);
+      }
+   }
+   return 0;
+}
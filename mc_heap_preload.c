@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2010-2021 Yann Poupet
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIEDi
+ *    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ *    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* LD_PRELOAD replacement of the malloc family, backed by a single
+ * HEAP_THREAD_SAFE heap over mmap'd regions:
+ *
+ *    LD_PRELOAD=./libmc_heap.so MC_HEAP_SIZE=1G ./prog
+ *
+ * The heap starts with a region of MC_HEAP_SIZE bytes (K, M or G suffix,
+ * default 256M) and maps another one each time it runs out of memory. Pages
+ * are only backed once they are handed out; the book-keeping (1/64th of a
+ * region) takes the start of the region and is written when it's created.
+ * With MC_HEAP_RELEASE set (e.g. 1M), free runs of that size and more are
+ * given back to the OS. Built with HEAP_TRACE, MC_HEAP_TRACE=path records
+ * the allocations for heap-replay. */
+#include <stddef.h>
+static void*meta_alloc(size_t sz);
+static void meta_free(void*p, size_t sz);
+/* the heap can't allocate its own trace buffers */
+#define HEAP_META_ALLOC(sz) meta_alloc(sz)
+#define HEAP_META_FREE(p, sz) meta_free((p), (sz))
+#define PRINTF(...) { }
+#include "mc_heap.c"
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef HEAP_THREAD_SAFE
+   #error "the malloc interposer needs HEAP_THREAD_SAFE"
+#endif
+
+#define MC_HEAP_SIZE_DEFAULT ((USZ)1 << 28)
+#define BOOT_MAX 8U
+
+static heap*mc_heap;
+static pthread_mutex_t mc_init_lock = PTHREAD_MUTEX_INITIALIZER;
+/* set while the heap is being set up: malloc() calls from the libc (e.g.
+ * pthread_atfork) come back to us */
+static __thread bool mc_in_init __attribute((tls_model("initial-exec")));
+
+/* the blocks handed out while setting the heap up, never given back */
+static struct {
+   void*p;
+   USZ size;
+} boot[BOOT_MAX];
+static U32 boot_cnt;
+/* -------------------------------------------------------------------------- */
+static void*meta_alloc(size_t const sz)
+{
+   void*const p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   return MAP_FAILED == p ? NULL : p;
+}
+/* -------------------------------------------------------------------------- */
+static void meta_free(void*const p, size_t const sz)
+{
+   munmap(p, sz);
+}
+/* -------------------------------------------------------------------------- */
+static void*boot_alloc(USZ const sz)
+{
+   if (BOOT_MAX == boot_cnt) {
+      return NULL;
+   }
+   void*const p = meta_alloc(sz);
+   if (NULL == p) {
+      return NULL;
+   }
+   boot[boot_cnt].p = p;
+   boot[boot_cnt].size = sz;
+   boot_cnt++;
+   return p;
+}
+/* -------------------------------------------------------------------------- */
+static bool boot_owns(void const*const p)
+{
+   for (U32 i = 0; i < boot_cnt; i++) {
+      if ((U8 const*)p >= (U8 const*)boot[i].p &&
+          (U8 const*)p < (U8 const*)boot[i].p + boot[i].size) {
+         return true;
+      }
+   }
+   return false;
+}
+/* -------------------------------------------------------------------------- */
+/* a size from the environment (K, M or G suffix), or dflt */
+static USZ mc_env_size(char const*const name, USZ const dflt)
+{
+   char const*const env = getenv(name);
+   if (NULL == env) {
+      return dflt;
+   }
+   char*end;
+   USZ size = strtoull(env, &end, 0);
+   switch (*end) {
+   case 'g': case 'G': size <<= 10; /* fall through */
+   case 'm': case 'M': size <<= 10; /* fall through */
+   case 'k': case 'K': size <<= 10; break;
+   default: break;
+   }
+   size &= ~(USZ)(BASE_SIZE_MIN - 1);
+   if (0 == size || size > HEAP_SIZE_MAX) {
+      return dflt;
+   }
+   return size;
+}
+/* -------------------------------------------------------------------------- */
+/* a thread forking while another one holds the heap lock would leave it
+ * locked for good in the child */
+static void mc_fork_prepare(void)
+{
+   heap_lock(mc_heap);
+}
+static void mc_fork_release(void)
+{
+   heap_unlock(mc_heap);
+}
+static void mc_fork_child(void)
+{
+#ifdef HEAP_TRACE
+   /* the records buffered so far are the parent's to write */
+   mc_heap->trace = NULL;
+#endif
+   heap_unlock(mc_heap);
+}
+#ifdef HEAP_TRACE
+/* -------------------------------------------------------------------------- */
+/* other threads may still allocate: the trace is flushed, not stopped */
+static void __attribute((destructor)) mc_trace_flush(void)
+{
+   heap*const h = __atomic_load_n(&mc_heap, __ATOMIC_ACQUIRE);
+   if (NULL != h && NULL != h->trace) {
+      pthread_mutex_lock(&h->trace->lock);
+      trace_flush(h->trace);
+      pthread_mutex_unlock(&h->trace->lock);
+   }
+}
+#endif
+/* -------------------------------------------------------------------------- */
+static heap*mc_heap_create(void)
+{
+   USZ const size = mc_env_size("MC_HEAP_SIZE", MC_HEAP_SIZE_DEFAULT);
+   /* the book-keeping of the regions lives in them */
+   heap*const h = heap_create_in(NULL, size, NULL);
+   if (NULL == h) {
+      return NULL;
+   }
+   heap_set_growth(h, size);
+   USZ const release = mc_env_size("MC_HEAP_RELEASE", 0);
+   if (0 != release) {
+      (void)heap_set_release(h, release, 0);
+   }
+#ifdef HEAP_TRACE
+   char const*const trace = getenv("MC_HEAP_TRACE");
+   if (NULL != trace) {
+      (void)heap_trace_start(h, trace);
+   }
+#endif
+   pthread_atfork(mc_fork_prepare, mc_fork_release, mc_fork_child);
+   return h;
+}
+/* -------------------------------------------------------------------------- */
+/* NULL while the heap is being created by the calling thread */
+static heap*mc_get_heap(void)
+{
+   heap*h = __atomic_load_n(&mc_heap, __ATOMIC_ACQUIRE);
+   if (likely(NULL != h) || mc_in_init) {
+      return h;
+   }
+   pthread_mutex_lock(&mc_init_lock);
+   h = mc_heap;
+   if (NULL == h) {
+      mc_in_init = true;
+      h = mc_heap_create();
+      mc_in_init = false;
+      if (NULL == h) {
+         abort();
+      }
+      __atomic_store_n(&mc_heap, h, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&mc_init_lock);
+   return h;
+}
+/* -------------------------------------------------------------------------- */
+static inline void*mc_nomem(void*const p)
+{
+   if (unlikely(NULL == p)) {
+      errno = ENOMEM;
+   }
+   return p;
+}
+/* -------------------------------------------------------------------------- */
+void*malloc(size_t sz)
+{
+   heap*const h = mc_get_heap();
+   if (unlikely(NULL == h)) {
+      return mc_nomem(boot_alloc(sz));
+   }
+   /* malloc(0) returns a unique pointer */
+   return mc_nomem(heap_alloc(h, 0 == sz ? 1 : sz));
+}
+/* -------------------------------------------------------------------------- */
+void free(void*p)
+{
+   if (NULL == p) {
+      return;
+   }
+   heap*const h = mc_get_heap();
+   if (unlikely(NULL == h || boot_owns(p))) {
+      return;
+   }
+   heap_free(h, p);
+}
+/* -------------------------------------------------------------------------- */
+void*calloc(size_t nmemb, size_t size)
+{
+   heap*const h = mc_get_heap();
+   if (unlikely(NULL == h)) {
+      /* fresh mappings read as zero */
+      if (0 != size && nmemb > SIZE_MAX / size) {
+         return mc_nomem(NULL);
+      }
+      return mc_nomem(boot_alloc(nmemb * size));
+   }
+   if (0 == nmemb || 0 == size) {
+      nmemb = size = 1;
+   }
+   return mc_nomem(heap_calloc(h, nmemb, size));
+}
+/* -------------------------------------------------------------------------- */
+void*realloc(void*p, size_t sz)
+{
+   if (NULL == p) {
+      return malloc(sz);
+   }
+   heap*const h = mc_get_heap();
+   if (unlikely(NULL == h || boot_owns(p))) {
+      /* not expected: nothing resizes the blocks given during the set up */
+      return mc_nomem(NULL);
+   }
+   if (0 == sz) {
+      heap_free(h, p);
+      return NULL;
+   }
+   return mc_nomem(heap_realloc(h, p, sz));
+}
+/* -------------------------------------------------------------------------- */
+int posix_memalign(void**memptr, size_t alignment, size_t sz)
+{
+   heap*const h = mc_get_heap();
+   if (unlikely(NULL == h)) {
+      /* mappings are page aligned */
+      if (0 != (alignment & (alignment - 1)) || alignment < sizeof(void*)) {
+         return EINVAL;
+      }
+      if (alignment > 4096 || NULL == (*memptr = boot_alloc(sz))) {
+         return ENOMEM;
+      }
+      return 0;
+   }
+   return heap_posix_memalign(h, memptr, alignment, sz);
+}
+/* -------------------------------------------------------------------------- */
+void*aligned_alloc(size_t alignment, size_t sz)
+{
+   void*p = NULL;
+   int const err = posix_memalign(&p, alignment, sz);
+   if (0 != err) {
+      errno = err;
+      return NULL;
+   }
+   return p;
+}
+/* -------------------------------------------------------------------------- */
+void*memalign(size_t alignment, size_t sz)
+{
+   /* glibc accepts any alignment and rounds it up to a power of 2 */
+   if (alignment < sizeof(void*)) {
+      alignment = sizeof(void*);
+   }
+   if (0 != (alignment & (alignment - 1))) {
+      alignment = (USZ)1 << (USZ_BITS - CLZW(alignment));
+   }
+   return aligned_alloc(alignment, sz);
+}
+/* -------------------------------------------------------------------------- */
+void*valloc(size_t sz)
+{
+   return aligned_alloc(sysconf(_SC_PAGESIZE), sz);
+}
+/* -------------------------------------------------------------------------- */
+void*pvalloc(size_t sz)
+{
+   USZ const page = sysconf(_SC_PAGESIZE);
+   USZ const psz = (sz + page - 1) & ~(page - 1);
+   if (psz < sz) {
+      return mc_nomem(NULL);
+   }
+   return aligned_alloc(page, 0 == psz ? page : psz);
+}
+/* -------------------------------------------------------------------------- */
+size_t malloc_usable_size(void*p)
+{
+   heap*const h = mc_get_heap();
+   if (NULL == p || NULL == h || boot_owns(p)) {
+      return 0;
+   }
+   return heap_get_alloc_size(h, p);
+}
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2010-2021 Yann Poupet
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ *    ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIEDi
+ *    WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *    DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR
+ *    ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ *    (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ *    ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* replays a trace recorded with heap_trace_start() (see heap.h), against
+ * MC-Heap or the libc malloc:
+ *
+ *    ./heap-replay [-libc | -address] [-size 1G] trace
+ *
+ * The records are replayed in the order they were written, by a single
+ * thread. Blocks are told apart by the id they had in the trace; frees of
+ * blocks allocated before the trace started are skipped. Reports the time
+ * per op, the peak of the bytes asked for and of the resident memory (the
+ * heap's book-keeping included), and the allocations that failed. With
+ * MC-Heap, also the peak and the final fragmentation (see heap_get_stats()),
+ * sampled with the resident memory. -address replays with the
+ * HEAP_POLICY_ADDRESS placement policy. */
+#define PRINTF(...) { }
+#include "mc_heap.c"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define REPLAY_HEAP_SIZE ((USZ)1 << 30)
+/* resident memory is sampled every that many records */
+#define REPLAY_SAMPLE (4096U)
+
+/* -------------------------------------------------------------------------- */
+/* the blocks alive in the replay, by trace id: open addressing, linear
+ * probing. Mapped and touched as a whole so that it can be told apart from
+ * the allocator's own footprint. */
+typedef struct {
+   U64 id;
+   void*p;
+   USZ size;
+} replay_obj;
+
+typedef struct {
+   replay_obj*t;
+   USZ mask;
+   USZ count;
+} replay_map;
+/* -------------------------------------------------------------------------- */
+static inline USZ map_hash(U64 const id)
+{
+   return (USZ)((id >> 4) * 0x9E3779B97F4A7C15U);
+}
+/* -------------------------------------------------------------------------- */
+static bool map_init(replay_map*const m, USZ const cap)
+{
+   USZ const bytes = cap * sizeof(replay_obj);
+   m->t = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (MAP_FAILED == m->t) {
+      return false;
+   }
+   memset(m->t, 0, bytes);
+   m->mask = cap - 1;
+   m->count = 0;
+   return true;
+}
+/* -------------------------------------------------------------------------- */
+static replay_obj*map_find(replay_map const*const m, U64 const id)
+{
+   for (USZ i = map_hash(id) & m->mask;; i = (i + 1) & m->mask) {
+      if (m->t[i].id == id) {
+         return &m->t[i];
+      }
+      if (0 == m->t[i].id) {
+         return NULL;
+      }
+   }
+}
+/* -------------------------------------------------------------------------- */
+static void map_put(replay_map*const m, U64 const id, void*const p,
+                    USZ const size);
+static bool map_grow(replay_map*const m)
+{
+   replay_map old = *m;
+   if (!map_init(m, (old.mask + 1) << 1)) {
+      *m = old;
+      return false;
+   }
+   for (USZ i = 0; i <= old.mask; i++) {
+      if (0 != old.t[i].id) {
+         map_put(m, old.t[i].id, old.t[i].p, old.t[i].size);
+      }
+   }
+   munmap(old.t, (old.mask + 1) * sizeof(replay_obj));
+   return true;
+}
+/* -------------------------------------------------------------------------- */
+static void map_put(replay_map*const m, U64 const id, void*const p,
+                    USZ const size)
+{
+   USZ i = map_hash(id) & m->mask;
+   while (0 != m->t[i].id && id != m->t[i].id) {
+      i = (i + 1) & m->mask;
+   }
+   m->count += 0 == m->t[i].id;
+   m->t[i] = (replay_obj){ .id = id, .p = p, .size = size };
+}
+/* -------------------------------------------------------------------------- */
+/* backward shift: no tombstones */
+static void map_del(replay_map*const m, replay_obj*const o)
+{
+   USZ i = o - m->t;
+   for (USZ j = (i + 1) & m->mask; 0 != m->t[j].id; j = (j + 1) & m->mask) {
+      USZ const home = map_hash(m->t[j].id) & m->mask;
+      /* j can fill the hole at i if its home isn't in (i, j] */
+      if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+         m->t[i] = m->t[j];
+         i = j;
+      }
+   }
+   m->t[i].id = 0;
+   m->count--;
+}
+/* -------------------------------------------------------------------------- */
+static heap*replay_heap;
+static bool use_libc;
+
+static void*replay_alloc(USZ const sz)
+{
+   return use_libc ? malloc(sz) : heap_alloc(replay_heap, sz);
+}
+static void replay_free(void*const p)
+{
+   use_libc ? free(p) : heap_free(replay_heap, p);
+}
+static void*replay_realloc(void*const p, USZ const sz)
+{
+   return use_libc ? realloc(p, sz) : heap_realloc(replay_heap, p, sz);
+}
+static double replay_frag(void)
+{
+   if (use_libc) {
+      return 0;
+   }
+   heap_stats st;
+   heap_get_stats(replay_heap, &st);
+   return st.fragmentation;
+}
+/* -------------------------------------------------------------------------- */
+static inline U64 now_ns(void)
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (U64)t.tv_sec * 1000000000U + t.tv_nsec;
+}
+/* -------------------------------------------------------------------------- */
+/* the cheapest of back to back reads, taken off each op */
+static U64 now_cost(void)
+{
+   U64 cost = ~(U64)0;
+   for (U32 i = 0; i < 4096; i++) {
+      U64 const t0 = now_ns();
+      U64 const t1 = now_ns();
+      if (t1 - t0 < cost) {
+         cost = t1 - t0;
+      }
+   }
+   return cost;
+}
+/* -------------------------------------------------------------------------- */
+static USZ resident(void)
+{
+   long pages = 0, rss = 0;
+   FILE*const f = fopen("/proc/self/statm", "r");
+   if (NULL != f) {
+      if (2 != fscanf(f, "%ld %ld", &pages, &rss)) {
+         rss = 0;
+      }
+      fclose(f);
+   }
+   return (USZ)rss * sysconf(_SC_PAGESIZE);
+}
+/* -------------------------------------------------------------------------- */
+static USZ parse_size(char const*const s)
+{
+   char*end;
+   USZ v = strtoull(s, &end, 0);
+   switch (*end) {
+   case 'G': case 'g': v <<= 10; /* fall through */
+   case 'M': case 'm': v <<= 10; /* fall through */
+   case 'K': case 'k': v <<= 10; break;
+   default: break;
+   }
+   return v;
+}
+/* -------------------------------------------------------------------------- */
+int main(int argc, char*argv[])
+{
+   USZ heap_size = REPLAY_HEAP_SIZE;
+   U32 policy = HEAP_POLICY_LIFO;
+   char const*path = NULL;
+   for (int i = 1; i < argc; i++) {
+      if (0 == strcmp(argv[i], "-libc")) {
+         use_libc = true;
+      } else if (0 == strcmp(argv[i], "-address")) {
+         policy = HEAP_POLICY_ADDRESS;
+      } else if (0 == strcmp(argv[i], "-size") && i + 1 < argc) {
+         heap_size = parse_size(argv[++i]);
+      } else {
+         path = argv[i];
+      }
+   }
+   if (NULL == path) {
+      fprintf(stderr, "usage: %s [-libc | -address] [-size bytes] trace\n",
+              argv[0]);
+      return 1;
+   }
+
+   int const fd = open(path, O_RDONLY);
+   struct stat st;
+   if (fd < 0 || 0 != fstat(fd, &st) || st.st_size < (off_t)sizeof(heap_trace_rec)) {
+      fprintf(stderr, "ERR: couldn't read %s.\n", path);
+      return 1;
+   }
+   heap_trace_rec const*const rec = mmap(NULL, st.st_size, PROT_READ,
+                                         MAP_PRIVATE, fd, 0);
+   USZ const count = st.st_size / sizeof(heap_trace_rec);
+   if (MAP_FAILED == rec || HEAP_TRACE_MAGIC != rec[0].id
+         || sizeof(heap_trace_rec) != rec[0].info) {
+      fprintf(stderr, "ERR: %s is not a trace.\n", path);
+      return 1;
+   }
+
+   replay_map m;
+   if (!map_init(&m, 1 << 16)) {
+      return 1;
+   }
+   USZ const base = resident();
+   if (!use_libc) {
+      replay_heap = heap_create(NULL, heap_size);
+      if (NULL == replay_heap) {
+         return 1;
+      }
+      heap_set_growth(replay_heap, heap_size);
+      heap_set_policy(replay_heap, policy);
+   }
+
+   U64 ns[4] = { 0 }, ops[4] = { 0 };
+   U64 failed = 0, trace_failed = 0, unknown = 0;
+   USZ live = 0, peak_live = 0, peak_rss = 0;
+   double frag = 0, peak_frag = 0;
+   U32 threads = 0;
+   U64 const cost = now_cost();
+   U64 const t0 = now_ns();
+   for (USZ i = 1; i < count; i++) {
+      heap_trace_rec const r = rec[i];
+      U32 const op = HEAP_TRACE_OP(r.info);
+      USZ const size = HEAP_TRACE_SIZE(r.info);
+      if (HEAP_TRACE_THREAD(r.info) > threads) {
+         threads = HEAP_TRACE_THREAD(r.info);
+      }
+      if (0 == (i % REPLAY_SAMPLE)) {
+         USZ const rss = resident() - (m.mask + 1) * sizeof(replay_obj);
+         if (rss > base && rss - base > peak_rss) {
+            peak_rss = rss - base;
+         }
+         frag = replay_frag();
+         if (frag > peak_frag) {
+            peak_frag = frag;
+         }
+      }
+      replay_obj*const o = HEAP_TRACE_ALLOC == op ? NULL : map_find(&m, r.id);
+      U64 const start = now_ns();
+      switch (op) {
+      case HEAP_TRACE_ALLOC: {
+         if (0 == r.id) {
+            trace_failed++;
+            continue;
+         }
+         void*const p = replay_alloc(size);
+         ns[op] += now_ns() - start - cost;
+         if (NULL == p) {
+            failed++;
+            continue;
+         }
+         if (2 * (m.count + 1) > m.mask && !map_grow(&m)) {
+            fprintf(stderr, "ERR: out of memory for the replay.\n");
+            return 1;
+         }
+         map_put(&m, r.id, p, size);
+         live += size;
+         break;
+      }
+      case HEAP_TRACE_FREE:
+         if (NULL == o) {
+            unknown++;
+            continue;
+         }
+         replay_free(o->p);
+         ns[op] += now_ns() - start - cost;
+         live -= o->size;
+         map_del(&m, o);
+         break;
+      case HEAP_TRACE_REALLOC: {
+         if (NULL == o) {
+            unknown++;
+            continue;
+         }
+         void*const p = replay_realloc(o->p, size);
+         ns[op] += now_ns() - start - cost;
+         if (NULL == p) {
+            failed++;
+            continue;
+         }
+         live += size - o->size;
+         o->p = p;
+         o->size = size;
+         break;
+      }
+      default:
+         fprintf(stderr, "ERR: unknown op %u in record %zu.\n", op, i);
+         return 1;
+      }
+      ops[op]++;
+      if (live > peak_live) {
+         peak_live = live;
+      }
+   }
+   U64 const t1 = now_ns();
+   USZ const rss = resident() - (m.mask + 1) * sizeof(replay_obj);
+   if (rss > base && rss - base > peak_rss) {
+      peak_rss = rss - base;
+   }
+   frag = replay_frag();
+   if (frag > peak_frag) {
+      peak_frag = frag;
+   }
+
+   U64 const done = ops[1] + ops[2] + ops[3];
+   printf("%s: %zu records from %u threads replayed with %s in %.1fms "
+          "(%.0f ops/s)\n", path, count - 1, threads,
+          use_libc ? "the libc" : HEAP_POLICY_ADDRESS == policy ?
+          "MC-Heap (address ordered)" : "MC-Heap", (t1 - t0) / 1e6,
+          done / ((t1 - t0) / 1e9));
+   char const*const names[] = { NULL, "alloc", "free", "realloc" };
+   for (U32 op = 1; op < 4; op++) {
+      if (0 != ops[op]) {
+         printf("   %-8s %10llu ops, %7.1fns per op\n", names[op],
+                (unsigned long long)ops[op], (double)ns[op] / ops[op]);
+      }
+   }
+   printf("   peak: %zu bytes asked for, %zu bytes resident\n", peak_live,
+          peak_rss);
+   if (!use_libc) {
+      printf("   fragmentation: %.1f%% at the peak, %.1f%% at the end\n",
+             100.0 * peak_frag, 100.0 * frag);
+   }
+   printf("   %llu allocations failed, %llu had failed in the trace, %llu ops "
+          "on unknown blocks\n", (unsigned long long)failed,
+          (unsigned long long)trace_failed, (unsigned long long)unknown);
+   return 0;
+}
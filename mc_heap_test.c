@@ -24,6 +24,12 @@
  *    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "mc_heap.c"
+#include <sys/mman.h>
+#include <time.h>
+#ifdef HEAP_SHARED
+   #include <fcntl.h>
+   #include <sys/wait.h>
+#endif
 /* -------------------------------------------------------------------------- */
 static void __attribute((unused)) test_alloc_inc(heap *H,U32 step)
 {
@@ -64,11 +70,53 @@ static void __attribute((unused)) test_alloc_inc(heap *H,U32 step)
    return;
 }
 /* -------------------------------------------------------------------------- */
+/* the bytes of the empty slabs H keeps: the last one of each size of each
+ * region stays when its objects are freed */
+static USZ __attribute((unused)) kept_slabs(heap const*const H)
+{
+   USZ kept = 0;
+#ifdef HEAP_SLAB
+   for (heap const*r = H; NULL != r; r = r->next) {
+      for (U32 i = 0; i < SLAB_CLASSES; i++) {
+         if (NULL != r->slabs[i] && 0 == r->slabs[i]->used) {
+            kept += SLAB_SIZE;
+         }
+      }
+   }
+#endif
+   return kept;
+}
+/* -------------------------------------------------------------------------- */
+/* all the blocks of H are free: it can be allocated whole again, unless it
+ * keeps empty slabs */
+static bool __attribute((unused)) all_free(heap*const H)
+{
+   /* the blocks cached by this thread aren't free in the heap yet */
+   heap_tcache_flush(H);
+   USZ const kept = kept_slabs(H);
+   if (0 != kept) {
+      heap_stats st;
+      heap_get_stats(H, &st);
+      return kept == st.allocated;
+   }
+   void*const all = heap_alloc(H, H->hsize);
+   if (NULL == all) {
+      return false;
+   }
+   heap_free(H, all);
+   return true;
+}
+/* -------------------------------------------------------------------------- */
 static void test_mixed_sizes(heap*const H)
 {
    /* allocate multiple sets of 16,32,64,128,16 bytes */
    U32 const set_size = 5;
+#ifdef HEAP_SLAB
+   /* the slab headers take some of the heap */
+   U32 const set_count = 1024*1024 - 1024*1024/16;
+#else
    U32 const set_count = 1024*1024;
+#endif
    void**pointers = malloc(set_count * set_size * sizeof(void*));
    ASSERT(NULL != pointers);
    for (U32 i = 0; i < set_count; i++) {
@@ -104,9 +152,7 @@ static void test_mixed_sizes(heap*const H)
    }
 
    /* double check the heap is completely freed */
-   void*all = heap_alloc(H, H->hsize);
-   ASSERT(NULL != all);
-   heap_free(H, all);
+   ASSERT(all_free(H));
    free(pointers);
 }
 /* -------------------------------------------------------------------------- */
@@ -122,8 +168,12 @@ static void test_alloc_all(heap*const H, U32 const elem_size)
     * be aligned on 4096 bytes. Therefore, only 8 allocs of 4096 bytes can be
     * made per chunk of 64kB
     */
-   static const U32 bslist[MAIN_BASE_SIZE_COUNT] = {
-                           16, 256, 4096, 65536, 1048576, 16777216, 268435456 };
+   static const USZ bslist[MAIN_BASE_SIZE_COUNT] = {
+                           16, 256, 4096, 65536, 1048576, 16777216, 268435456,
+                        #if MAIN_BASE_SIZE_COUNT > 7
+                           4294967296,
+                        #endif
+                           };
    U32 align_idx = 0;
    for (U32 x = 0; x < MAIN_BASE_SIZE_COUNT; x++) {
       if (size < bslist[x]) {
@@ -132,31 +182,1491 @@ static void test_alloc_all(heap*const H, U32 const elem_size)
          break;
       }
    }
-   U32 const next_bs = bslist[align_idx + 1];
-   alloc_count = (next_bs / ((size + bslist[align_idx] - 1) &
-                                   ~(bslist[align_idx] - 1))) * (H->hsize / next_bs);
+   USZ const next_bs = bslist[align_idx + 1];
+   USZ const slot = (size + bslist[align_idx] - 1) & ~(bslist[align_idx] - 1);
+   alloc_count = (next_bs / slot) * (H->hsize / next_bs);
    pointers = (void**)malloc(alloc_count * sizeof(void*));
    ASSERT(pointers != NULL);
+   U32 least __attribute((unused)) = alloc_count;
+   bool slabbed __attribute((unused)) = false;
+#ifdef HEAP_SLAB
+   /* the empty slabs the heap keeps take a slot each, or their chunk's worth */
+   least -= (kept_slabs(H) / SLAB_SIZE) * (slot < SLAB_SIZE ? SLAB_SIZE / slot : 1);
+   if (size <= HEAP_SLAB_MAX_SIZE) {
+      /* slab objects: rounded to SLAB_STEP, and the slab headers and the
+       * empty slabs of the other sizes take some of the heap */
+      size = SMALL_ROUND(elem_size);
+      least = alloc_count - alloc_count / 16;
+      slabbed = true;
+   }
+#endif
    for (i = 0; i < alloc_count; i++) {
       pointers[i] = heap_alloc(H,elem_size);
-      ASSERT(NULL != pointers[i]);
+      if (NULL == pointers[i]) {
+         break;
+      }
    #ifdef DEBUG_BUILD
       memset(pointers[i],0xA5,elem_size); /* overwrite chunk's next & prev */
    #endif
       ASSERT(heap_get_alloc_size(H,pointers[i]) == size);
-      ASSERT(heap_get_address_status(H,pointers[i]) == eSTATUS_ALLOC_HEAD);
+      ASSERT(slabbed ||
+             heap_get_address_status(H,pointers[i]) == eSTATUS_ALLOC_HEAD);
    }
-   ASSERT(heap_alloc(H,elem_size) == NULL);
+   ASSERT(i >= least);
+   /* the heap is full, unless its slabs hold more objects than blocks would */
+   ASSERT((slabbed && i == alloc_count) || heap_alloc(H,elem_size) == NULL);
+   alloc_count = i;
    PRINTF("Allocated %u times %u bytes.\n",alloc_count,elem_size);
+   bool cached __attribute((unused)) = false;
+#ifdef HEAP_THREAD_SAFE
+   /* small blocks stay allocated in this thread's cache until it's flushed */
+   cached = elem_size <= HEAP_TCACHE_MAX_SIZE;
+#endif
    for (i = 0; i < alloc_count; i++) {
       heap_free(H,pointers[i]);
-      ASSERT(heap_get_address_status(H,pointers[i]) == eSTATUS_FREE);
+      ASSERT(slabbed || cached ||
+             heap_get_address_status(H,pointers[i]) == eSTATUS_FREE);
    }
+   heap_tcache_flush(H);
    PRINTF("Freed them all.\n");
    free(pointers);
    return;
 }
 /* -------------------------------------------------------------------------- */
+#define RA_SLOTS (1024)
+#define RA_OPS (1024*1024)
+static void test_realloc(heap*const H)
+{
+   /* a shrunk block grows back in place, across levels */
+   static const USZ steps[] = { 16, 65536 + 4096 + 256 + 16, 4096 + 16,
+                                2 * 65536 };
+   U8*p = heap_alloc(H, 2 * 65536);
+   ASSERT(NULL != p);
+   for (U32 i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+      U8*const q = heap_realloc(H, p, steps[i]);
+   #ifdef HEAP_STRIPED
+      /* the stripes resize by moving */
+      ASSERT(NULL != q);
+   #else
+      ASSERT(q == p);
+   #endif
+      ASSERT(heap_get_alloc_size(H, q) == steps[i]);
+      p = q;
+   }
+   heap_free(H, p);
+
+   /* random resizes, every block tagged and checked */
+   U8**const slots = calloc(RA_SLOTS, sizeof(*slots));
+   USZ*const sizes = calloc(RA_SLOTS, sizeof(*sizes));
+   ASSERT(NULL != slots && NULL != sizes);
+   U32 x = 1, in_place = 0;
+   for (U32 i = 0; i < RA_OPS; i++) {
+      x = x * 1103515245U + 12345U;
+      U32 const s = (x >> 8) % RA_SLOTS;
+      U32 const r = x >> 20;
+      USZ const sz = (r & 0x800) ? 1 + (r & 0x7F) :
+                     (r & 0x400) ? 1 + ((r * 7) & 0x3FFF) : 1 + r * 97;
+      U8*const q = heap_realloc(H, slots[s], sz);
+      ASSERT(NULL != q);
+      USZ const kept = sz < sizes[s] ? sz : sizes[s];
+      for (USZ j = 0; j < kept; j += 61) {
+         ASSERT(q[j] == (U8)(s + j));
+      }
+      ASSERT(0 == kept || q[kept - 1] == (U8)(s + kept - 1));
+      /* slab objects are rounded to SMALL_STEP, blocks shrunk in place to
+       * BASE_SIZE_MIN */
+      USZ const got __attribute((unused)) = heap_get_alloc_size(H, q);
+      ASSERT(got == SMALL_ROUND(sz) ||
+             got == ((sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1)));
+      in_place += q == slots[s];
+      for (USZ j = kept; j < sz; j++) {
+         q[j] = (U8)(s + j);
+      }
+      slots[s] = q;
+      sizes[s] = sz;
+   }
+   PRINTF("Resized %u blocks, %u times in place.\n", RA_OPS, in_place);
+   for (U32 s = 0; s < RA_SLOTS; s++) {
+      heap_free(H, slots[s]);
+   }
+   free(slots);
+   free(sizes);
+   ASSERT(all_free(H));
+}
+/* -------------------------------------------------------------------------- */
+static bool __attribute((unused)) is_zero(U8 const*const p, USZ const n)
+{
+   return 0 == p[0] && 0 == memcmp(p, p + 1, n - 1);
+}
+/* -------------------------------------------------------------------------- */
+#define CA_SLOTS (4096)
+#define CA_OPS (256*1024)
+static void test_calloc(void)
+{
+   USZ const SIZE = 64 * 1024 * 1024;
+   U8*const map = mmap(NULL, 2 * SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   ASSERT(MAP_FAILED != map);
+   U8*const data = (U8*)(((USZ)map + SIZE - 1) & ~(SIZE - 1));
+   heap*const H = heap_create(data, SIZE);
+   ASSERT(NULL != H);
+   heap_set_zeroed(H);
+
+   /* fresh memory isn't cleared, memory handed out before is */
+   USZ const big_sz = 16 * 1024 * 1024;
+   struct timespec t0, t1, t2, t3;
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   U8*big = heap_calloc(H, 1, big_sz);
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   ASSERT(NULL != big && is_zero(big, big_sz));
+   memset(big, 0xA5, big_sz);
+   heap_free(H, big);
+   clock_gettime(CLOCK_MONOTONIC, &t2);
+   big = heap_calloc(H, big_sz / 16, 16);
+   clock_gettime(CLOCK_MONOTONIC, &t3);
+   ASSERT(NULL != big && is_zero(big, big_sz));
+   heap_free(H, big);
+   PRINTF("calloc of %zu bytes: %.3fms when known zero, %.3fms otherwise.\n",
+          big_sz, (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6,
+          (t3.tv_sec - t2.tv_sec) * 1e3 + (t3.tv_nsec - t2.tv_nsec) / 1e6);
+   ASSERT(NULL == heap_calloc(H, SIZE_MAX / 2, 4));
+
+   /* dirty blocks and zeroed blocks mixed up */
+   U8**const slots = calloc(CA_SLOTS, sizeof(*slots));
+   ASSERT(NULL != slots);
+   U32 x = 1;
+   for (U32 i = 0; i < CA_OPS; i++) {
+      x = x * 1103515245U + 12345U;
+      U32 const s = (x >> 8) % CA_SLOTS;
+      if (NULL != slots[s]) {
+         heap_free(H, slots[s]);
+         slots[s] = NULL;
+         continue;
+      }
+      USZ const sz = (x & 0x80000000U) ? 1 + ((x >> 16) & 0xFFFU) :
+                                          1 + ((x >> 12) & 0xFFFFU);
+      if (x & 0x40000000U) {
+         slots[s] = heap_calloc(H, 1, sz);
+         ASSERT(NULL != slots[s] && is_zero(slots[s], sz));
+      } else {
+         slots[s] = heap_alloc(H, sz);
+         ASSERT(NULL != slots[s]);
+      }
+      memset(slots[s], 0xA5, sz);
+   }
+   for (U32 s = 0; s < CA_SLOTS; s++) {
+      if (NULL != slots[s]) {
+         heap_free(H, slots[s]);
+      }
+   }
+   free(slots);
+   PRINTF("Mixed %u allocs and callocs.\n", CA_OPS);
+
+   heap_destroy(H);
+   munmap(map, 2 * SIZE);
+}
+/* -------------------------------------------------------------------------- */
+#define AA_SLOTS (4096)
+static void test_aligned_alloc(heap*const H)
+{
+   /* only the unused end of the aligned chunk is lost... for a while */
+   U8*const p = heap_aligned_alloc(H, 4096, 100);
+   ASSERT(NULL != p && 0 == ((USZ)p & 4095));
+   ASSERT(heap_get_alloc_size(H, p) == 112);
+   /* a block, not a slab object */
+   U8*const q = heap_alloc(H, SMALL_MAX_SIZE + BASE_SIZE_MIN);
+   ASSERT(q > p && q < p + 4096);
+   heap_free(H, q);
+   heap_free(H, p);
+
+   void*r = NULL;
+   int const e1 = heap_posix_memalign(H, &r, 24, 100);
+   int const e2 = heap_posix_memalign(H, &r, 4, 100);
+   ASSERT(EINVAL == e1 && EINVAL == e2 && NULL == r);
+   int const e3 = heap_posix_memalign(H, &r, 64, 100);
+   ASSERT(0 == e3 && NULL != r && 0 == ((USZ)r & 63));
+   heap_free(H, r);
+   (void)e1; (void)e2; (void)e3;
+
+   U8*const m = heap_aligned_alloc(H, 1024 * 1024, 4096 + 16);
+   ASSERT(NULL != m && 0 == ((USZ)m & (1024 * 1024 - 1)));
+   heap_free(H, m);
+
+   /* alignments up to 64KB, mixed up with random frees */
+   U8**const slots = calloc(AA_SLOTS, sizeof(*slots));
+   ASSERT(NULL != slots);
+   U32 x = 1, count = 0;
+   for (U32 i = 0; i < 64 * AA_SLOTS; i++) {
+      x = x * 1103515245U + 12345U;
+      U32 const s = (x >> 8) % AA_SLOTS;
+      if (NULL != slots[s]) {
+         heap_free(H, slots[s]);
+         slots[s] = NULL;
+         continue;
+      }
+      USZ const align = (USZ)1 << ((x >> 20) % 17);
+      USZ const sz = 1 + ((x >> 4) & 0x1FFFU);
+      slots[s] = heap_aligned_alloc(H, align, sz);
+      ASSERT(NULL != slots[s]);
+      ASSERT(0 == ((USZ)slots[s] & (align - 1)));
+      USZ const got __attribute((unused)) = heap_get_alloc_size(H, slots[s]);
+      ASSERT(got == SMALL_ROUND(sz) ||
+             got == ((sz + BASE_SIZE_MIN - 1) & ~(USZ)(BASE_SIZE_MIN - 1)));
+      memset(slots[s], 0xA5, sz);
+      count++;
+   }
+   for (U32 s = 0; s < AA_SLOTS; s++) {
+      if (NULL != slots[s]) {
+         heap_free(H, slots[s]);
+      }
+   }
+   free(slots);
+   PRINTF("Allocated %u aligned blocks.\n", count);
+   ASSERT(all_free(H));
+}
+/* -------------------------------------------------------------------------- */
+#define BA_COUNT (1024)
+#define BA_ROUNDS (4096)
+static double elapsed_ms(struct timespec const*const t0,
+                         struct timespec const*const t1)
+{
+   return (t1->tv_sec - t0->tv_sec) * 1e3 + (t1->tv_nsec - t0->tv_nsec) / 1e6;
+}
+/* -------------------------------------------------------------------------- */
+static void test_batch(heap*const H)
+{
+   static void*ptrs[BA_COUNT];
+   static U32 const sizes[] = { 48, 512, 16 + 256 + 4096, 1 };
+   for (U32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      USZ const sz __attribute((unused)) =
+                  (sizes[s] + BASE_SIZE_MIN - 1) & ~(BASE_SIZE_MIN - 1);
+      U32 const n = heap_alloc_batch(H, sizes[s], BA_COUNT, ptrs);
+      ASSERT(BA_COUNT == n);
+      for (U32 i = 0; i < n; i++) {
+         ASSERT(heap_get_alloc_size(H, ptrs[i]) == sz);
+         memset(ptrs[i], (U8)i, sizes[s]);
+      }
+      for (U32 i = 0; i < n; i++) {
+         ASSERT(((U8*)ptrs[i])[0] == (U8)i);
+      }
+      if (48 == sizes[s]) {
+         /* carved 5 by 5 from 256 bytes chunks */
+         ASSERT((U8*)ptrs[1] == (U8*)ptrs[0] + 48);
+         ASSERT((U8*)ptrs[4] == (U8*)ptrs[0] + 4 * 48);
+      }
+      /* free in "random" order */
+      for (U32 i = 0; i < n; i++) {
+         U32 const j = (i * 7919) % n;
+         void*const t = ptrs[i];
+         ptrs[i] = ptrs[j];
+         ptrs[j] = t;
+      }
+      heap_free_batch(H, ptrs, n);
+      ASSERT(all_free(H));
+   }
+
+   struct timespec t0, t1, t2;
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (U32 r = 0; r < BA_ROUNDS; r++) {
+      for (U32 i = 0; i < 64; i++) {
+         ptrs[i] = heap_alloc(H, 48);
+      }
+      for (U32 i = 0; i < 64; i++) {
+         heap_free(H, ptrs[i]);
+      }
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   for (U32 r = 0; r < BA_ROUNDS; r++) {
+      U32 const n = heap_alloc_batch(H, 48, 64, ptrs);
+      ASSERT(64 == n);
+      heap_free_batch(H, ptrs, n);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t2);
+   PRINTF("%u x 64 blocks of 48 bytes: %.3fms one by one, %.3fms in batches.\n",
+          BA_ROUNDS, elapsed_ms(&t0, &t1), elapsed_ms(&t1, &t2));
+}
+/* -------------------------------------------------------------------------- */
+#define FS_COUNT  128
+#define FS_ROUNDS 2048
+static void test_free_sized(heap*const H)
+{
+   static void*ptrs[FS_COUNT];
+   static U32 const sizes[] = { 16, 24, 48, 16 + 256, 16 + 256 + 4096,
+                                16 + 4096 + 65536, 65536 };
+
+   /* blocks from every allocation path, freed with the size asked for */
+   void*const a = heap_alloc(H, 1000);
+   void*const c = heap_calloc(H, 3, 100);
+   void*const al = heap_aligned_alloc(H, 4096, 16 + 256);
+   void*r = heap_alloc(H, 16 + 256 + 4096);
+   ASSERT(NULL != a && NULL != c && NULL != al && NULL != r);
+   r = heap_realloc(H, r, 300);
+   ASSERT(NULL != r);
+   U32 const n = heap_alloc_batch(H, 48, 64, ptrs);
+   ASSERT(64 == n);
+   heap_free_sized(H, a, 1000);
+   heap_free_sized(H, c, 300);
+   heap_free_sized(H, al, 16 + 256);
+   heap_free_sized(H, r, 300);
+   for (U32 i = 0; i < n; i++) {
+      heap_free_sized(H, ptrs[i], 48);
+   }
+   if (0 != kept_slabs(H)) {
+      ASSERT(all_free(H));
+   } else {
+      heap_tcache_flush(H);
+      void*const all = heap_alloc(H, H->hsize);
+      ASSERT(NULL != all);
+      heap_free_sized(H, all, H->hsize);
+   }
+
+   /* the walk saved grows with the number of levels of the size */
+   for (U32 s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      double t_free = 0, t_sized = 0;
+      for (U32 r = 0; r < FS_ROUNDS; r++) {
+         struct timespec t0, t1;
+         for (U32 i = 0; i < FS_COUNT; i++) {
+            ptrs[i] = heap_alloc(H, sizes[s]);
+            ASSERT(NULL != ptrs[i]);
+         }
+         clock_gettime(CLOCK_MONOTONIC, &t0);
+         for (U32 i = 0; i < FS_COUNT; i++) {
+            heap_free(H, ptrs[i]);
+         }
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+         t_free += elapsed_ms(&t0, &t1);
+         for (U32 i = 0; i < FS_COUNT; i++) {
+            ptrs[i] = heap_alloc(H, sizes[s]);
+            ASSERT(NULL != ptrs[i]);
+         }
+         clock_gettime(CLOCK_MONOTONIC, &t0);
+         for (U32 i = 0; i < FS_COUNT; i++) {
+            heap_free_sized(H, ptrs[i], sizes[s]);
+         }
+         clock_gettime(CLOCK_MONOTONIC, &t1);
+         t_sized += elapsed_ms(&t0, &t1);
+      }
+      double const k = 1e6 / ((double)FS_COUNT * FS_ROUNDS);
+      PRINTF("free of %u bytes blocks: %.1fns with heap_free, "
+             "%.1fns with heap_free_sized.\n",
+             sizes[s], t_free * k, t_sized * k);
+   }
+}
+/* -------------------------------------------------------------------------- */
+/* a heap made of two 1MB regions, then one growing 1MB at a time */
+static void test_regions(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   static void*ptrs[512];
+   void*r0, *r1;
+   if (0 != posix_memalign(&r0, SIZE, SIZE) ||
+       0 != posix_memalign(&r1, SIZE, SIZE)) {
+      ASSERT(false);
+      return;
+   }
+   heap*H = heap_create(r0, SIZE);
+   ASSERT(NULL != H);
+   int const added __attribute((unused)) = heap_add_region(H, r1, SIZE);
+   ASSERT(0 == added);
+   int const again __attribute((unused)) = heap_add_region(H, r1, SIZE);
+   ASSERT(-1 == again);
+
+   /* 2MB in 4KB blocks: both regions get used up */
+   U32 in0 = 0, in1 = 0;
+   for (U32 i = 0; i < 512; i++) {
+      ptrs[i] = heap_alloc(H, 4096);
+      ASSERT(NULL != ptrs[i]);
+      ASSERT(heap_get_alloc_size(H, ptrs[i]) == 4096);
+      memset(ptrs[i], (U8)i, 4096);
+      in0 += (U8*)ptrs[i] >= (U8*)r0 && (U8*)ptrs[i] < (U8*)r0 + SIZE;
+      in1 += (U8*)ptrs[i] >= (U8*)r1 && (U8*)ptrs[i] < (U8*)r1 + SIZE;
+   }
+   ASSERT(256 == in0 && 256 == in1);
+   ASSERT(NULL == heap_alloc(H, 16));
+   /* the second region serves the best fit */
+   heap_free(H, ptrs[300]);
+   heap_free(H, ptrs[10]);
+   heap_free(H, ptrs[11]);
+   void*const p = heap_alloc(H, 4096);
+   ASSERT(p == ptrs[300]);
+   ptrs[300] = p;
+   ptrs[10] = ptrs[11] = NULL;
+   /* a block at the start of a 64KB chunk grows in place over the next one */
+   U32 g = 0, next = 0;
+   while (NULL == ptrs[g] || 0 != ((USZ)ptrs[g] & 0xFFFFU)) {
+      g++;
+   }
+   while (NULL == ptrs[next] || (U8*)ptrs[next] != (U8*)ptrs[g] + 4096) {
+      next++;
+   }
+   heap_free(H, ptrs[next]);
+   ptrs[next] = NULL;
+   void*const q __attribute((unused)) = heap_realloc(H, ptrs[g], 8192);
+#ifdef HEAP_STRIPED
+   /* the stripes resize by moving */
+   ASSERT(NULL != q);
+   ptrs[g] = q;
+#else
+   ASSERT(q == ptrs[g]);
+#endif
+   for (U32 i = 0; i < 512; i++) {
+      if (NULL != ptrs[i]) {
+         ASSERT(((U8*)ptrs[i])[4095] == (U8)i);
+         heap_free_sized(H, ptrs[i], g == i ? 8192 : 4096);
+      }
+   }
+   void*const all0 = heap_alloc(H, SIZE);
+   void*const all1 = heap_alloc(H, SIZE);
+   ASSERT(NULL != all0 && NULL != all1 && all0 != all1);
+   heap_free(H, all0);
+   heap_free(H, all1);
+   heap_destroy(H);
+   free(r0);
+   free(r1);
+
+   /* a growing heap, mapped by itself */
+   H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+   heap_set_growth(H, SIZE);
+   for (U32 i = 0; i < 512; i++) {
+      ptrs[i] = heap_alloc(H, 16 + 256 + 4096 * 3);
+      ASSERT(NULL != ptrs[i]);
+      memset(ptrs[i], (U8)i, 16 + 256 + 4096 * 3);
+   }
+   /* larger than the growth size */
+   void*const big = heap_calloc(H, 5, SIZE);
+   ASSERT(NULL != big && is_zero(big, 5 * SIZE));
+   void*const al = heap_aligned_alloc(H, SIZE, 100);
+   ASSERT(NULL != al && 0 == ((USZ)al & (SIZE - 1)));
+   U32 const n = heap_alloc_batch(H, 48, 256, ptrs + 256);
+   ASSERT(256 == n);
+   heap_free_batch(H, ptrs + 256, n);
+   for (U32 i = 0; i < 256; i++) {
+      ASSERT(((U8*)ptrs[i])[16 + 256] == (U8)i);
+      heap_free(H, ptrs[i]);
+   }
+   heap_free(H, big);
+   heap_free(H, al);
+   void*const all = heap_alloc(H, SIZE);
+   ASSERT(NULL != all);
+   heap_free(H, all);
+   heap_destroy(H);
+}
+/* -------------------------------------------------------------------------- */
+/* none of the pages of [p, p + n) is resident */
+static bool __attribute((unused)) not_resident(void*const p, USZ const n)
+{
+   static unsigned char vec[4096];
+   USZ const pages = n >> 12;
+   ASSERT(0 == ((USZ)p & 4095) && pages <= sizeof(vec));
+   if (0 != mincore(p, n, vec)) {
+      return false;
+   }
+   for (USZ i = 0; i < pages; i++) {
+      if (0 != (vec[i] & 1)) {
+         return false;
+      }
+   }
+   return true;
+}
+/* -------------------------------------------------------------------------- */
+static void test_release(void)
+{
+   USZ const SIZE = 64 * 1024 * 1024;
+   USZ const BIG = 8 * 1024 * 1024;
+   USZ resident, released, before;
+   heap*const H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+   void*const keep = heap_alloc(H, 4096);
+   ASSERT(NULL != keep);
+
+   /* released when freed */
+   int const set __attribute((unused)) = heap_set_release(H, 1024 * 1024, 0);
+   ASSERT(0 == set);
+   U8*p = heap_alloc(H, BIG);
+   ASSERT(NULL != p);
+   memset(p, 0x55, BIG);
+   heap_free(H, p);
+   heap_get_release_stats(H, &resident, &released);
+   ASSERT(released >= BIG - 4096 && resident + released == SIZE);
+   ASSERT(not_resident(p + 65536, BIG - 65536));
+   /* faulted back in as zero: no need to clear it */
+   p = heap_calloc(H, 1, BIG);
+   ASSERT(NULL != p && is_zero(p, BIG));
+   before = released;
+   heap_get_release_stats(H, &resident, &released);
+   ASSERT(released <= before - BIG);
+   memset(p, 0x55, BIG);
+   heap_free(H, p);
+
+   /* released by heap_trim() only */
+   heap_set_release(H, 1024 * 1024, HEAP_RELEASE_DEFERRED);
+   p = heap_alloc(H, BIG);
+   ASSERT(NULL != p);
+   memset(p, 0x55, BIG);
+   heap_get_release_stats(H, &resident, &before);
+   heap_free(H, p);
+   heap_get_release_stats(H, &resident, &released);
+   ASSERT(released == before);
+   USZ const trimmed __attribute((unused)) = heap_trim(H);
+   ASSERT(trimmed >= BIG - 4096);
+   ASSERT(not_resident(p + 65536, BIG - 65536));
+
+   /* lazily: the pages may keep their data, calloc clears them */
+   heap_set_release(H, 1024 * 1024, HEAP_RELEASE_LAZY);
+   p = heap_alloc(H, BIG);
+   ASSERT(NULL != p);
+   memset(p, 0x55, BIG);
+   heap_free(H, p);
+   p = heap_calloc(H, 1, BIG);
+   ASSERT(NULL != p && is_zero(p, BIG));
+   heap_free(H, p);
+
+   heap_free(H, keep);
+   heap_set_release(H, 0, 0);
+   heap_destroy(H);
+}
+/* -------------------------------------------------------------------------- */
+#ifdef HEAP_SLAB
+#define SL_COUNT (1000)
+static void test_slab(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   heap_stats st;
+   U8*p[SL_COUNT];
+   heap*const H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+
+   /* 24 bytes objects, packed in slabs */
+   for (U32 i = 0; i < SL_COUNT; i++) {
+      p[i] = heap_alloc(H, 24);
+      ASSERT(NULL != p[i] && 0 == ((USZ)p[i] & 7));
+      ASSERT(24 == heap_get_alloc_size(H, p[i]));
+      memset(p[i], i & 0xFF, 24);
+   }
+   heap_tcache_flush(H);
+   USZ const per_slab = (SLAB_SIZE - SLAB_HEADER) / 24;
+   USZ const slabs __attribute((unused)) = (SL_COUNT + per_slab - 1) / per_slab;
+   heap_get_stats(H, &st);
+   ASSERT(slabs * SLAB_SIZE == st.allocated);
+   for (U32 i = 0; i < SL_COUNT; i++) {
+      for (U32 j = 0; j < 24; j++) {
+         ASSERT((i & 0xFF) == p[i][j]);
+      }
+   }
+
+   /* a slab header isn't an object */
+   heap_free(H, (void*)((USZ)p[0] & ~(SLAB_SIZE - 1)));
+
+   /* every other one: the slabs stay, then the rest: all but one go back */
+   for (U32 i = 0; i < SL_COUNT; i += 2) {
+      heap_free(H, p[i]);
+   }
+   heap_tcache_flush(H);
+   heap_get_stats(H, &st);
+   ASSERT(slabs * SLAB_SIZE == st.allocated);
+   for (U32 i = 1; i < SL_COUNT; i += 2) {
+      heap_free_sized(H, p[i], 24);
+   }
+   heap_tcache_flush(H);
+   heap_get_stats(H, &st);
+   ASSERT(SLAB_SIZE == st.allocated);
+
+   /* resized by moving, but within their size */
+   U8*q = heap_alloc(H, 24);
+   memset(q, 0x5A, 24);
+   ASSERT(q == heap_realloc(H, q, 20));
+   q = heap_realloc(H, q, 40);
+   ASSERT(NULL != q && 40 == heap_get_alloc_size(H, q));
+   ASSERT(0x5A == q[0] && 0x5A == q[19]);
+   q = heap_realloc(H, q, 1000);
+   ASSERT(NULL != q && 0x5A == q[19]);
+   heap_free(H, q);
+   q = heap_calloc(H, 3, 8);
+   ASSERT(NULL != q && 0 == q[0] && 0 == q[23]);
+   heap_free(H, q);
+   q = heap_aligned_alloc(H, 16, 24);
+   ASSERT(NULL != q && 0 == ((USZ)q & 15));
+   heap_free(H, q);
+   heap_tcache_flush(H);
+
+   /* no chunk left for a slab: a block it is */
+   U32 n = 0;
+   while (NULL != (p[n] = heap_alloc(H, 4096))) {
+      n++;
+   }
+   heap_free(H, p[--n]);
+   p[n] = heap_alloc(H, 2048);
+   q = heap_alloc(H, 56);
+   ASSERT(NULL != q && 64 == heap_get_alloc_size(H, q));
+   heap_free(H, q);
+   heap_tcache_flush(H);
+   for (U32 i = 0; i <= n; i++) {
+      heap_free(H, p[i]);
+   }
+   /* the last slab of each size stays: 24, 32 and 40 bytes */
+   heap_get_stats(H, &st);
+   ASSERT(3 * SLAB_SIZE == st.allocated);
+
+   heap_destroy(H);
+}
+#endif
+/* -------------------------------------------------------------------------- */
+static void test_alloc_at_least(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   heap*const H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+   ASSERT(SIZE == heap_largest_free(H));
+
+   /* a 4KB block leaves 15 chunks of 64KB and 15 of 4KB */
+   void*p[5];
+   p[0] = heap_alloc(H, 4096);
+   ASSERT(15 * 65536 == heap_largest_free(H));
+   void*const big = heap_alloc(H, heap_largest_free(H));
+   ASSERT(NULL != big && 15 * 4096 == heap_largest_free(H));
+   ASSERT(NULL == heap_alloc(H, 15 * 4096 + 16));
+   heap_free(H, big);
+
+   /* a hole of 3 chunks of 4KB: the best fit, taken whole */
+   for (U32 i = 1; i < 5; i++) {
+      p[i] = heap_alloc(H, 4096);
+      ASSERT(NULL != p[i]);
+   }
+   for (U32 i = 1; i < 4; i++) {
+      heap_free(H, p[i]);
+   }
+   USZ actual = 0;
+   void*q = heap_alloc_at_least(H, 4000, &actual);
+   ASSERT(q == p[3] && 3 * 4096 == actual);
+   ASSERT(actual == heap_get_alloc_size(H, q));
+   heap_free(H, q);
+   /* no run of its level: rounded to its highest nibble */
+   q = heap_alloc_at_least(H, 100, &actual);
+   ASSERT(NULL != q && 112 == actual);
+   heap_free(H, q);
+   q = heap_alloc_at_least(H, 2 * SIZE, &actual);
+   ASSERT(NULL == q && 0 == actual);
+
+   heap_free(H, p[0]);
+   heap_free(H, p[4]);
+   heap_tcache_flush(H);
+   ASSERT(SIZE == heap_largest_free(H));
+   heap_destroy(H);
+}
+/* -------------------------------------------------------------------------- */
+static void test_policy(void)
+{
+   USZ const SIZE = 16 * 1024 * 1024;
+   heap*const H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+   ASSERT(-1 == heap_set_policy(H, 7));
+#ifdef HEAP_STRIPED
+   ASSERT(-1 == heap_set_policy(H, HEAP_POLICY_ADDRESS));
+   heap_destroy(H);
+#else
+   /* the heap full of 4KB blocks: block k is at HDATA(H) + k * 4096 */
+   USZ const N = SIZE / 4096;
+   U8*q __attribute((unused));
+   for (USZ k = 0; k < N; k++) {
+      q = heap_alloc(H, 4096);
+      ASSERT(NULL != q);
+   }
+   ASSERT(NULL == heap_alloc(H, 16));
+   U8*const base = HDATA(H);
+
+   /* a hole every 3 blocks, freed from the bottom up: LIFO hands the last one
+    * out first */
+   for (USZ k = 1; k < N; k += 3) {
+      heap_free(H, base + k * 4096);
+   }
+   USZ const last = ((N - 2) / 3) * 3 + 1;
+   q = heap_alloc(H, 4096);
+   ASSERT(base + last * 4096 == q);
+   for (USZ k = 1; k < last; k += 3) {
+      q = heap_alloc(H, 4096);
+      ASSERT(NULL != q);
+   }
+   ASSERT(NULL == heap_alloc(H, 16));
+
+   /* by address, from the bottom up whatever the order they were freed in */
+   int const rc __attribute((unused)) =
+                                   heap_set_policy(H, HEAP_POLICY_ADDRESS);
+   ASSERT(0 == rc);
+   for (USZ k = 1; k < N; k += 3) {
+      heap_free(H, base + (last + 1 - k) * 4096);
+   }
+   for (USZ k = 1; k < N; k += 3) {
+      q = heap_alloc(H, 4096);
+      ASSERT(base + k * 4096 == q);
+   }
+   ASSERT(NULL == heap_alloc(H, 16));
+
+   /* two holes further apart than a scan goes: both are found */
+   heap_free(H, base + (N - 1) * 4096);
+   heap_free(H, base);
+   q = heap_alloc(H, 4096);
+   ASSERT(base == q);
+   q = heap_alloc(H, 4096);
+   ASSERT(base + (N - 1) * 4096 == q);
+   heap_free(H, base + 4096);
+   q = heap_alloc(H, 4096);
+   ASSERT(base + 4096 == q);
+
+   /* a chunk split for a smaller block is the lowest as well */
+   heap_free(H, base + 8 * 4096);
+   heap_free(H, base + 2 * 4096);
+   q = heap_alloc(H, 16);
+   ASSERT(q >= base + 2 * 4096 && q < base + 3 * 4096);
+   heap_free(H, q);
+
+   for (USZ k = 0; k < N; k++) {
+      if (2 != k && 8 != k) {
+         heap_free(H, base + k * 4096);
+      }
+   }
+   heap_tcache_flush(H);
+   heap_stats st;
+   heap_get_stats(H, &st);
+   ASSERT(SIZE == st.free + kept_slabs(H));
+   heap_destroy(H);
+#endif
+}
+/* -------------------------------------------------------------------------- */
+#define HD_COUNT (240)
+static void test_handles(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   heap*const H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+#ifdef HEAP_STRIPED
+   ASSERT(0 == heap_halloc(H, 100));
+   ASSERT(0 == heap_compact(H, SIZE));
+   heap_destroy(H);
+#else
+   ASSERT(0 == heap_compact(H, SIZE));
+   heap_handle hd[HD_COUNT];
+   for (U32 i = 0; i < HD_COUNT; i++) {
+      hd[i] = heap_halloc(H, 4000);
+      ASSERT(0 != hd[i]);
+      U8*const p = heap_hlock(H, hd[i]);
+      memset(p, (U8)i, 4000);
+      heap_hunlock(H, hd[i]);
+   }
+   ASSERT(NULL == heap_hlock(H, 0) && NULL == heap_hlock(H, HD_COUNT * 2));
+
+   /* one block in 16 is kept: scattered, they keep most chunks of 64KB from
+    * being free */
+   for (U32 i = 0; i < HD_COUNT; i++) {
+      if (0 != i % 16) {
+         heap_hfree(H, hd[i]);
+         hd[i] = 0;
+      }
+   }
+   USZ const before __attribute((unused)) = heap_largest_free(H);
+   ASSERT(before < SIZE / 2);
+
+   /* a locked block stays where it is */
+   U8*const pinned __attribute((unused)) = heap_hlock(H, hd[16]);
+   ASSERT(0 == heap_compact(H, 16));
+   USZ moved, total = 0;
+   while (0 != (moved = heap_compact(H, 3 * 4096))) {
+      ASSERT(moved <= 3 * 4096);
+      total += moved;
+   }
+   ASSERT(0 != total);
+   heap_hunlock(H, hd[16]);
+   U8*const p __attribute((unused)) = heap_hlock(H, hd[16]);
+   ASSERT(pinned == p);
+   /* nor is it freed */
+   heap_hfree(H, hd[16]);
+   ASSERT(p == heap_hlock(H, hd[16]));
+   heap_hunlock(H, hd[16]);
+   heap_hunlock(H, hd[16]);
+   /* the 15 blocks and the handles table end up in the lowest 64KB */
+   while (0 != heap_compact(H, SIZE)) {
+   }
+   ASSERT(heap_largest_free(H) > before && heap_largest_free(H) >= 14 * 65536);
+
+   for (U32 i = 0; i < HD_COUNT; i += 16) {
+      U8 const*const q __attribute((unused)) = heap_hlock(H, hd[i]);
+      for (U32 j = 0; j < 4000; j++) {
+         ASSERT((U8)i == q[j]);
+      }
+      heap_hunlock(H, hd[i]);
+      heap_hfree(H, hd[i]);
+   }
+   heap_destroy(H);
+#endif
+}
+/* -------------------------------------------------------------------------- */
+static int test_create_in_cb(void*const ctx, void*const address,
+                             size_t const size, int const used)
+{
+   /* the first block: the book-keeping when it's kept in the region */
+   void**const first = (void**)ctx;
+   first[0] = address;
+   first[1] = (void*)(USZ)size;
+   first[2] = (void*)(USZ)used;
+   return 1;
+}
+/* -------------------------------------------------------------------------- */
+static void test_create_in(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   USZ const META = heap_bookkeeping_size(SIZE);
+   ASSERT(0 != META && META < SIZE / 32);
+   ASSERT(0 == heap_bookkeeping_size(100));
+   ASSERT(0 == heap_bookkeeping_size(0));
+   heap_stats st;
+
+   /* in a buffer of the caller */
+   U8*const meta = aligned_alloc(16, META + 16);
+   ASSERT(NULL != meta);
+   ASSERT(NULL == heap_create_in(NULL, SIZE, meta + 8));
+   heap*H = heap_create_in(NULL, SIZE, meta);
+   ASSERT((void*)H == meta && SIZE == heap_largest_free(H));
+   void*p = heap_alloc(H, 4096);
+   ASSERT(NULL != p);
+   heap_free(H, p);
+   ASSERT(SIZE == heap_largest_free(H));
+   heap_destroy(H);
+   free(meta);
+
+   /* in the region: its first block */
+   H = heap_create_in(NULL, SIZE, NULL);
+   ASSERT(NULL != H && HDATA(H) == (U8*)H);
+   void*first[3];
+   int const r __attribute((unused)) = heap_walk(H, test_create_in_cb, first);
+   ASSERT(1 == r && (void*)H == first[0]);
+   ASSERT(META == (USZ)first[1] && 0 != (USZ)first[2]);
+   heap_get_stats(H, &st);
+   ASSERT(META == st.allocated && SIZE - META == st.free);
+   ASSERT(15 * 65536 == st.largest_free);
+
+   /* the rest of the region can all be handed out */
+   U32 n = 0;
+   void*q[256];
+   while (n < 256 && NULL != (q[n] = heap_alloc(H, 4096))) {
+      n++;
+   }
+   ASSERT((SIZE - ((META + 4095) & ~(USZ)4095)) / 4096 == n);
+   for (U32 i = 0; i < n; i++) {
+      heap_free(H, q[i]);
+   }
+   heap_get_stats(H, &st);
+   ASSERT(META == st.allocated && 15 * 65536 == st.largest_free);
+
+   /* and so are the regions it grows */
+   heap_set_growth(H, SIZE);
+   for (U32 i = 0; i < 3; i++) {
+      q[i] = heap_alloc(H, SIZE / 2);
+      ASSERT(NULL != q[i]);
+   }
+   heap_get_stats(H, &st);
+   ASSERT(3 * SIZE == st.size && 3 * (META + SIZE / 2) == st.allocated);
+   for (heap const*g = H->next; NULL != g; g = g->next) {
+      ASSERT(META_REGION == g->meta && HDATA(g) == (U8 const*)g);
+   }
+   for (U32 i = 0; i < 3; i++) {
+      heap_free(H, q[i]);
+   }
+   heap_get_stats(H, &st);
+   ASSERT(3 * META == st.allocated);
+   heap_destroy(H);
+}
+/* -------------------------------------------------------------------------- */
+static int test_unaligned_cb(void*const ctx, void*const address,
+                             size_t const size, int const used)
+{
+   void**const first = (void**)ctx;
+   first[0] = address;
+   first[1] = (void*)(USZ)used;
+   return 1;
+}
+/* -------------------------------------------------------------------------- */
+#define UA_COUNT (512)
+static void test_unaligned(void)
+{
+   USZ const SIZE = 0x30000;
+   U8*const buf = aligned_alloc(0x100000, 0x100000);
+   ASSERT(NULL != buf);
+   U8*const address = buf + 0x1230;
+   heap_stats st;
+   ASSERT(NULL == heap_create(address + 8, SIZE));
+
+   /* managed from buf, all of [address, address + SIZE) is free */
+   heap*H = heap_create(address, SIZE);
+   ASSERT(NULL != H && HDATA(H) == buf && 0x1230 == H->hoff);
+   heap_get_stats(H, &st);
+   ASSERT(SIZE == st.size && SIZE == st.free && 0 == st.allocated);
+   void*first[2];
+   heap_walk(H, test_unaligned_cb, first);
+   ASSERT(address == first[0] && 0 == (USZ)first[1]);
+
+   /* blocks keep their alignment: 47 of 4KB from buf + 0x2000 up, and the
+    * head and tail fragments for 16 bytes blocks */
+   void*p[UA_COUNT];
+   U32 n = 0;
+   while (NULL != (p[n] = heap_alloc(H, 4096))) {
+      ASSERT(0 == ((USZ)p[n] & 4095));
+      ASSERT((U8*)p[n] >= address && (U8*)p[n] + 4096 <= address + SIZE);
+      n++;
+   }
+   ASSERT(47 == n);
+   while (n < UA_COUNT && NULL != (p[n] = heap_alloc(H, 16))) {
+      ASSERT((U8*)p[n] >= address && (U8*)p[n] + 16 <= address + SIZE);
+      n++;
+   }
+   ASSERT(47 + (0x2000 - 0x1230 + 0x230) / 16 == n);
+   ASSERT(NULL == heap_alloc(H, 16));
+   for (U32 i = 0; i < n; i++) {
+      heap_free(H, p[i]);
+   }
+   void*const q = heap_aligned_alloc(H, 65536, 100);
+   ASSERT(NULL != q && 0 == ((USZ)q & 65535) && (U8*)q >= address);
+   heap_free(H, q);
+   heap_tcache_flush(H);
+   heap_get_stats(H, &st);
+   ASSERT(SIZE == st.free);
+   heap_destroy(H);
+
+   /* with the book-keeping in the region, right at its start */
+   USZ const META __attribute((unused)) = heap_bookkeeping_size_at(address, SIZE);
+   ASSERT(META > heap_bookkeeping_size(SIZE));
+   H = heap_create_in(address, SIZE, NULL);
+   ASSERT((U8*)H == address);
+   heap_walk(H, test_unaligned_cb, first);
+   ASSERT(address == first[0] && 0 != (USZ)first[1]);
+   heap_get_stats(H, &st);
+   ASSERT(SIZE == st.size && META == st.allocated);
+   heap_destroy(H);
+   free(buf);
+}
+#ifdef HEAP_SHARED
+/* -------------------------------------------------------------------------- */
+/* another mapping of the shared object fd, aligned as the heap needs */
+static U8*test_shared_map(int const fd, USZ const size)
+{
+   U8*const a = region_map(size);
+   ASSERT(NULL != a);
+   U8*const m = mmap(a, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                     fd, 0);
+   ASSERT(MAP_FAILED != m && a == m);
+   return m;
+}
+/* -------------------------------------------------------------------------- */
+#define SH_COUNT (100)
+static void test_shared(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   USZ const META = heap_bookkeeping_size(SIZE);
+   char name[64];
+   snprintf(name, sizeof(name), "/mc-heap-test-%d", (int)getpid());
+   int const fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+   ASSERT(fd >= 0);
+   shm_unlink(name);
+   int const rc __attribute((unused)) = ftruncate(fd, SIZE);
+   ASSERT(0 == rc);
+   U8*const m1 = test_shared_map(fd, SIZE);
+   U8*const m2 = test_shared_map(fd, SIZE);
+   ASSERT(NULL == heap_attach(m2));
+
+   /* one heap, seen at two addresses */
+   heap*const A = heap_create_shared(m1, SIZE);
+   heap*const B = heap_attach(m2);
+   ASSERT((U8*)A == m1 && (U8*)B == m2);
+   ASSERT(NULL == heap_create_shared(NULL, SIZE));
+   ASSERT(-1 == heap_add_region(A, NULL, SIZE));
+
+   /* blocks of one are freed by the other */
+   void*p[SH_COUNT];
+   for (U32 i = 0; i < SH_COUNT; i++) {
+      heap*const h = 0 == (i & 1) ? A : B;
+      p[i] = heap_alloc(h, 16 + i * 48);
+      ASSERT(NULL != p[i]);
+      memset(p[i], i, 16 + i * 48);
+   }
+   for (U32 i = 0; i < SH_COUNT; i++) {
+      USZ const off = 0 == (i & 1) ? (U8*)p[i] - m1 : (U8*)p[i] - m2;
+      U8*const q = 0 == (i & 1) ? m2 + off : m1 + off;
+      ASSERT(i == q[0] && i == q[15 + i * 48]);
+      heap_free(0 == (i & 1) ? B : A, q);
+   }
+   heap_stats st;
+   heap_get_stats(B, &st);
+   ASSERT(META == st.allocated);
+
+   /* free runs leave the object, not just the mapping of the one freeing */
+   USZ const BIG = 256 * 1024;
+   USZ resident, released;
+   int const set __attribute((unused)) = heap_set_release(A, 65536, 0);
+   ASSERT(0 == set);
+   U8*const big = heap_alloc(A, BIG);
+   ASSERT(NULL != big);
+   memset(big, 0x55, BIG);
+   U8*const big2 = m2 + (big - m1);
+   ASSERT(0x55 == big2[0] && 0x55 == big2[BIG - 1]);
+   heap_free(B, big2);
+   heap_get_release_stats(A, &resident, &released);
+   ASSERT(released >= BIG - 65536 && resident + released == SIZE);
+   ASSERT(not_resident(big + 65536, BIG - 2 * 65536));
+   ASSERT(not_resident(big2 + 65536, BIG - 2 * 65536));
+   heap_set_release(A, 0, 0);
+
+   /* a child process maps the object again and hands a block over */
+   USZ*const mbox = heap_calloc(A, 1, sizeof(USZ));
+   ASSERT(NULL != mbox);
+   pid_t const pid = fork();
+   ASSERT(pid >= 0);
+   if (0 == pid) {
+      U8*const m3 = test_shared_map(fd, SIZE);
+      heap*const C = heap_attach(m3);
+      char*const msg = NULL == C ? NULL : heap_alloc(C, 4096);
+      if (NULL == msg) {
+         _exit(1);
+      }
+      strcpy(msg, "from the child");
+      *(USZ*)(m3 + ((U8*)mbox - m1)) = (U8*)msg - m3;
+      _exit(0);
+   }
+   int status = 0;
+   waitpid(pid, &status, 0);
+   ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+   char*const msg = (char*)(m1 + *mbox);
+   ASSERT(0 == strcmp(msg, "from the child"));
+   ASSERT(4096 == heap_get_alloc_size(B, m2 + *mbox));
+   heap_free(B, m2 + *mbox);
+   heap_free(A, mbox);
+   heap_get_stats(A, &st);
+   ASSERT(META == st.allocated);
+
+   heap_destroy(A);
+   ASSERT(NULL == heap_attach(m2));
+   munmap(m1, SIZE);
+   munmap(m2, SIZE);
+   close(fd);
+}
+/* -------------------------------------------------------------------------- */
+#define PS_COUNT (50)
+static void test_persistent(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   char path[64];
+   snprintf(path, sizeof(path), "/tmp/mc-heap-test-%d.heap", (int)getpid());
+   unlink(path);
+   ASSERT(NULL == heap_create_persistent(path, 100));
+   heap*H = heap_create_persistent(path, SIZE);
+   ASSERT(NULL != H && NULL == heap_get_root(H));
+
+   /* a table of blocks, found again from the root */
+   USZ*table = heap_alloc(H, PS_COUNT * sizeof(USZ));
+   ASSERT(NULL != table);
+   for (U32 i = 0; i < PS_COUNT; i++) {
+      U8*const p = heap_alloc(H, 100 + i * 300);
+      ASSERT(NULL != p);
+      memset(p, i, 100 + i * 300);
+      table[i] = p - HDATA(H);
+   }
+   heap_set_root(H, table);
+   heap_stats st0, st;
+   heap_get_stats(H, &st0);
+   ASSERT(0 == heap_sync(H));
+   heap_destroy(H);
+
+   ASSERT(NULL == heap_create_persistent(path, 2 * SIZE));
+   H = heap_create_persistent(path, 0);
+   ASSERT(NULL != H && SIZE == H->hsize);
+   table = heap_get_root(H);
+   ASSERT(NULL != table);
+   heap_get_stats(H, &st);
+   ASSERT(st0.allocated == st.allocated && st0.free == st.free);
+   for (U32 i = 0; i < PS_COUNT; i++) {
+      U8*const p = HDATA(H) + table[i];
+      ASSERT(100 + i * 300 <= heap_get_alloc_size(H, p));
+      ASSERT(i == p[0] && i == p[99 + i * 300]);
+      heap_free(H, p);
+   }
+   heap_free(H, table);
+   heap_set_root(H, NULL);
+   heap_get_stats(H, &st);
+   ASSERT(heap_bookkeeping_size(SIZE) == st.allocated);
+   heap_destroy(H);
+   unlink(path);
+
+   /* the pages given back hold the file's data until it's punched: calloc
+    * can't count on them reading as zero */
+   H = heap_create_persistent(path, 4 * SIZE);
+   ASSERT(NULL != H);
+   heap_set_release(H, 65536, 0);
+   U8*p = heap_alloc(H, SIZE);
+   ASSERT(NULL != p);
+   memset(p, 0x55, SIZE);
+   heap_free(H, p);
+   p = heap_calloc(H, 1, SIZE);
+   ASSERT(NULL != p && is_zero(p, SIZE));
+   heap_free(H, p);
+   heap_destroy(H);
+
+   /* not a heap */
+   FILE*const f = fopen(path, "w");
+   ASSERT(NULL != f);
+   for (USZ i = 0; i < SIZE; i++) {
+      fputc(0x5A, f);
+   }
+   fclose(f);
+   ASSERT(NULL == heap_create_persistent(path, 0));
+   unlink(path);
+}
+#endif
+/* -------------------------------------------------------------------------- */
+#define ST_COUNT (64)
+static void test_stats(void)
+{
+   USZ const SIZE = 1024 * 1024;
+   heap_stats st;
+   void*p[ST_COUNT];
+   heap*const H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+
+   heap_get_stats(H, &st);
+   ASSERT(SIZE == st.size && SIZE == st.free && 0 == st.allocated);
+   ASSERT(SIZE == st.largest_free && 0.0 == st.fragmentation);
+   ASSERT(1 == st.free_runs[base_size_to_index(SIZE)] && 0 == st.live_blocks);
+
+   for (U32 i = 0; i < ST_COUNT; i++) {
+      p[i] = heap_alloc(H, 4096);
+      ASSERT(NULL != p[i]);
+   }
+   heap_get_stats(H, &st);
+   ASSERT(ST_COUNT * 4096 == st.allocated && SIZE == st.allocated + st.free);
+#ifdef HEAP_STATS
+   ASSERT(ST_COUNT == st.live_blocks && ST_COUNT == st.allocs);
+#endif
+
+   /* every other one: holes that can't serve more than 4KB */
+   for (U32 i = 0; i < ST_COUNT; i += 2) {
+      heap_free(H, p[i]);
+   }
+   heap_get_stats(H, &st);
+   ASSERT(ST_COUNT / 2 * 4096 == st.allocated);
+   ASSERT(st.largest_free < st.free && 0.0 < st.fragmentation);
+   PRINTF("stats: %zu bytes allocated, %zu free, largest free run %zu bytes, "
+          "fragmentation %.3f.\n", st.allocated, st.free, st.largest_free,
+          st.fragmentation);
+
+   /* the rest in a batch, merged before being freed */
+   for (U32 i = 1; i < ST_COUNT; i += 2) {
+      p[i / 2] = p[i];
+   }
+   heap_free_batch(H, p, ST_COUNT / 2);
+   heap_get_stats(H, &st);
+   ASSERT(SIZE == st.free && 0.0 == st.fragmentation && 0 == st.live_blocks);
+
+   /* carved in a batch, shrunk in place */
+   U32 const n __attribute((unused)) = heap_alloc_batch(H, 16, ST_COUNT, p);
+   ASSERT(ST_COUNT == n);
+   void*q = heap_alloc(H, 65536 + 4096);
+   ASSERT(NULL != q);
+   q = heap_realloc(H, q, 4096);
+   ASSERT(NULL != q);
+   heap_get_stats(H, &st);
+   ASSERT(ST_COUNT * 16 + 4096 == st.allocated);
+#ifdef HEAP_STATS
+   ASSERT(ST_COUNT + 1 == st.live_blocks);
+#endif
+   heap_free(H, q);
+   heap_free_batch(H, p, ST_COUNT);
+   heap_get_stats(H, &st);
+   ASSERT(SIZE == st.free && 0 == st.live_blocks);
+
+   heap_destroy(H);
+}
+/* -------------------------------------------------------------------------- */
+#define WK_COUNT (32)
+typedef struct {
+   U8*next;      /* where the next block must start */
+   U32 used;
+   U32 free;
+   void*const*p; /* the allocated blocks, in address order */
+   USZ const*sz;
+} walk_check;
+static int test_walk_cb(void*const ctx, void*const address, USZ const size,
+                        int const used)
+{
+   walk_check*const c = (walk_check*)ctx;
+   ASSERT((U8*)address == c->next && 0 != size);
+   c->next += size;
+   if (used) {
+      ASSERT(address == c->p[c->used] && size == c->sz[c->used]);
+      c->used++;
+   } else {
+      c->free++;
+   }
+   return 0;
+}
+static int test_walk_stop(void*const ctx, void*const address, USZ const size,
+                          int const used)
+{
+   (void)address; (void)size;
+   *(U32*)ctx += 1;
+   return used ? 1 : 0;
+}
+static void test_walk(void)
+{
+   USZ const SIZE = 1024 * 1024 + 3 * 65536 + 4096;
+   void*p[WK_COUNT];
+   USZ sz[WK_COUNT];
+   heap_stats st;
+   heap*const H = heap_create(NULL, SIZE);
+   ASSERT(NULL != H);
+
+   /* multi-level sizes, and holes between them */
+   for (U32 i = 0; i < WK_COUNT; i++) {
+      sz[i] = (USZ)0x1230 + i * 0x110;
+      p[i] = heap_alloc(H, sz[i]);
+      ASSERT(NULL != p[i]);
+   }
+   for (U32 i = 0; i < WK_COUNT; i += 3) {
+      heap_free(H, p[i]);
+   }
+   U32 n = 0;
+   for (U32 i = 0; i < WK_COUNT; i++) {
+      if (0 != i % 3) {
+         p[n] = p[i];
+         sz[n++] = sz[i];
+      }
+   }
+   /* address order */
+   for (U32 i = 1; i < n; i++) {
+      for (U32 j = i; j > 0 && (USZ)p[j - 1] > (USZ)p[j]; j--) {
+         void*const t = p[j]; p[j] = p[j - 1]; p[j - 1] = t;
+         USZ const u = sz[j]; sz[j] = sz[j - 1]; sz[j - 1] = u;
+      }
+   }
+
+   U8*const base = HDATA(H);
+   walk_check c = { .next = base, .used = 0, .free = 0, .p = p, .sz = sz };
+   int const r __attribute((unused)) = heap_walk(H, test_walk_cb, &c);
+   ASSERT(0 == r && c.next == base + SIZE && c.used == n);
+   heap_get_stats(H, &st);
+   U32 runs = 0;
+   for (U32 i = 0; i < HEAP_STATS_CLASSES; i++) {
+      runs += st.free_runs[i];
+   }
+   ASSERT(c.free == runs);
+   U32 seen __attribute((unused)) = 0;
+   int const stop __attribute((unused)) = heap_walk(H, test_walk_stop, &seen);
+   ASSERT(1 == stop && seen <= c.free + 1);
+
+   /* one line per cell and a header */
+   FILE*const f = tmpfile();
+   ASSERT(NULL != f);
+   int const bad __attribute((unused)) =
+                   heap_dump_map(H, f, MAIN_BASE_SIZE_COUNT, HEAP_MAP_ASCII);
+   int const ok __attribute((unused)) = heap_dump_map(H, f, 2, HEAP_MAP_CSV);
+   ASSERT(-1 == bad && 0 == ok);
+   rewind(f);
+   U32 lines = 0;
+   for (int ch; EOF != (ch = fgetc(f));) {
+      lines += '\n' == ch;
+   }
+   ASSERT(1 + SIZE / 4096 == lines);
+   fclose(f);
+   heap_dump_map(H, stdout, 3, HEAP_MAP_ASCII);
+
+   for (U32 i = 0; i < n; i++) {
+      heap_free(H, p[i]);
+   }
+   heap_destroy(H);
+}
+/* -------------------------------------------------------------------------- */
+#ifdef HEAP_TRACE
+static void test_trace(void)
+{
+   heap*const H = heap_create(NULL, 1024 * 1024);
+   char path[] = "/tmp/mc_heap_traceXXXXXX";
+   int const fd = mkstemp(path);
+   ASSERT(NULL != H && fd >= 0);
+   close(fd);
+   int const started __attribute((unused)) = heap_trace_start(H, path);
+   ASSERT(0 == started);
+
+   void*const a = heap_alloc(H, 100);
+   void*const b = heap_calloc(H, 4, 1000);
+   void*const c = heap_realloc(H, b, 2000);
+   heap_free(H, a);
+   heap_free_sized(H, c, 2000);
+   void*const d __attribute((unused)) = heap_alloc(H, 2 * 1024 * 1024);
+   ASSERT(NULL != a && NULL != b && NULL != c && NULL == d);
+   heap_trace_stop(H);
+
+   /* what's expected, after the header */
+   heap_trace_rec exp[8] = {
+      { .id = (USZ)a, .info = HEAP_TRACE_INFO(HEAP_TRACE_ALLOC, 0, 100) },
+      { .id = (USZ)b, .info = HEAP_TRACE_INFO(HEAP_TRACE_ALLOC, 0, 4000) },
+   };
+   U32 n = 2;
+   if (b == c) {
+      exp[n++] = (heap_trace_rec){ .id = (USZ)b,
+                  .info = HEAP_TRACE_INFO(HEAP_TRACE_REALLOC, 0, 2000) };
+   } else {
+      exp[n++] = (heap_trace_rec){ .id = (USZ)c,
+                  .info = HEAP_TRACE_INFO(HEAP_TRACE_ALLOC, 0, 2000) };
+      exp[n++] = (heap_trace_rec){ .id = (USZ)b,
+                  .info = HEAP_TRACE_INFO(HEAP_TRACE_FREE, 0, 0) };
+   }
+   exp[n++] = (heap_trace_rec){ .id = (USZ)a,
+               .info = HEAP_TRACE_INFO(HEAP_TRACE_FREE, 0, 0) };
+   exp[n++] = (heap_trace_rec){ .id = (USZ)c,
+               .info = HEAP_TRACE_INFO(HEAP_TRACE_FREE, 0, 0) };
+   exp[n++] = (heap_trace_rec){ .id = 0,
+               .info = HEAP_TRACE_INFO(HEAP_TRACE_ALLOC, 0, 2 * 1024 * 1024) };
+
+   heap_trace_rec rec[10];
+   FILE*const f = fopen(path, "rb");
+   ASSERT(NULL != f);
+   USZ const got __attribute((unused)) = fread(rec, sizeof(rec[0]), 10, f);
+   fclose(f);
+   unlink(path);
+   ASSERT(got == n + 1);
+   ASSERT(HEAP_TRACE_MAGIC == rec[0].id && sizeof(rec[0]) == rec[0].info);
+   for (U32 i = 0; i < n; i++) {
+      ASSERT(rec[i + 1].id == exp[i].id);
+      ASSERT(HEAP_TRACE_OP(rec[i + 1].info) == HEAP_TRACE_OP(exp[i].info));
+      ASSERT(HEAP_TRACE_SIZE(rec[i + 1].info) == HEAP_TRACE_SIZE(exp[i].info));
+      ASSERT(0 != HEAP_TRACE_THREAD(rec[i + 1].info));
+      ASSERT(rec[i + 1].time >= rec[i].time);
+   }
+   heap_destroy(H);
+}
+#endif
+/* -------------------------------------------------------------------------- */
+#if MAIN_BASE_SIZE_COUNT > 7
+/* a heap larger than 4GB, reserved but never entirely touched */
+static void test_large_heap(void)
+{
+   USZ const SIZE = 0x410000000U; /* 16GB + 256MB */
+   USZ const ALIGN = 0x100000000U;
+   U8*const map = mmap(NULL, SIZE + ALIGN, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   ASSERT(MAP_FAILED != map);
+   U8*const data = (U8*)(((USZ)map + ALIGN - 1) & ~(ALIGN - 1));
+   heap*const H = heap_create(data, SIZE);
+   ASSERT(NULL != H);
+
+   USZ const big_sz = 0x140000000U; /* 5GB */
+   void*const big = heap_alloc(H, big_sz);
+   ASSERT(NULL != big);
+   ASSERT(0 == (((U8*)big - data) & (ALIGN - 1)));
+   ASSERT(heap_get_alloc_size(H, big) == big_sz);
+   void*const small = heap_alloc(H, 16+256+4096);
+   ASSERT(NULL != small);
+   ASSERT(heap_get_alloc_size(H, small) == 16+256+4096);
+   /* only 11GB + 256MB are left */
+   ASSERT(NULL == heap_alloc(H, 0x300000000U));
+   void*const mid = heap_alloc(H, 0x200000000U);
+   ASSERT(NULL != mid);
+   heap_free(H, small);
+   heap_free(H, big);
+   heap_free(H, mid);
+   void*const all = heap_alloc(H, 0x400000000U);
+   ASSERT(all == data);
+   ASSERT(NULL != heap_alloc(H, 0x10000000U));
+   ASSERT(NULL == heap_alloc(H, 16));
+   heap_free(H, all);
+   PRINTF("Allocated and freed %zu bytes blocks in a %zu bytes heap.\n",
+          big_sz, SIZE);
+
+   heap_destroy(H);
+   munmap(map, SIZE + ALIGN);
+}
+#endif
+/* -------------------------------------------------------------------------- */
+#if defined(HEAP_THREAD_SAFE) || defined(HEAP_STRIPED)
+#define MT_THREADS_MAX (64)
+#define MT_SLOTS (4096)
+#define MT_OPS (1024*1024)
+typedef struct {
+   heap*H;
+   U32 seed;
+} mt_arg;
+/* random alloc / free of mostly small blocks, every block tagged and checked */
+static void*test_threads_worker(void*arg)
+{
+   mt_arg const*const a = (mt_arg*)arg;
+   U8**const slots = calloc(MT_SLOTS, sizeof(*slots));
+   USZ*const sizes = calloc(MT_SLOTS, sizeof(*sizes));
+   ASSERT(NULL != slots && NULL != sizes);
+   U32 x = a->seed;
+   for (U32 i = 0; i < MT_OPS; i++) {
+      x = x * 1103515245U + 12345U;
+      U32 const s = (x >> 8) % MT_SLOTS;
+      if (NULL != slots[s]) {
+         ASSERT(slots[s][0] == (U8)s && slots[s][sizes[s] - 1] == (U8)s);
+         heap_free(a->H, slots[s]);
+         slots[s] = NULL;
+      } else {
+         USZ const sz = (0 == (x & 0x3F00000U)) ? 4096 + (x >> 26) * 100 :
+                                                  1 + ((x >> 16) & 0xFFU);
+         slots[s] = heap_alloc(a->H, sz);
+         ASSERT(NULL != slots[s]);
+         ASSERT(heap_get_alloc_size(a->H, slots[s]) >= sz);
+         memset(slots[s], (U8)s, sz);
+         sizes[s] = sz;
+      }
+   }
+   for (U32 s = 0; s < MT_SLOTS; s++) {
+      if (NULL != slots[s]) {
+         heap_free(a->H, slots[s]);
+      }
+   }
+   free(slots);
+   free(sizes);
+   return NULL;
+}
+/* -------------------------------------------------------------------------- */
+static void test_threads(heap*const H, U32 const nthreads)
+{
+   pthread_t threads[MT_THREADS_MAX];
+   mt_arg args[MT_THREADS_MAX];
+   struct timespec t0, t1;
+   ASSERT(nthreads <= MT_THREADS_MAX);
+   clock_gettime(CLOCK_MONOTONIC, &t0);
+   for (U32 t = 0; t < nthreads; t++) {
+      args[t].H = H;
+      args[t].seed = t + 1;
+      if (0 != pthread_create(&threads[t], NULL, test_threads_worker, &args[t])) {
+         perror("pthread_create");
+         ASSERT(false);
+      }
+   }
+   for (U32 t = 0; t < nthreads; t++) {
+      (void)pthread_join(threads[t], NULL);
+   }
+   clock_gettime(CLOCK_MONOTONIC, &t1);
+   double const sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+   PRINTF("%2u threads: %u ops in %.3fs, %.1f Mops/s\n", nthreads,
+          nthreads * MT_OPS, sec, nthreads * MT_OPS / sec / 1e6);
+   /* thread caches were flushed at thread exit */
+#ifdef HEAP_SLAB
+   /* but for the last slab of each size of each region */
+   U32 regions = 0;
+   for (heap const*r = H; NULL != r; r = r->next) {
+      regions++;
+   }
+   heap_stats st;
+   heap_get_stats(H, &st);
+   ASSERT(st.allocated <= regions * SLAB_CLASSES * SLAB_SIZE);
+   (void)regions;
+#else
+   void*const all = heap_alloc(H, H->hsize);
+   ASSERT(NULL != all);
+   heap_free(H, all);
+#endif
+}
+#endif
+/* -------------------------------------------------------------------------- */
 #ifdef MAX_PERF
 void *test_alloc(void *arg)
 {
@@ -185,7 +1695,7 @@ void *test_alloc(void *arg)
 #if 0
    for (i = 0; i < H->size >> 4; i++)
    {
-      heap_free(H,H->hdata + (i << 4));
+      heap_free(H,HDATA(H) + (i << 4));
    }
 #endif
 
@@ -202,7 +1712,143 @@ static void*memalign(U32 const alignmt, U32 const size)
    return ptr;
 }
 /* -------------------------------------------------------------------------- */
-   static U32 const base_size_list[BASE_SIZES_COUNT] = {
+#ifdef HEAP_ARENAS
+#define AR_PAIRS (4)
+#define AR_RING (256)
+#define AR_OPS (256*1024)
+typedef struct {
+   heap_arenas*A;
+   U8*_Atomic ring[AR_RING];
+   _Atomic U32 wr;
+   _Atomic U32 rd;
+} ar_pipe;
+/* allocates tagged blocks of 16..4096 bytes and hands them to the consumer */
+static void*test_arenas_producer(void*arg)
+{
+   ar_pipe*const p = (ar_pipe*)arg;
+   U32 x = (U32)(USZ)arg;
+   for (U32 i = 0; i < AR_OPS; i++) {
+      x = x * 1103515245U + 12345U;
+      USZ const sz = 16 + ((x >> 16) & 0xFF0U);
+      U8*const b = heap_arenas_alloc(p->A, sz);
+      ASSERT(NULL != b);
+      memset(b, (U8)i, sz);
+      U32 const w = atomic_load_explicit(&p->wr, memory_order_relaxed);
+      while (w - atomic_load_explicit(&p->rd, memory_order_acquire) == AR_RING) {
+         sched_yield();
+      }
+      atomic_store_explicit(&p->ring[w % AR_RING], b, memory_order_relaxed);
+      atomic_store_explicit(&p->wr, w + 1, memory_order_release);
+   }
+   return NULL;
+}
+/* -------------------------------------------------------------------------- */
+/* frees the producer's blocks (remote frees) and some blocks of its own */
+static void*test_arenas_consumer(void*arg)
+{
+   ar_pipe*const p = (ar_pipe*)arg;
+   void*own[16] = { NULL };
+   for (U32 i = 0; i < AR_OPS; i++) {
+      U32 const r = atomic_load_explicit(&p->rd, memory_order_relaxed);
+      while (atomic_load_explicit(&p->wr, memory_order_acquire) == r) {
+         sched_yield();
+      }
+      U8*const b = atomic_load_explicit(&p->ring[r % AR_RING], memory_order_relaxed);
+      atomic_store_explicit(&p->rd, r + 1, memory_order_release);
+      ASSERT(b[0] == (U8)i);
+      heap_arenas_free(p->A, b);
+      if (NULL != own[i & 15]) {
+         heap_arenas_free(p->A, own[i & 15]);
+      }
+      own[i & 15] = heap_arenas_alloc(p->A, 16 + (i & 0x1F0U));
+      ASSERT(NULL != own[i & 15]);
+   }
+   for (U32 i = 0; i < 16; i++) {
+      heap_arenas_free(p->A, own[i]);
+   }
+   return NULL;
+}
+/* -------------------------------------------------------------------------- */
+/* the set's only arena is taken: allocates from the overflow heap */
+static void*test_arenas_overflow(void*arg)
+{
+   heap_arenas*const B = (heap_arenas*)arg;
+   for (U32 i = 0; i < 1024; i++) {
+      U8*const b = heap_arenas_alloc(B, 16 + (i & 0xFF0U));
+      ASSERT(NULL != b);
+      ASSERT(b < B->hdata || b >= B->hdata + B->asize);
+      memset(b, (U8)i, 16);
+      heap_arenas_free(B, b);
+   }
+   ASSERT(NULL == arena_slot(B)->ar);
+   return NULL;
+}
+/* -------------------------------------------------------------------------- */
+static void test_arenas(void)
+{
+   const U32 SIZE = 256 * 1024 * 1024;
+   void *data = memalign(SIZE, SIZE);
+   heap_arenas*const A = heap_arenas_create(data, SIZE, 2 * AR_PAIRS);
+   ASSERT(NULL != A);
+   static ar_pipe pipes[AR_PAIRS];
+   pthread_t threads[2 * AR_PAIRS];
+   for (U32 t = 0; t < AR_PAIRS; t++) {
+      pipes[t].A = A;
+      atomic_init(&pipes[t].wr, 0);
+      atomic_init(&pipes[t].rd, 0);
+      if (0 != pthread_create(&threads[2 * t], NULL, test_arenas_producer, &pipes[t]) ||
+          0 != pthread_create(&threads[2 * t + 1], NULL, test_arenas_consumer, &pipes[t])) {
+         perror("pthread_create");
+         ASSERT(false);
+      }
+   }
+   for (U32 t = 0; t < 2 * AR_PAIRS; t++) {
+      (void)pthread_join(threads[t], NULL);
+   }
+   /* the owners are gone: free what they didn't get to collect */
+   for (U32 i = 0; i < A->count; i++) {
+      arena*const ar = &A->arenas[i];
+      ASSERT(NULL == ar->tls);
+      arena_drain_remote(ar);
+      void*const all = heap_alloc(ar->h, A->asize);
+      ASSERT(NULL != all);
+      heap_free(ar->h, all);
+   }
+   PRINTF("%u producer/consumer pairs exchanged %u blocks each.\n",
+          AR_PAIRS, AR_OPS);
+
+   /* alternating between two sets keeps the arena of each */
+   void*const bdata = memalign(SIZE / 16, SIZE / 16);
+   heap_arenas*const B = heap_arenas_create(bdata, SIZE / 16, 1);
+   ASSERT(NULL != B);
+   void*const a0 = heap_arenas_alloc(A, 64);
+   void*const b0 = heap_arenas_alloc(B, 64);
+   arena*const ara = arena_slot(A)->ar;
+   arena*const arb = arena_slot(B)->ar;
+   ASSERT(NULL != ara && &B->arenas[0] == arb);
+   for (U32 i = 0; i < 16; i++) {
+      heap_arenas_free(A, heap_arenas_alloc(A, 64));
+      heap_arenas_free(B, heap_arenas_alloc(B, 64));
+      ASSERT(arena_slot(A)->ar == ara && arena_slot(B)->ar == arb);
+   }
+   /* a thread beyond the count of arenas still allocates */
+   pthread_t t;
+   if (0 != pthread_create(&t, NULL, test_arenas_overflow, B)) {
+      perror("pthread_create");
+      ASSERT(false);
+   }
+   (void)pthread_join(t, NULL);
+   ASSERT(NULL != B->shared);
+   heap_arenas_free(A, a0);
+   heap_arenas_free(B, b0);
+   heap_arenas_destroy(B);
+   free(bdata);
+   heap_arenas_destroy(A);
+   free(data);
+}
+#endif
+/* -------------------------------------------------------------------------- */
+   static USZ const base_size_list[BASE_SIZES_COUNT] = {
       0x00000010U,0x00000020U,0x00000030U,0x00000040U,0x00000050U,0x00000060U,0x00000070U,
       0x00000080U,0x00000090U,0x000000A0U,0x000000B0U,0x000000C0U,0x000000D0U,0x000000E0U,
       0x000000F0U,0x00000100U,0x00000200U,0x00000300U,0x00000400U,0x00000500U,0x00000600U,
@@ -218,13 +1864,18 @@ static void*memalign(U32 const alignmt, U32 const size)
       0x0A000000U,0x0B000000U,0x0C000000U,0x0D000000U,0x0E000000U,0x0F000000U,0x10000000U,
       0x20000000U,0x30000000U,0x40000000U,0x50000000U,0x60000000U,0x70000000U,0x80000000U,
       0x90000000U,0xA0000000U,0xB0000000U,0xC0000000U,0xD0000000U,0xE0000000U,0xF0000000U,
+   #if BASE_SIZES_COUNT > 105
+      0x100000000U,0x200000000U,0x300000000U,0x400000000U,0x500000000U,0x600000000U,
+      0x700000000U,0x800000000U,0x900000000U,0xA00000000U,0xB00000000U,0xC00000000U,
+      0xD00000000U,0xE00000000U,0xF00000000U,
+   #endif
    };
 /* -------------------------------------------------------------------------- */
 static void closest_base_size_index_UT(void)
 {
    U32 idx = 0;
    /* very slow */
-   for (U32 i = 0; i < BASE_SIZE_MAX; i++) {
+   for (USZ i = 0; i < BASE_SIZE_MAX; i++) {
       ASSERT(closest_base_size(i) == base_size_list[idx]);
       if (i == base_size_list[idx]) ++idx;
    }
@@ -260,6 +1911,32 @@ static void __attribute((unused)) UT(void)
 /* -------------------------------------------------------------------------- */
 int main(int argc,char *argv[])
 {
+#ifdef HEAP_ARENAS
+   test_arenas();
+   return 0;
+#endif
+#ifdef HEAP_SLAB
+   test_slab();
+#endif
+#if defined(HEAP_THREAD_SAFE) || defined(HEAP_STRIPED)
+   {
+      const U32 SIZE = 1024 * 1024 * 1024;
+      void *data = memalign(SIZE, SIZE);
+      heap *H = heap_create(data, SIZE);
+      for (U32 n = 1; n <= MT_THREADS_MAX; n <<= 1) {
+         test_threads(H, n);
+      }
+      heap_destroy(H);
+      free(data);
+      /* threads running a 16MB heap out of memory: it grows, and gives its
+       * free 1MB chunks back to the OS */
+      H = heap_create(NULL, 16 * 1024 * 1024);
+      heap_set_growth(H, 16 * 1024 * 1024);
+      heap_set_release(H, 1024 * 1024, 0);
+      test_threads(H, 16);
+      heap_destroy(H);
+   }
+#endif
 #if 0
    U32 const SZ = 18*1024;
    void*const mem = memalign(64*1024, SZ);
@@ -313,6 +1990,27 @@ int main(int argc,char *argv[])
       #endif
    }
    test_mixed_sizes(H1);
+   test_realloc(H1);
+   test_calloc();
+   test_aligned_alloc(H1);
+   test_batch(H1);
+   test_free_sized(H1);
+   test_regions();
+   test_release();
+   test_stats();
+   test_alloc_at_least();
+   test_policy();
+   test_handles();
+   test_create_in();
+   test_unaligned();
+   #ifdef HEAP_SHARED
+   test_shared();
+   test_persistent();
+   #endif
+   test_walk();
+   #ifdef HEAP_TRACE
+   test_trace();
+   #endif
    test_alloc_all(H1, (16*4096)+(15*256)+16);
    test_alloc_all(H1, 16);
    test_alloc_all(H1, 24);
@@ -326,6 +2024,9 @@ int main(int argc,char *argv[])
    #endif
    test_alloc_all(H1, 16+256+4096);
    test_alloc_all(H1, 345);
+   #if MAIN_BASE_SIZE_COUNT > 7
+   test_large_heap();
+   #endif
    //test_alloc_inc(H1,16);
 #else
   #if 0